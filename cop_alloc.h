@@ -23,6 +23,7 @@
 
 #include "cop/cop_attributes.h"
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
 
 /***************************************************************************
@@ -39,8 +40,30 @@
  * how many pages can be locked. */
 size_t cop_memory_query_current_lockable();
 size_t cop_memory_query_page_size();
+
+/* Returns the size of the huge pages supported by the system or zero if the
+ * size is unknown or huge pages are not supported. */
+size_t cop_memory_query_huge_page_size();
 size_t cop_memory_query_system_memory();
 
+/* Returns the size of a cache line of the level one data cache in bytes. */
+size_t cop_cpu_query_cache_line_size();
+
+/* Returns the size in bytes of the data (or unified) cache of the given level
+ * (1, 2 or 3) which is seen by the first processor. */
+size_t cop_cpu_query_cache_size(unsigned level);
+
+/* Return the number of logical processors which are online, the number of
+ * physical cores they belong to and the number of logical processors which
+ * share each core (the number of SMT siblings, which is one when
+ * simultaneous multithreading is not in use). */
+unsigned cop_cpu_query_logical_cores();
+unsigned cop_cpu_query_physical_cores();
+unsigned cop_cpu_query_smt_siblings();
+
+/* All of the above CPU queries return zero if the value cannot be determined
+ * on the running system. */
+
 /***************************************************************************
  * ALLOCATOR INTERFACES
  ***************************************************************************/
@@ -58,6 +81,9 @@ struct cop_alloc_iface {
 	void *(*alloc)(struct cop_alloc_iface *a, size_t size, size_t align);
 };
 
+/* Optional members may be added to the end of this structure over time, so
+ * an implementation must zero the whole structure (e.g. with memset) before
+ * filling in the members it supports. */
 struct cop_salloc_iface {
 	struct cop_alloc_iface iface;
 
@@ -67,6 +93,29 @@ struct cop_salloc_iface {
 	 * the restore API to return to the state at which "save" as called. */
 	size_t (*save)(struct cop_salloc_iface *a);
 	void   (*restore)(struct cop_salloc_iface *a, size_t s);
+
+	/* "extend" attempts to resize the most recent allocation (which is
+	 * located at ptr and is old_size bytes long) to new_size bytes without
+	 * moving it. new_size may be smaller than old_size. The function returns
+	 * zero on success. On failure, non-zero is returned and the allocation is
+	 * unchanged. This member may be NULL if the allocator does not support
+	 * the operation. */
+	int    (*extend)(struct cop_salloc_iface *a, void *ptr, size_t old_size, size_t new_size);
+
+	/* "zalloc" behaves like alloc but the returned memory is zeroed. An
+	 * implementation can use this to avoid clearing memory which it knows
+	 * has never been written. This member may be NULL, in which case
+	 * cop_salloc_zalloc() clears the memory itself. */
+	void  *(*zalloc)(struct cop_salloc_iface *a, size_t size, size_t align);
+};
+
+struct cop_falloc_iface {
+	struct cop_alloc_iface iface;
+
+	/* "free" returns memory which was obtained from the alloc function of
+	 * this interface back to the allocator so that it can be reused. ptr may
+	 * be NULL in which case the call does nothing. */
+	void (*free)(struct cop_falloc_iface *a, void *ptr);
 };
 
 /* The following functions are provided for convenience in using the allocator
@@ -94,6 +143,92 @@ static COP_ATTR_ALWAYSINLINE void cop_salloc_restore(struct cop_salloc_iface *if
 	assert(iface->restore != NULL);
 	iface->restore(iface, sz);
 }
+static COP_ATTR_ALWAYSINLINE int cop_salloc_extend(struct cop_salloc_iface *iface, void *ptr, size_t old_size, size_t new_size)
+{
+	assert(iface != NULL);
+	if (iface->extend == NULL)
+		return -1;
+	return iface->extend(iface, ptr, old_size, new_size);
+}
+static COP_ATTR_ALWAYSINLINE void *cop_salloc_zalloc(struct cop_salloc_iface *iface, size_t size, size_t align)
+{
+	void *p;
+	assert(iface != NULL);
+	if (iface->zalloc != NULL)
+		return iface->zalloc(iface, size, align);
+	if ((p = cop_alloc(&(iface->iface), size, align)) != NULL)
+		memset(p, 0, size);
+	return p;
+}
+static COP_ATTR_ALWAYSINLINE void *cop_falloc(struct cop_falloc_iface *iface, size_t size, size_t align)
+{
+	assert(iface != NULL);
+	return cop_alloc(&(iface->iface), size, align);
+}
+static COP_ATTR_ALWAYSINLINE void cop_falloc_free(struct cop_falloc_iface *iface, void *ptr)
+{
+	assert(iface != NULL);
+	assert(iface->free != NULL);
+	iface->free(iface, ptr);
+}
+
+/***************************************************************************
+ * ALLOCATOR STATISTICS
+ ***************************************************************************/
+
+/* The allocator implementations only maintain the counters marked as
+ * optional below when COP_ALLOC_STATS is defined to a non-zero value (see
+ * the COP_ALLOC_STATS CMake option). When it is not defined, the counters
+ * do not exist, cost nothing and are reported as zero. */
+struct cop_alloc_stats {
+	size_t used;            /* bytes currently allocated including padding */
+	size_t committed;       /* bytes currently obtained from the system */
+	size_t nb_commits;      /* commit calls made to the system (virtual only) */
+
+	/* Optional counters. */
+	size_t nb_allocs;       /* successful allocations */
+	size_t bytes_requested; /* sum of the sizes of successful allocations */
+	size_t bytes_padding;   /* bytes lost to alignment padding */
+	size_t peak_used;       /* highest value of used */
+	size_t nb_decommits;    /* decommit calls made to the system (virtual only) */
+	size_t nb_chunk_allocs; /* chunks obtained from malloc (group temps only) */
+	size_t nb_chunk_frees;  /* chunks returned to free (group temps only) */
+	size_t bytes_zeroed;    /* bytes cleared by zalloc (virtual only) */
+};
+
+/***************************************************************************
+ * MEMORY BUDGETS
+ ***************************************************************************/
+
+/* A budget limits the number of bytes which allocators may obtain from the
+ * system. The virtual allocator charges committed pages and the group
+ * temporaries allocator charges the chunks it holds (including those in its
+ * cache). Several allocators may share a budget and budgets may be grouped by
+ * giving them a parent: every charge applies to the budget and all of its
+ * ancestors, so a process-wide limit can be placed above per-allocator ones.
+ * The counters are atomic and budgets may be shared between threads.
+ *
+ * A limit of zero means no limit. When a charge would take a budget over its
+ * hard limit, the charge fails and the allocation which needed the memory
+ * returns NULL without changing the allocator. When a charge takes a budget
+ * from at or below its soft limit to above it, on_soft (if not NULL) is
+ * called with the context, the budget and its new usage. The callback runs
+ * on the thread which made the allocation, from inside the allocator, so it
+ * must not allocate from that allocator. It is called again only after usage
+ * has dropped back to the soft limit and crossed it once more. */
+struct cop_alloc_budget;
+
+typedef void (*cop_alloc_budget_fn)(void *context, struct cop_alloc_budget *budget, size_t used);
+
+void   cop_alloc_budget_init(struct cop_alloc_budget *budget, struct cop_alloc_budget *parent, size_t soft_limit, size_t hard_limit, cop_alloc_budget_fn on_soft, void *context);
+size_t cop_alloc_budget_used(struct cop_alloc_budget *budget);
+
+/* Charge or release bytes directly. These are used by the allocators in this
+ * library and may be used to account for other memory. cop_alloc_budget_charge
+ * returns zero on success or non-zero if a hard limit would be exceeded, in
+ * which case nothing is charged. */
+int    cop_alloc_budget_charge(struct cop_alloc_budget *budget, size_t sz);
+void   cop_alloc_budget_release(struct cop_alloc_budget *budget, size_t sz);
 
 /***************************************************************************
  * ALLOCATOR IMPLEMENTATIONS
@@ -111,22 +246,305 @@ int cop_alloc_grp_temps_init(struct cop_alloc_grp_temps *gat, struct cop_salloc_
 /* Free all memory associated with a group allocator. */
 void cop_alloc_grp_temps_free(struct cop_alloc_grp_temps *gat);
 
+/* Set the maximum number of bytes of chunks which are kept for reuse after a
+ * restore releases them. Without the cache, a save/alloc/restore loop which
+ * crosses a chunk boundary would call malloc and free on every iteration.
+ * The default is the max_grow value given at initialisation. Setting zero
+ * disables the cache. */
+void cop_alloc_grp_temps_set_cache(struct cop_alloc_grp_temps *gat, size_t max_bytes);
+
+/* Attach a budget to the allocator (or detach it by passing NULL). The memory
+ * currently held is moved from the old budget to the new one; this move
+ * ignores the hard limit. */
+void cop_alloc_grp_temps_set_budget(struct cop_alloc_grp_temps *gat, struct cop_alloc_budget *budget);
+
+/* Fill stats with the current statistics of the group allocator. */
+void cop_alloc_grp_temps_get_stats(const struct cop_alloc_grp_temps *gat, struct cop_alloc_stats *stats);
+
 struct cop_alloc_virtual;
 
 int cop_alloc_virtual_init(struct cop_alloc_virtual *s, struct cop_salloc_iface *iface, size_t reserve_sz, size_t default_align, size_t grow_sz);
 void cop_alloc_virtual_free(struct cop_alloc_virtual *s);
 
+/* Request that the arena be backed by huge pages. On Linux, MAP_HUGETLB is
+ * used if the huge page pool can back the entire reservation. Otherwise, the
+ * reservation is aligned to the huge page size and advised for transparent
+ * huge pages. If neither is possible, normal pages are used - the flag never
+ * causes initialisation to fail. When huge pages are obtained, the reserve
+ * and grow sizes are rounded up to multiples of the huge page size. */
+#define COP_ALLOC_VIRTUAL_FLAG_HUGEPAGES    (0x1)
+
+/* Fault in every page as it is committed and lock the pages into physical
+ * memory while the amount locked stays within the budget given by
+ * cop_memory_query_current_lockable() at initialisation. Once the budget runs
+ * out (or the system refuses to lock more pages), later commits are still
+ * faulted in but are not locked; cop_alloc_virtual_lock_status() reports
+ * when this has happened. Locking resumes if a decommit (see
+ * cop_alloc_virtual_set_decommit()) later unlocks pages. Together with
+ * cop_alloc_virtual_precommit(), this permits real-time threads to allocate
+ * without ever taking a page fault. */
+#define COP_ALLOC_VIRTUAL_FLAG_LOCKED       (0x2)
+
+/* Values returned by cop_alloc_virtual_page_kind(). */
+#define COP_ALLOC_VIRTUAL_PAGES_NORMAL      (0)
+#define COP_ALLOC_VIRTUAL_PAGES_TRANSPARENT (1) /* advised for transparent huge pages; the kernel decides whether to use them */
+#define COP_ALLOC_VIRTUAL_PAGES_HUGETLB     (2) /* backed by reserved huge pages */
+
+/* Same as cop_alloc_virtual_init() but accepts COP_ALLOC_VIRTUAL_FLAG_*
+ * flags. */
+int cop_alloc_virtual_init_ex(struct cop_alloc_virtual *s, struct cop_salloc_iface *iface, size_t reserve_sz, size_t default_align, size_t grow_sz, unsigned flags);
+
+/* Set a policy for giving committed memory back to the system when the arena
+ * is restored. Memory is only released once nb_restores consecutive restores
+ * have seen the arena using less than low_percent percent of its committed
+ * memory; the pages above the highest usage seen during those restores
+ * (rounded up to the grow size) are then decommitted. Setting nb_restores to
+ * zero disables the policy, which is the default. */
+void cop_alloc_virtual_set_decommit(struct cop_alloc_virtual *s, unsigned low_percent, unsigned nb_restores);
+
+/* Growth policies for cop_alloc_virtual_set_growth(). With the linear
+ * policy (the default), the committed region grows by grow_sz bytes at a
+ * time. With the geometric policy, it grows by the amount which is already
+ * committed (doubling it) and the capped geometric policy does the same but
+ * never grows by more than max_step bytes at once. A growth always commits
+ * at least enough memory to satisfy the allocation which caused it. */
+#define COP_ALLOC_VIRTUAL_GROW_LINEAR           (0)
+#define COP_ALLOC_VIRTUAL_GROW_GEOMETRIC        (1)
+#define COP_ALLOC_VIRTUAL_GROW_CAPPED_GEOMETRIC (2)
+
+void cop_alloc_virtual_set_growth(struct cop_alloc_virtual *s, unsigned policy, size_t max_step);
+
+/* Returns the number of system calls which have been made to commit memory
+ * to the arena. */
+size_t cop_alloc_virtual_commit_count(const struct cop_alloc_virtual *s);
+
+/* Fill stats with the current statistics of the arena. For a concurrent
+ * arena, the values are only a snapshot. */
+void cop_alloc_virtual_get_stats(const struct cop_alloc_virtual *s, struct cop_alloc_stats *stats);
+
+/* Commit (and for locked arenas, fault in and lock) enough pages for the
+ * arena to hold at least sz bytes without committing any more memory.
+ * Returns zero on success. */
+int cop_alloc_virtual_precommit(struct cop_alloc_virtual *s, size_t sz);
+
+/* Returns non-zero if any committed pages of a locked arena could not be
+ * locked. If p_locked is not NULL, it receives the number of bytes currently
+ * locked. */
+int cop_alloc_virtual_lock_status(const struct cop_alloc_virtual *s, size_t *p_locked);
+
+/* Get the size and kind of the pages which back the arena. */
+size_t   cop_alloc_virtual_page_size(const struct cop_alloc_virtual *s);
+unsigned cop_alloc_virtual_page_kind(const struct cop_alloc_virtual *s);
+
+/* Attach a budget to the arena (or detach it by passing NULL). The committed
+ * memory is moved from the old budget to the new one; this move ignores the
+ * hard limit. When the usual growth step would exceed a hard limit, only the
+ * pages which are required are committed. This must not be called while
+ * other threads are allocating from a concurrent arena. */
+void cop_alloc_virtual_set_budget(struct cop_alloc_virtual *s, struct cop_alloc_budget *budget);
+
+/* Write the used region of the arena (from its base up to the current
+ * allocation position) to a file using cop_file_dump(). The file may later be
+ * mapped with cop_filemap_open_at() (read-only, or copy-on-write by passing
+ * COP_FILEMAP_FLAG_W without COP_FILEMAP_SHARED) to get the data structures
+ * back without rebuilding them. If the snapshot is mapped at the address
+ * returned by cop_alloc_virtual_base() when it was written (see
+ * COP_FILEMAP_FLAG_FIXED), pointers within it are valid immediately.
+ * Otherwise they must be moved with cop_alloc_snapshot_relocate(), which
+ * requires a writable mapping. A simple way to find the original base is to
+ * make the first allocation in the arena a root object which stores its own
+ * address. The function returns zero on success. */
+int   cop_alloc_virtual_snapshot(const struct cop_alloc_virtual *s, const char *filename);
+void *cop_alloc_virtual_base(const struct cop_alloc_virtual *s);
+
+/* Add delta to each of the nb_fixups pointers stored in image at the byte
+ * offsets given in fixup_offsets. NULL pointers are left alone. Offsets
+ * rather than pointers are used so that the table itself can be stored in
+ * the snapshot. */
+void  cop_alloc_snapshot_relocate(void *image, const size_t *fixup_offsets, size_t nb_fixups, ptrdiff_t delta);
+
+/* Initialise a virtual allocator which may be used by many threads at once.
+ * Allocations claim space with an atomic update and only one thread at a
+ * time will commit more pages; threads which need memory that is being
+ * committed by another thread spin until it is available. The save and
+ * restore functions of the interface are not thread-safe and may only be
+ * used while no other thread is allocating. If the allocation function
+ * fails because pages could not be committed, the claimed space is lost
+ * until the allocator is restored to a point before it. The allocator is
+ * released using cop_alloc_virtual_free(). */
+int cop_alloc_virtual_init_concurrent(struct cop_alloc_virtual *s, struct cop_salloc_iface *iface, size_t reserve_sz, size_t default_align, size_t grow_sz);
+
+/* A mirrored allocation maps the same physical pages at two adjacent address
+ * ranges so that base[i] and base[i + size] are the same byte for i in
+ * [0, size). Data which wraps around the end of a ring buffer placed in the
+ * first range can then be accessed as one contiguous span (see cop_ring.h).
+ * The requested size is rounded up to a multiple of the page size (the
+ * allocation granularity on Windows); the final size and the base address
+ * are available via the functions below. The function returns zero on
+ * success. */
+struct cop_alloc_mirror;
+
+int            cop_alloc_mirror_init(struct cop_alloc_mirror *m, size_t size);
+void           cop_alloc_mirror_free(struct cop_alloc_mirror *m);
+unsigned char *cop_alloc_mirror_base(const struct cop_alloc_mirror *m);
+size_t         cop_alloc_mirror_size(const struct cop_alloc_mirror *m);
+
+/* A shared arena is a block of shared memory which can be mapped by several
+ * processes at once. Allocations are made with a bump pointer which lives in
+ * the shared memory and is updated atomically, so any attached process may
+ * allocate. Memory is only released when the arena is destroyed. As each
+ * process maps the arena at a different address, blocks should be passed
+ * between processes as offsets using cop_alloc_shared_offset() and
+ * cop_alloc_shared_ptr().
+ *
+ * cop_alloc_shared_create() creates an arena able to hold size bytes. If
+ * name is NULL, the memory is anonymous (memfd_create where available) and
+ * can be passed to another process by sharing the file descriptor from
+ * cop_alloc_shared_fd() (e.g. over a UNIX socket or by forking) which then
+ * calls cop_alloc_shared_attach_fd(). Otherwise name identifies a POSIX
+ * shared memory object (it must begin with a '/') or a Windows named file
+ * mapping which other processes pass to cop_alloc_shared_attach(). Creating
+ * a name which already exists fails. All functions which return int return
+ * zero on success.
+ *
+ * cop_alloc_shared_attach_fd() takes ownership of fd when it succeeds: the
+ * descriptor is closed by cop_alloc_shared_detach(), so pass a dup() of it
+ * if it is still needed afterwards. If attaching fails, fd is left open and
+ * still belongs to the caller.
+ *
+ * cop_alloc_shared_detach() unmaps the arena from the calling process; the
+ * memory is released once every process has detached and the name (if
+ * any) has been removed with cop_alloc_shared_unlink(). The name may be
+ * unlinked as soon as all processes have attached. */
+struct cop_alloc_shared;
+
+int  cop_alloc_shared_create(struct cop_alloc_shared *sh, struct cop_alloc_iface *iface, const char *name, size_t size);
+int  cop_alloc_shared_attach(struct cop_alloc_shared *sh, struct cop_alloc_iface *iface, const char *name);
+void cop_alloc_shared_detach(struct cop_alloc_shared *sh);
+int  cop_alloc_shared_unlink(const char *name);
+#if !_WIN32
+int  cop_alloc_shared_attach_fd(struct cop_alloc_shared *sh, struct cop_alloc_iface *iface, int fd);
+int  cop_alloc_shared_fd(const struct cop_alloc_shared *sh);
+#endif
+
+/* Direct allocation functions which avoid the indirect call made through the
+ * allocator interface. cop_alloc_virtual_alloc_fast() and
+ * cop_alloc_grp_temps_alloc_fast() are defined inline at the end of this
+ * header: they align and bump the cursor against the committed limit (or
+ * the end of the head chunk) and only call the out-of-line function when
+ * pages must be committed or a new chunk obtained. They behave exactly as
+ * the alloc function of the interface and may be mixed freely with it and
+ * with save/restore. They must not be used with a concurrent virtual
+ * allocator. When COP_ALLOC_STATS is enabled, every call takes the
+ * out-of-line path so that the counters are kept. */
+void *cop_alloc_virtual_alloc(struct cop_alloc_virtual *s, size_t size, size_t align);
+void *cop_alloc_grp_temps_alloc(struct cop_alloc_grp_temps *gat, size_t size, size_t align);
+
+/* A slab allocator hands out fixed-size objects and supports freeing them in
+ * constant time. Freed objects are kept on an intrusive free list and are
+ * reused by later allocations. Slabs holding objs_per_slab objects are taken
+ * from the parent allocator or, if parent is NULL, from malloc. Memory taken
+ * from a parent is never returned to it by the slab allocator; the caller
+ * should restore or free the parent once the slab allocator is no longer
+ * needed.
+ *
+ * Requests made through the interface must be for no more than obj_sz bytes
+ * and for an alignment no greater than obj_align (zero selects obj_align).
+ * Requests outside of these limits will fail. If obj_align is zero, a
+ * default alignment of 16 bytes is used. The function returns zero on
+ * success. */
+struct cop_alloc_slab;
+
+int cop_alloc_slab_init(struct cop_alloc_slab *slab, struct cop_falloc_iface *iface, struct cop_alloc_iface *parent, size_t obj_sz, size_t obj_align, size_t objs_per_slab);
+
+/* Free all slabs which were obtained from malloc. Slabs taken from a parent
+ * allocator are not touched. */
+void cop_alloc_slab_free(struct cop_alloc_slab *slab);
+
+/* A two-level segregated fit (TLSF) allocator manages a single region of
+ * memory and supports allocating and freeing blocks of any size in bounded
+ * time: neither operation contains a loop which depends on the number or
+ * size of the blocks in the region. This makes it usable from real-time
+ * threads where malloc cannot be called.
+ *
+ * The region of pool_sz bytes is taken from the parent allocator (for
+ * example, the interface of a cop_alloc_virtual which has been precommitted)
+ * or, if parent is NULL, from malloc. Like the slab allocator, memory taken
+ * from a parent is never returned to it. Every block carries a header of two
+ * pointers and the smallest alignment given out is twice the size of a
+ * pointer; an alignment of zero selects it. Larger power-of-two alignments
+ * are supported. The function returns zero on success. */
+struct cop_alloc_tlsf;
+
+int cop_alloc_tlsf_init(struct cop_alloc_tlsf *tlsf, struct cop_falloc_iface *iface, struct cop_alloc_iface *parent, size_t pool_sz);
+
+/* Free the region if it was obtained from malloc. */
+void cop_alloc_tlsf_free(struct cop_alloc_tlsf *tlsf);
+
+/* Get the number of bytes in the region which are not currently free. This
+ * includes the block headers. */
+size_t cop_alloc_tlsf_used(const struct cop_alloc_tlsf *tlsf);
+
+/* A pool of per-thread virtual allocators is declared in cop_alloc_tls_pool.h
+ * so that this header does not depend on cop_thread.h. */
+
 /* ---------------------------------------------------------------------------
  * Private parts - defined so you can put them on the stack, not so you can
  * touch their bits. */
 
+struct cop_alloc_budget {
+	size_t                   used;
+	size_t                   soft_limit;
+	size_t                   hard_limit;
+	cop_alloc_budget_fn      on_soft;
+	void                    *context;
+	struct cop_alloc_budget *parent;
+};
+
 struct cop_alloc_virtual {
 	size_t         reserve_sz;
 	size_t         grow_sz;
+	size_t         grow_max;    /* largest step for the capped geometric policy */
+	unsigned       grow_policy;
+	size_t         nb_commits;
 	size_t         protect_sz;
 	size_t         used_sz;
+	size_t         zero_sz;     /* committed memory at and above this offset is known to be zero */
 	size_t         default_align;
+	size_t         committing; /* non-zero while a concurrent commit is in progress */
+	size_t         page_sz;
+	unsigned       page_kind;
+	unsigned       flags;
+	unsigned       dc_percent;  /* decommit low water mark as a percentage of protect_sz */
+	unsigned       dc_restores; /* number of low restores required before decommitting */
+	unsigned       dc_count;    /* number of consecutive low restores */
+	size_t         dc_peak;     /* highest usage seen during the low restores */
+	size_t         lock_budget;
+	size_t         locked_sz;
+	int            lock_exhausted;
+	unsigned char *base;
+	struct cop_alloc_budget *budget;
+#if COP_ALLOC_STATS
+	struct cop_alloc_stats stats;
+#endif
+};
+
+struct cop_alloc_mirror {
 	unsigned char *base;
+	size_t         size;
+#if _WIN32
+	void          *mapping;
+#endif
+};
+
+struct cop_alloc_shared {
+	unsigned char *base;
+	size_t         size;
+#if _WIN32
+	void          *handle;
+#else
+	int            fd;
+#endif
 };
 
 struct cop_alloc_grp_temps_buf {
@@ -139,6 +557,95 @@ struct cop_alloc_grp_temps {
 	size_t                          max_grow;
 	size_t                          pre_head_size; /* sum of size members of all buffers before head */
 	struct cop_alloc_grp_temps_buf *head;
+	struct cop_alloc_grp_temps_buf *cache;     /* released chunks linked by prev */
+	size_t                          cache_sz;  /* sum of alloc_sz of cached chunks */
+	size_t                          cache_max;
+	struct cop_alloc_budget        *budget;
+#if COP_ALLOC_STATS
+	struct cop_alloc_stats          stats;
+#endif
+};
+
+struct cop_alloc_slab {
+	size_t                  obj_sz;
+	size_t                  obj_align;
+	size_t                  slab_sz;   /* bytes of objects per slab */
+	struct cop_alloc_iface *parent;
+	void                   *free_list;
+	unsigned char          *cur;       /* next never-used object in the current slab */
+	unsigned char          *end;       /* end of the current slab */
+	void                   *slabs;     /* list of slabs obtained from malloc */
 };
 
+/* Blocks are classified into first-level lists by the position of their most
+ * significant bit and then linearly into COP_ALLOC_TLSF_SL_COUNT second-level
+ * lists. Blocks smaller than 1 << COP_ALLOC_TLSF_FL_SHIFT all go into the
+ * first first-level list. */
+#define COP_ALLOC_TLSF_ALIGN    (2 * sizeof(void *))
+#define COP_ALLOC_TLSF_SL_LOG2  (5)
+#define COP_ALLOC_TLSF_SL_COUNT (1 << COP_ALLOC_TLSF_SL_LOG2)
+#define COP_ALLOC_TLSF_FL_SHIFT (COP_ALLOC_TLSF_SL_LOG2 + ((sizeof(void *) > 4) ? 4 : 3))
+#define COP_ALLOC_TLSF_FL_MAX   ((sizeof(size_t) > 4) ? 38 : 30)
+#define COP_ALLOC_TLSF_FL_COUNT (COP_ALLOC_TLSF_FL_MAX - COP_ALLOC_TLSF_FL_SHIFT + 1)
+
+struct cop_alloc_tlsf_block;
+
+struct cop_alloc_tlsf {
+	unsigned                     fl_bitmap;
+	unsigned                     sl_bitmap[COP_ALLOC_TLSF_FL_COUNT];
+	struct cop_alloc_tlsf_block *blocks[COP_ALLOC_TLSF_FL_COUNT][COP_ALLOC_TLSF_SL_COUNT];
+	size_t                       free_sz;   /* bytes in free blocks including headers */
+	size_t                       pool_sz;
+	void                        *malloc_mem;
+};
+
+
+/* ---------------------------------------------------------------------------
+ * Inline functions - the allocation fast paths (see cop_alloc_virtual_alloc())
+ * and the shared arena offset conversions. */
+
+static COP_ATTR_ALWAYSINLINE void *cop_alloc_virtual_alloc_fast(struct cop_alloc_virtual *s, size_t size, size_t align)
+{
+#if !COP_ALLOC_STATS
+	size_t offset;
+	align  = (align == 0) ? s->default_align : align;
+	offset = s->used_sz + (((size_t)0 - ((size_t)s->base + s->used_sz)) & (align - 1));
+	if (offset <= s->protect_sz && size <= s->protect_sz - offset) {
+		s->used_sz = offset + size;
+		return s->base + offset;
+	}
+#endif
+	return cop_alloc_virtual_alloc(s, size, align);
+}
+
+static COP_ATTR_ALWAYSINLINE void *cop_alloc_grp_temps_alloc_fast(struct cop_alloc_grp_temps *gat, size_t size, size_t align)
+{
+#if !COP_ALLOC_STATS
+	struct cop_alloc_grp_temps_buf *head = gat->head;
+	unsigned char                  *data = (unsigned char *)(head + 1);
+	size_t                          start;
+	align = (align == 0) ? gat->default_align : align;
+	start = head->size + (((size_t)0 - ((size_t)data + head->size)) & (align - 1));
+	if (start <= head->alloc_sz && size <= head->alloc_sz - start) {
+		head->size = start + size;
+		return data + start;
+	}
+#endif
+	return cop_alloc_grp_temps_alloc(gat, size, align);
+}
+
+/* Convert between pointers into a shared arena and offsets which have the
+ * same meaning in every process which has the arena attached. */
+static COP_ATTR_UNUSED size_t cop_alloc_shared_offset(const struct cop_alloc_shared *sh, const void *ptr)
+{
+	assert((const unsigned char *)ptr >= sh->base && (const unsigned char *)ptr <= sh->base + sh->size);
+	return (size_t)((const unsigned char *)ptr - sh->base);
+}
+
+static COP_ATTR_UNUSED void *cop_alloc_shared_ptr(const struct cop_alloc_shared *sh, size_t offset)
+{
+	assert(offset <= sh->size);
+	return sh->base + offset;
+}
+
 #endif /* COP_ALLOC_H */
@@ -0,0 +1,104 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+/* C Compiler, OS and Platform Abstractions - Thread-Local Allocator Pool.
+ *
+ * The pool is not available on Windows as cop_thread.h does not implement
+ * thread-local storage keys with destructors there. */
+
+#ifndef COP_ALLOC_TLS_POOL_H
+#define COP_ALLOC_TLS_POOL_H
+
+#include "cop/cop_alloc.h"
+#include "cop/cop_thread.h"
+
+#if !_WIN32
+
+/* A thread-local pool hands out one virtual allocator per thread. Each thread
+ * which calls cop_alloc_tls_pool_get() lazily receives its own arena; the
+ * returned interface may then be used by that thread without any locking.
+ * When a thread exits (or calls cop_alloc_tls_pool_release()), its arena is
+ * reset and placed on a free list to be handed to the next thread which
+ * needs one - the address space reservation is never released until the
+ * pool is destroyed. */
+struct cop_alloc_tls_pool;
+
+struct cop_alloc_tls_pool_usage {
+	size_t nb_arenas;  /* number of arenas which have been created */
+	size_t nb_active;  /* number of arenas currently owned by a thread */
+	size_t reserved;   /* total bytes of address space reserved */
+	size_t committed;  /* total bytes committed to memory */
+	size_t used;       /* total bytes allocated */
+};
+
+/* Initialise a thread-local pool. reserve_sz, default_align and grow_sz are
+ * used to initialise each per-thread arena using cop_alloc_virtual_init().
+ * Returns zero on success. */
+int cop_alloc_tls_pool_init(struct cop_alloc_tls_pool *pool, size_t reserve_sz, size_t default_align, size_t grow_sz);
+
+/* Destroy the pool and release all arenas. No thread may be using an arena
+ * obtained from the pool when this is called. */
+void cop_alloc_tls_pool_free(struct cop_alloc_tls_pool *pool);
+
+/* Get the allocator for the calling thread, creating or recycling an arena if
+ * the thread does not yet have one. Returns NULL if an arena could not be
+ * created. The returned pointer remains valid until the thread exits or
+ * calls cop_alloc_tls_pool_release() - callers on hot paths should hold on to
+ * it rather than calling this function for every allocation. */
+struct cop_salloc_iface *cop_alloc_tls_pool_get(struct cop_alloc_tls_pool *pool);
+
+/* Return the calling thread's arena (if it has one) to the pool. All memory
+ * allocated from it by the thread is invalidated. This does not need to be
+ * called by threads which are about to exit. */
+void cop_alloc_tls_pool_release(struct cop_alloc_tls_pool *pool);
+
+/* Obtain aggregate usage figures for all arenas in the pool. May be called
+ * from any thread. Each arena's used and committed sizes are published with
+ * atomic stores by its owner after every operation, so the figures are only a
+ * snapshot as threads may be allocating while the query runs. */
+void cop_alloc_tls_pool_query(struct cop_alloc_tls_pool *pool, struct cop_alloc_tls_pool_usage *usage);
+
+/* ---------------------------------------------------------------------------
+ * Private parts - defined so you can put them on the stack, not so you can
+ * touch their bits. */
+
+struct cop_alloc_tls_pool_arena {
+	struct cop_alloc_virtual         mem;
+	struct cop_salloc_iface          iface;        /* given to the owner */
+	struct cop_salloc_iface          inner;        /* interface of mem */
+	size_t                           used_sz;      /* published copy */
+	size_t                           committed_sz; /* published copy */
+	struct cop_alloc_tls_pool       *pool;
+	struct cop_alloc_tls_pool_arena *next;         /* next arena in the pool */
+	struct cop_alloc_tls_pool_arena *next_free;    /* next in the free list */
+};
+struct cop_alloc_tls_pool {
+	size_t                           reserve_sz;
+	size_t                           default_align;
+	size_t                           grow_sz;
+	cop_tlskey                       key;
+	cop_mutex                        lock;
+	struct cop_alloc_tls_pool_arena *arenas;
+	struct cop_alloc_tls_pool_arena *free_list;
+};
+
+#endif
+
+#endif /* COP_ALLOC_TLS_POOL_H */
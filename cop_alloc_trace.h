@@ -0,0 +1,119 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+/* C Compiler, OS and Platform Abstractions - Allocation Tracing.
+ *
+ * A tracing wrapper sits between the users of a stack allocator interface
+ * and the allocator and records every alloc, save, restore and extend into
+ * a compact binary file. A general allocator interface can be wrapped in the
+ * same way, in which case only allocations are recorded. The trace can be decoded and replayed against the
+ * allocator implementations to tune their parameters (see the
+ * cop_alloc_replay tool in the tests directory).
+ *
+ * Recording is only compiled in when COP_ALLOC_TRACE is defined to a non-zero
+ * value (see the COP_ALLOC_TRACE CMake option). Otherwise, the open
+ * functions simply copy the target interface so that the
+ * wrapper costs nothing and cop_alloc_trace_close() does nothing. Decoding is
+ * always available.
+ *
+ * File format: the 8 byte magic "COPTRC1" (including the terminator)
+ * followed by events. Each event starts with a byte holding the event type
+ * and is followed by unsigned LEB128 encoded arguments:
+ *
+ *   ALLOC   size, align            (align of zero is the default)
+ *   ZALLOC  size, align
+ *   SAVE                           (saves are numbered from zero in order)
+ *   RESTORE distance               (number of the save restored to is
+ *                                   saves so far - 1 - distance)
+ *   EXTEND  old size, new size     (of the most recent allocation)
+ *   RESTORE_START                  (restore to a point which was not saved
+ *                                   through the wrapper, such as zero;
+ *                                   replayed as a restore to the start.
+ *                                   Later restores to earlier saves are
+ *                                   recorded the same way)
+ *
+ * If the wrapper runs out of memory to track saves, it writes an invalid
+ * event so that decoding the trace fails rather than giving wrong restores. */
+
+#ifndef COP_ALLOC_TRACE_H
+#define COP_ALLOC_TRACE_H
+
+#include "cop/cop_alloc.h"
+#include <stdio.h>
+
+#define COP_ALLOC_TRACE_ALLOC         (1)
+#define COP_ALLOC_TRACE_ZALLOC        (2)
+#define COP_ALLOC_TRACE_SAVE          (3)
+#define COP_ALLOC_TRACE_RESTORE       (4)
+#define COP_ALLOC_TRACE_EXTEND        (5)
+#define COP_ALLOC_TRACE_RESTORE_START (6)
+
+struct cop_alloc_trace_event {
+	unsigned type;
+	size_t   size;     /* ALLOC, ZALLOC: size. EXTEND: new size */
+	size_t   align;    /* ALLOC, ZALLOC */
+	size_t   old_size; /* EXTEND */
+	size_t   save_id;  /* SAVE: number of this save. RESTORE: number of the save */
+};
+
+/* Start recording operations made through traced into filename. Operations
+ * are forwarded to target. Returns zero on success. */
+struct cop_alloc_trace;
+int  cop_alloc_trace_open(struct cop_alloc_trace *trace, struct cop_salloc_iface *traced, struct cop_salloc_iface *target, const char *filename);
+
+/* The same for a general allocator interface. Only ALLOC events are
+ * recorded (there is no way to see memory being returned through the
+ * interface), so a replay gives the peak commit for the allocations never
+ * being released. */
+int  cop_alloc_trace_open_alloc(struct cop_alloc_trace *trace, struct cop_alloc_iface *traced, struct cop_alloc_iface *target, const char *filename);
+
+/* Flush and close the trace file. traced must not be used afterwards. */
+void cop_alloc_trace_close(struct cop_alloc_trace *trace);
+
+/* Decode the next event from a trace held in memory. *p_pos should start at
+ * zero (the magic is checked and skipped) and *p_nb_saves at zero; both are
+ * updated as events are decoded. Returns 1 if an event was decoded, 0 at the
+ * end of the trace or -1 if the trace is invalid. */
+int  cop_alloc_trace_decode(const unsigned char *buf, size_t size, size_t *p_pos, size_t *p_nb_saves, struct cop_alloc_trace_event *event);
+
+/* ---------------------------------------------------------------------------
+ * Private parts - defined so you can put them on the stack, not so you can
+ * touch their bits. */
+
+struct cop_alloc_trace_save {
+	size_t value; /* returned by the target */
+	size_t id;
+};
+
+struct cop_alloc_trace {
+#if COP_ALLOC_TRACE
+	FILE                        *f;
+	struct cop_alloc_iface      *alloc_target;
+	struct cop_salloc_iface     *target; /* NULL for a general allocator */
+	size_t                       nb_saves;
+	struct cop_alloc_trace_save *stack;
+	size_t                       stack_sz;
+	size_t                       stack_cap;
+#else
+	int                          unused;
+#endif
+};
+
+#endif /* COP_ALLOC_TRACE_H */
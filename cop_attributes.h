@@ -46,7 +46,10 @@
  *                     conditional argument. The macro will always return the
  *                     result of the condition. It will indicate to supporting
  *                     compilers that the condition is likely to evaluate to
- *                     zero. */
+ *                     zero.
+ *   COP_HINT_PREFETCH(ptr) Ask supporting platforms to start loading the
+ *                     cache line containing ptr for reading. The pointer is
+ *                     never dereferenced by the macro and may be invalid. */
 
 #ifndef COP_ATTRIBUES_H
 #define COP_ATTRIBUES_H
@@ -62,6 +65,7 @@
 #define COP_ATTR_ALWAYSINLINE   __inline__ __attribute__((always_inline))
 #define COP_ATTR_NOINLINE       __attribute__((noinline))
 #define COP_HINT_FALSE(cond)    __builtin_expect(cond, 0)
+#define COP_HINT_PREFETCH(ptr)  __builtin_prefetch(ptr)
 
 #ifndef COP_ATTR_RESTRICT
 #define COP_ATTR_RESTRICT       __restrict__
@@ -71,6 +75,12 @@
 #define COP_ATTR_ALWAYSINLINE
 #define COP_ATTR_NOINLINE       __declspec(noinline)
 #define COP_HINT_FALSE(cond)    (cond)
+#if defined(_M_IX86) || defined(_M_X64)
+#include <xmmintrin.h>
+#define COP_HINT_PREFETCH(ptr)  _mm_prefetch((const char *)(ptr), _MM_HINT_T0)
+#else
+#define COP_HINT_PREFETCH(ptr)  ((void)(ptr))
+#endif
 
 #ifndef COP_ATTR_RESTRICT
 #define COP_ATTR_RESTRICT       __restrict
@@ -80,6 +90,7 @@
 #define COP_ATTR_ALWAYSINLINE
 #define COP_ATTR_NOINLINE
 #define COP_HINT_FALSE(cond)    (cond)
+#define COP_HINT_PREFETCH(ptr)  ((void)(ptr))
 #endif
 
 #ifndef COP_ATTR_RESTRICT
@@ -57,6 +57,11 @@ struct cop_filemap {
  * through to the underlying file. */
 #define COP_FILEMAP_SHARED      (0x4)
 
+/* This flag is used with cop_filemap_open_at() to require that the file is
+ * mapped at the given address. Without it, the address is only a hint. An
+ * existing mapping at the address is never replaced. */
+#define COP_FILEMAP_FLAG_FIXED  (0x8)
+
 /* The mapping could not be constructed due to a file access error. */
 #define COP_FILEMAP_ERR_FILE    (1)
 
@@ -64,6 +69,13 @@ struct cop_filemap {
 #define COP_FILEMAP_ERR_MAPPING (2)
 
 int  cop_filemap_open(struct cop_filemap *map, const char *filename, unsigned flags);
+
+/* Equivalent to cop_filemap_open() but tries to place the mapping at addr
+ * (which should be aligned to the system allocation granularity). If
+ * COP_FILEMAP_FLAG_FIXED is set and the mapping cannot be placed there,
+ * COP_FILEMAP_ERR_MAPPING is returned. Otherwise, check map->ptr to find
+ * where the mapping was placed. */
+int  cop_filemap_open_at(struct cop_filemap *map, const char *filename, unsigned flags, void *addr);
 void cop_filemap_close(struct cop_filemap *map);
 
 /* Dump the blob of memory in buffer with the given size into a file with the
@@ -0,0 +1,71 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#ifndef COP_RING_H
+#define COP_RING_H
+
+/* C Compiler, OS and Platform Abstractions - Single-Producer Single-Consumer
+ *                                            Byte Ring.
+ *
+ * The ring is intended to be placed over the first half of a mirrored
+ * allocation (see cop_alloc_mirror_init() in cop_alloc.h). Because the pages
+ * are mapped twice, the span returned by cop_ring_write_ptr() or
+ * cop_ring_read_ptr() is always contiguous even when it wraps around the end
+ * of the ring. Reads and writes are therefore single memcpy calls and blocks
+ * of samples can be loaded directly from the read pointer with v4f_ld() or
+ * v8f_ld() (the base of a mirrored allocation is page aligned, so positions
+ * which are multiples of the vector size remain aligned).
+ *
+ * One thread may write to the ring while another reads from it without any
+ * locking. The positions are published with release stores and observed with
+ * acquire loads. They run over [0, 2*size) so that a full ring can be told
+ * apart from an empty one without wasting a byte. */
+
+#include <stddef.h>
+
+struct cop_ring {
+	unsigned char *buf;
+	size_t         size;
+	size_t         write_pos; /* in [0, 2*size), only modified by the producer */
+	size_t         read_pos;  /* in [0, 2*size), only modified by the consumer */
+};
+
+/* Initialise a ring over size bytes at buf. buf[i] and buf[i + size] must
+ * refer to the same memory for i in [0, size). */
+void cop_ring_init(struct cop_ring *r, unsigned char *buf, size_t size);
+
+/* Get a pointer to the contiguous free space of the ring and the number of
+ * bytes which may be written there. The data becomes visible to the consumer
+ * once cop_ring_commit_write() is called. */
+unsigned char *cop_ring_write_ptr(struct cop_ring *r, size_t *p_avail);
+void cop_ring_commit_write(struct cop_ring *r, size_t nb);
+
+/* Get a pointer to the readable data of the ring and the number of bytes
+ * which may be read. The space is returned to the producer once
+ * cop_ring_commit_read() is called. */
+const unsigned char *cop_ring_read_ptr(struct cop_ring *r, size_t *p_avail);
+void cop_ring_commit_read(struct cop_ring *r, size_t nb);
+
+/* Copy up to nb bytes into or out of the ring. The return value is the
+ * number of bytes which were copied. */
+size_t cop_ring_write(struct cop_ring *r, const void *data, size_t nb);
+size_t cop_ring_read(struct cop_ring *r, void *data, size_t nb);
+
+#endif /* COP_RING_H */
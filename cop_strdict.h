@@ -2,6 +2,7 @@
 #define COP_STRDICT_H
 
 #include "cop_strtypes.h"
+#include "cop_alloc.h"
 #include <stddef.h>
 
 /* This structure is defined later in this header. Don't access members
@@ -83,6 +84,42 @@ cop_strdict_insert
 	,struct cop_strdict_node  *p_key
 	);
 
+/* Find a node or insert a new one in a single descent.
+ *
+ * If a node with the same key as p_item already exists in the dictionary,
+ * it is returned and no change is made to the dictionary. Otherwise, p_item
+ * is inserted (with the same persistence requirements as
+ * cop_strdict_insert()) and returned. The return value is never NULL. */
+struct cop_strdict_node *
+cop_strdict_find_or_insert
+	(struct cop_strdict_node **pp_root
+	,struct cop_strdict_node  *p_item
+	);
+
+/* Called by cop_strdict_find_or_create() when the key does not exist.
+ * p_context is the value passed to cop_strdict_find_or_create() and p_key is
+ * the key which was searched for. The function should return a node
+ * initialised with a key equal to p_key (its key data must be persistent) or
+ * NULL if it could not create one. */
+typedef struct cop_strdict_node *(cop_strdict_create_fn)(void *p_context, const struct cop_strh *p_key);
+
+/* Find a node or create and insert a new one in a single descent.
+ *
+ * Searches for p_key. If it exists, the node is returned and p_fn is not
+ * called - so no node or copy of the key needs to be made. Otherwise, p_fn
+ * is called to build a node which is inserted where the search ended and
+ * returned. If p_fn returns NULL, no change is made to the dictionary and
+ * NULL is returned. If p_created is not NULL, it is set to 1 if a node was
+ * created and inserted and 0 otherwise. */
+struct cop_strdict_node *
+cop_strdict_find_or_create
+	(struct cop_strdict_node **pp_root
+	,const struct cop_strh    *p_key
+	,cop_strdict_create_fn    *p_fn
+	,void                     *p_context
+	,int                      *p_created
+	);
+
 /* Find an existing value in the dictionary by cop_strh structure.
  *
  * Search for a key using the data in the given cop_strh structure. If
@@ -111,6 +148,25 @@ cop_strdict_get_by_cstr
 	,void                          **pp_value
 	);
 
+/* Find many values in the dictionary at once.
+ *
+ * Searches for each of the nb keys in p_keys. The searches are made in
+ * lockstep and the next node of every search is prefetched before any of
+ * them is examined, so the cache misses of many searches overlap rather than
+ * being taken one after another. For every key i, pp_values[i] is set to the
+ * data pointer of the item if it exists or NULL if it does not and
+ * p_found[i] is set to 1 if it exists or 0 if it does not. Either output
+ * array may be NULL if the result is not required. Returns the number of
+ * keys which were found. */
+size_t
+cop_strdict_get_multi
+	(const struct cop_strdict_node  *p_root
+	,const struct cop_strh          *p_keys
+	,size_t                          nb
+	,void                          **pp_values
+	,unsigned char                  *p_found
+	);
+
 int /* zero on success, non-zero when key does not exist */
 cop_strdict_update
 	(struct cop_strdict_node *p_root
@@ -177,6 +233,151 @@ cop_strdict_enumerate
 	,void                     *p_context
 	);
 
+/* ---------------------------------------------------------------------------
+ * Bulk construction and compaction
+ *
+ * Nodes inserted one at a time live wherever the caller allocated them, so a
+ * lookup in a large dictionary tends to miss the cache at every level. The
+ * functions below place every node of a dictionary in one contiguous array
+ * in an order which keeps nodes that are visited together close together.
+ * ------------------------------------------------------------------------ */
+
+/* Breadth-first order: the root, then its children, then its grandchildren
+ * and so on. The top levels of the trie (which every lookup visits) end up
+ * packed into the first few cache lines. */
+#define COP_STRDICT_LAYOUT_BFS (0)
+
+/* van Emde Boas order: the top half of the levels is laid out recursively
+ * followed by each subtree hanging from it, also laid out recursively. Every
+ * step of a lookup tends to stay within the same block of memory regardless
+ * of the cache or page size. */
+#define COP_STRDICT_LAYOUT_VEB (1)
+
+/* Return the number of nodes in the dictionary. */
+size_t cop_strdict_count(const struct cop_strdict_node *p_root);
+
+/* Build a dictionary from nb keys and data pointers.
+ *
+ * p_nodes must point to an array of nb nodes which will hold the entire
+ * dictionary in the given layout. p_keys[i] is used to initialise node i
+ * (the key data must be persistent as for cop_strdict_node_init()) and the
+ * node data is set to pp_data[i] (or NULL if pp_data is NULL). scratch is
+ * used for temporary storage and is restored before the function returns.
+ * The function returns zero on success. It returns non-zero if a key is
+ * duplicated or scratch memory could not be obtained - in which case
+ * *pp_root is not modified. */
+int
+cop_strdict_build
+	(struct cop_strdict_node **pp_root
+	,struct cop_strdict_node  *p_nodes
+	,const struct cop_strh    *p_keys
+	,void             *const  *pp_data
+	,size_t                    nb
+	,int                       layout
+	,struct cop_salloc_iface  *scratch
+	);
+
+/* Relocate every node of a dictionary into an array in the given layout.
+ *
+ * p_nodes must point to an array of at least cop_strdict_count(*pp_root)
+ * nodes. It may overlap the nodes which are currently in the dictionary
+ * (e.g. to re-layout a dictionary which was previously built or compacted
+ * into the same array). On success, *pp_root is updated to point into
+ * p_nodes and the nodes which were previously in the dictionary are no
+ * longer part of it - but key data is not copied and must remain
+ * persistent. Nodes returned by later calls to cop_strdict_delete() will be
+ * elements of p_nodes. scratch is used for temporary storage and is restored
+ * before the function returns. The function returns zero on success and
+ * non-zero if scratch memory could not be obtained - in which case the
+ * dictionary is not modified. */
+int
+cop_strdict_compact
+	(struct cop_strdict_node **pp_root
+	,struct cop_strdict_node  *p_nodes
+	,int                       layout
+	,struct cop_salloc_iface  *scratch
+	);
+
+/* ---------------------------------------------------------------------------
+ * Concurrent readers with a single writer
+ *
+ * A cop_strdict_rcu holds a dictionary which any number of threads may
+ * search without locks while one thread at a time modifies it. Readers
+ * follow child pointers with acquire loads and the writer publishes new
+ * nodes with release stores. A delete which has to move another node into
+ * the place of the deleted one is made under a sequence counter and readers
+ * which miss while it changed search again.
+ *
+ * A node returned by cop_strdict_rcu_delete() may still be in use by
+ * readers. It must not be freed, reused or modified until
+ * cop_strdict_rcu_synchronize() has been called after the delete. Its
+ * children are left as they were (apart from a link to the node which took
+ * its place), so initialise it again before inserting it again.
+ *
+ * The writer functions must never be called concurrently with each other
+ * (use a cop_mutex if there may be several writers). The dictionary returned
+ * by cop_strdict_rcu_root() may be used with the non-modifying functions
+ * above from the writer thread only.
+ * ------------------------------------------------------------------------ */
+
+/* Defined later in this header. */
+struct cop_strdict_rcu;
+struct cop_strdict_rcu_reader;
+
+/* Initialise an empty dictionary. Returns zero on success. */
+int cop_strdict_rcu_init(struct cop_strdict_rcu *p_rcu);
+
+/* Release the resources held by the dictionary. No readers may be
+ * registered. The nodes are not touched. */
+void cop_strdict_rcu_destroy(struct cop_strdict_rcu *p_rcu);
+
+/* Add a reader to the dictionary. Every thread which calls
+ * cop_strdict_rcu_get() needs its own registered reader. */
+void cop_strdict_rcu_reader_register(struct cop_strdict_rcu *p_rcu, struct cop_strdict_rcu_reader *p_reader);
+
+/* Remove a reader from the dictionary. It must not be searching. */
+void cop_strdict_rcu_reader_unregister(struct cop_strdict_rcu_reader *p_reader);
+
+/* Find an existing value as for cop_strdict_get(). May be called at any
+ * time by the thread which owns p_reader. */
+int /* zero on success, non-zero when key does not exist */
+cop_strdict_rcu_get
+	(struct cop_strdict_rcu_reader  *p_reader
+	,const struct cop_strh          *p_key
+	,void                          **pp_value
+	);
+
+/* Writer: insert a node as for cop_strdict_insert(). The node is visible to
+ * readers once the function returns. */
+int
+cop_strdict_rcu_insert
+	(struct cop_strdict_rcu  *p_rcu
+	,struct cop_strdict_node *p_item
+	);
+
+/* Writer: change the data pointer of a key as for cop_strdict_update(). */
+int /* zero on success, non-zero when key does not exist */
+cop_strdict_rcu_update
+	(struct cop_strdict_rcu  *p_rcu
+	,const struct cop_strh   *p_key
+	,void                    *p_value
+	);
+
+/* Writer: remove a key as for cop_strdict_delete(). See above for when the
+ * returned node may be reused. */
+struct cop_strdict_node *
+cop_strdict_rcu_delete
+	(struct cop_strdict_rcu  *p_rcu
+	,const struct cop_strh   *p_key
+	);
+
+/* Writer: wait until every search which was running when the function was
+ * called has completed. Nodes deleted before the call may then be freed. */
+void cop_strdict_rcu_synchronize(struct cop_strdict_rcu *p_rcu);
+
+/* Writer: return the root of the dictionary. */
+struct cop_strdict_node *cop_strdict_rcu_root(struct cop_strdict_rcu *p_rcu);
+
 /* ---------------------------------------------------------------------------
  * Internal bits
  *
@@ -192,8 +393,40 @@ cop_strdict_enumerate
 #define COP_STRDICT_CHID_NB   (1u<<COP_STRDICT_CHID_BITS)
 #define COP_STRDICT_CHID_MASK (COP_STRDICT_CHID_NB-1u)
 
+/* Maximum number of searches cop_strdict_get_multi() keeps in flight. */
+#define COP_STRDICT_MULTI_LANES (16)
+
+/* When COP_STRDICT_PACKED is defined to a non-zero value (see the
+ * COP_STRDICT_PACKED CMake option), every node is sized and aligned to a
+ * 64 byte cache line and holds a 16 bit summary of each of its children:
+ * a 12 bit tag derived from the child's key in the upper bits and a bit for
+ * each non-null child of the child in the lower 4 bits. A lookup which is
+ * about to move to a child which does not have the key being searched for
+ * and has nowhere further to go can then fail without loading the child.
+ *
+ * COP_STRDICT_NODE_ALIGN is the alignment nodes must be allocated with
+ * (suitable for the align argument of cop_salloc()). The packed node type is
+ * declared with that alignment, so using a node which is not aligned to it
+ * is undefined behaviour; cop_strdict_node_init() asserts that it is. */
+#if COP_STRDICT_PACKED
+#if COP_STRDICT_CHID_BITS != 2
+#error "COP_STRDICT_PACKED requires 4 children per node"
+#endif
+#define COP_STRDICT_NODE_ALIGN (64)
+#if defined(_MSC_VER)
+#define COP_STRDICT_NODE_ATTR __declspec(align(64))
+#elif defined(__clang__) || defined(__GNUC__)
+#define COP_STRDICT_NODE_ATTR __attribute__((aligned(64)))
+#else
+#define COP_STRDICT_NODE_ATTR
+#endif
+#else
+#define COP_STRDICT_NODE_ALIGN (0)
+#define COP_STRDICT_NODE_ATTR
+#endif
+
 /* Internal node structure */
-struct cop_strdict_node {
+struct COP_STRDICT_NODE_ATTR cop_strdict_node {
 	/* Lower 32 bits is the hash. Upper 32 bits is the key data length. */
 	uint_fast64_t            key;
 
@@ -207,6 +440,34 @@ struct cop_strdict_node {
 	/* Pointers to child nodes. Initialised to NULL. */
 	struct cop_strdict_node *kids[COP_STRDICT_CHID_NB];
 
+#if COP_STRDICT_PACKED
+	/* Summaries of the child nodes. Zero when the child is NULL. */
+	uint_least16_t           summaries[COP_STRDICT_CHID_NB];
+#endif
+
+};
+
+struct cop_strdict_rcu_reader {
+	struct cop_strdict_rcu        *rcu;
+	struct cop_strdict_rcu_reader *next;
+
+	/* The epoch when the current search started or zero if the reader is
+	 * not searching. */
+	size_t                         epoch;
+};
+
+struct cop_strdict_rcu {
+	struct cop_strdict_node       *root;
+
+	/* Odd while the writer is moving nodes. */
+	size_t                         seq;
+
+	/* Odd and incremented by 2 for each synchronize. */
+	size_t                         epoch;
+
+	/* Non-zero while the list of readers is being used. */
+	size_t                         lock;
+	struct cop_strdict_rcu_reader *readers;
 };
 
 #endif /* COP_STRDICT_H */
@@ -68,6 +68,7 @@ typedef DWORD           cop_tlskey;
 #else
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 typedef pthread_cond_t  cop_cond;
 typedef pthread_t       cop_thread;
 typedef pthread_mutex_t cop_mutex;
@@ -132,6 +133,46 @@ static void  cop_tlskey_set_pointer(cop_tlskey key, void *value);
 static int   cop_tlskey_create(cop_tlskey *key);
 static void  cop_tlskey_destroy(cop_tlskey key);
 
+/* Create a thread-local storage key with a destructor. When a thread which
+ * has a non-NULL value stored in the key exits, the destructor will be called
+ * with that value. The destructor is not called for values which are still
+ * set when the key is destroyed. */
+static int   cop_tlskey_create_with_destructor(cop_tlskey *key, void (*destructor)(void *value));
+
+/* The atomic API consists of the following functions which operate on
+ * naturally aligned size_t values. They exist so that lock-free structures
+ * can be built without depending on C11.
+ *
+ *   cop_atomic_size_load       Load the value with acquire semantics.
+ *   cop_atomic_size_store      Store the value with release semantics.
+ *   cop_atomic_size_cas        Compare the value with *expected and replace
+ *                              it with desired if they are equal. Returns
+ *                              non-zero if the exchange happened. Otherwise,
+ *                              returns zero and *expected is updated with
+ *                              the current value.
+ *   cop_atomic_size_fetch_add  Add to the value and return what it was
+ *                              before the addition. */
+static size_t cop_atomic_size_load(size_t *p);
+static void   cop_atomic_size_store(size_t *p, size_t value);
+static int    cop_atomic_size_cas(size_t *p, size_t *expected, size_t desired);
+static size_t cop_atomic_size_fetch_add(size_t *p, size_t value);
+
+/* The same for naturally aligned pointers, plus a full memory barrier.
+ *
+ *   cop_atomic_ptr_load        Load the pointer with acquire semantics.
+ *   cop_atomic_ptr_store       Store the pointer with release semantics.
+ *   cop_atomic_fence           No loads or stores may be reordered across
+ *                              the fence in either direction. This is
+ *                              needed to order a store before a later load
+ *                              (e.g. for epoch or hazard pointer schemes). */
+static void  *cop_atomic_ptr_load(void **p);
+static void   cop_atomic_ptr_store(void **p, void *value);
+static void   cop_atomic_fence(void);
+
+/* Give up the remainder of the calling thread's time slice. Use this when
+ * spinning while waiting for another thread to make progress. */
+static void   cop_thread_yield(void);
+
 /*****************************************************************************
  * IMPLEMENTATIONS
  ****************************************************************************/
@@ -232,6 +273,54 @@ static COP_ATTR_UNUSED int cop_thread_join(cop_thread thread, void **value)
 	return COP_THREADERR_UNKNOWN;
 }
 
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE size_t cop_atomic_size_load(size_t *p)
+{
+	return (size_t)InterlockedCompareExchangePointer((PVOID volatile *)p, NULL, NULL);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void cop_atomic_size_store(size_t *p, size_t value)
+{
+	InterlockedExchangePointer((PVOID volatile *)p, (PVOID)value);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE int cop_atomic_size_cas(size_t *p, size_t *expected, size_t desired)
+{
+	size_t prev = (size_t)InterlockedCompareExchangePointer((PVOID volatile *)p, (PVOID)desired, (PVOID)*expected);
+	if (prev == *expected)
+		return 1;
+	*expected = prev;
+	return 0;
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE size_t cop_atomic_size_fetch_add(size_t *p, size_t value)
+{
+#if defined(_WIN64)
+	return (size_t)InterlockedExchangeAdd64((LONG64 volatile *)p, (LONG64)value);
+#else
+	return (size_t)InterlockedExchangeAdd((LONG volatile *)p, (LONG)value);
+#endif
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void *cop_atomic_ptr_load(void **p)
+{
+	return InterlockedCompareExchangePointer((PVOID volatile *)p, NULL, NULL);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void cop_atomic_ptr_store(void **p, void *value)
+{
+	InterlockedExchangePointer((PVOID volatile *)p, value);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void cop_atomic_fence(void)
+{
+	MemoryBarrier();
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void cop_thread_yield(void)
+{
+	SwitchToThread();
+}
+
 #if 0
 /* Untested */
 static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE unsigned cop_thread_get_id(void) {
@@ -436,6 +525,42 @@ static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE int cop_tlskey_create(cop_tlskey *k
 	return (pthread_key_create(key, NULL)) ? -1 : 0;
 }
 
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE int cop_tlskey_create_with_destructor(cop_tlskey *key, void (*destructor)(void *value)) {
+	return (pthread_key_create(key, destructor)) ? -1 : 0;
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE size_t cop_atomic_size_load(size_t *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void cop_atomic_size_store(size_t *p, size_t value) {
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE int cop_atomic_size_cas(size_t *p, size_t *expected, size_t desired) {
+	return __atomic_compare_exchange_n(p, expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE size_t cop_atomic_size_fetch_add(size_t *p, size_t value) {
+	return __atomic_fetch_add(p, value, __ATOMIC_ACQ_REL);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void *cop_atomic_ptr_load(void **p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void cop_atomic_ptr_store(void **p, void *value) {
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void cop_atomic_fence(void) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void cop_thread_yield(void) {
+	sched_yield();
+}
+
 static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void cop_tlskey_destroy(cop_tlskey key) {
 	int failed = pthread_key_delete(key);
 	assert(!failed); (void)failed;
@@ -19,12 +19,22 @@
  * DEALINGS IN THE SOFTWARE. */
 
 #include "cop/cop_alloc.h"
+#include "cop/cop_alloc_tls_pool.h"
+#include "cop/cop_thread.h"
+#include "cop/cop_filemap.h"
 
 #include <stdint.h> /* SIZE_MAX */
+#include <stddef.h> /* offsetof */
+#include <limits.h> /* CHAR_BIT */
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>        /* shm_open */
+#include <sys/stat.h>     /* fstat */
+#endif
 #ifdef __linux__
 #include <unistd.h>
 #include <sys/mman.h>     /* mmap */
@@ -32,6 +42,7 @@
 #include <sys/resource.h> /* getrlimit */
 #endif
 #ifdef __APPLE__
+#include <unistd.h>       /* sysconf */
 #include <sys/sysctl.h>   /* sysctl */
 #include <sys/mman.h>     /* mmap */
 #include <sys/time.h>     /* getrlimit */
@@ -41,6 +52,14 @@
 #include <windows.h>
 #endif
 
+/* Update optional statistics counters. The argument is not evaluated unless
+ * statistics are enabled. */
+#if COP_ALLOC_STATS
+#define COP_ALLOC_STAT(expr_) do { expr_; } while (0)
+#else
+#define COP_ALLOC_STAT(expr_) do { } while (0)
+#endif
+
 size_t cop_memory_query_page_size()
 {
 #ifdef __linux__
@@ -61,6 +80,33 @@ size_t cop_memory_query_page_size()
 #endif
 }
 
+size_t cop_memory_query_huge_page_size()
+{
+#ifdef __linux__
+	unsigned long value = 0;
+	FILE         *f;
+	if ((f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r")) != NULL) {
+		if (fscanf(f, "%lu", &value) != 1)
+			value = 0;
+		fclose(f);
+	}
+	if (value == 0 && (f = fopen("/proc/meminfo", "r")) != NULL) {
+		char line[128];
+		while (fgets(line, sizeof(line), f) != NULL)
+			if (sscanf(line, "Hugepagesize: %lu kB", &value) == 1) {
+				value *= 1024;
+				break;
+			}
+		fclose(f);
+	}
+	return (size_t)value;
+#elif _WIN32
+	return GetLargePageMinimum();
+#else
+	return 0;
+#endif
+}
+
 size_t cop_memory_query_system_memory()
 {
 #ifdef __linux__
@@ -97,16 +143,416 @@ size_t cop_memory_query_current_lockable()
 #endif
 }
 
+#ifdef __linux__
+/* Read a single unsigned value from a sysfs file. Sizes with a K or M suffix
+ * are scaled. Returns zero if the file cannot be read. */
+static size_t linux_read_sysfs_size(const char *path)
+{
+	unsigned long value = 0;
+	char          suffix = 0;
+	FILE         *f;
+	if ((f = fopen(path, "r")) != NULL) {
+		if (fscanf(f, "%lu%c", &value, &suffix) < 1)
+			value = 0;
+		fclose(f);
+	}
+	if (suffix == 'K')
+		value *= 1024;
+	else if (suffix == 'M')
+		value *= 1024 * 1024;
+	return (size_t)value;
+}
+
+/* Read a cpu list such as "0-3,8" from a sysfs file. Returns the number of
+ * processors in the list or zero on error. The first processor of the list
+ * is placed in p_first. */
+static unsigned linux_read_sysfs_cpulist(const char *path, unsigned *p_first)
+{
+	unsigned count = 0;
+	unsigned lo, hi;
+	int      c;
+	FILE    *f;
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+	while (fscanf(f, "%u", &lo) == 1) {
+		hi = lo;
+		if ((c = fgetc(f)) == '-') {
+			if (fscanf(f, "%u", &hi) != 1 || hi < lo)
+				break;
+			c = fgetc(f);
+		}
+		if (count == 0)
+			*p_first = lo;
+		count += hi - lo + 1;
+		if (c != ',')
+			break;
+	}
+	fclose(f);
+	return count;
+}
+#endif
+
+#if _WIN32
+static SYSTEM_LOGICAL_PROCESSOR_INFORMATION *win_get_processor_info(DWORD *p_count)
+{
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION *info = NULL;
+	DWORD                                 len  = 0;
+	if (GetLogicalProcessorInformation(NULL, &len) || GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+		return NULL;
+	if ((info = malloc(len)) == NULL)
+		return NULL;
+	if (!GetLogicalProcessorInformation(info, &len)) {
+		free(info);
+		return NULL;
+	}
+	*p_count = len / sizeof(*info);
+	return info;
+}
+
+static unsigned win_count_bits(ULONG_PTR mask)
+{
+	unsigned count = 0;
+	for (; mask; mask &= mask - 1)
+		count++;
+	return count;
+}
+#endif
+
+#ifdef __APPLE__
+static size_t apple_sysctl_value(const char *name)
+{
+	uint64_t value    = 0;
+	size_t   valuelen = sizeof(value);
+	if (sysctlbyname(name, &value, &valuelen, NULL, 0) != 0)
+		return 0;
+	/* Some values are only 32-bits wide. */
+	return (valuelen == sizeof(uint32_t)) ? (size_t)*(uint32_t *)&value : (size_t)value;
+}
+#endif
+
+size_t cop_cpu_query_cache_line_size()
+{
+#ifdef __linux__
+	size_t value = linux_read_sysfs_size("/sys/devices/system/cpu/cpu0/cache/index0/coherency_line_size");
+#ifdef _SC_LEVEL1_DCACHE_LINESIZE
+	if (value == 0) {
+		long lsz = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+		value = (lsz < 0) ? 0 : (size_t)lsz;
+	}
+#endif
+	return value;
+#elif __APPLE__
+	return apple_sysctl_value("hw.cachelinesize");
+#elif _WIN32
+	DWORD                                 i, count;
+	size_t                                value = 0;
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION *info  = win_get_processor_info(&count);
+	if (info == NULL)
+		return 0;
+	for (i = 0; i < count && value == 0; i++)
+		if (info[i].Relationship == RelationCache && info[i].Cache.Level == 1 && info[i].Cache.Type != CacheInstruction)
+			value = info[i].Cache.LineSize;
+	free(info);
+	return value;
+#else
+	return 0;
+#endif
+}
+
+size_t cop_cpu_query_cache_size(unsigned level)
+{
+#ifdef __linux__
+	unsigned idx;
+	for (idx = 0; idx < 16; idx++) {
+		char  path[96];
+		char  type[32];
+		FILE *f;
+		sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%u/type", idx);
+		if ((f = fopen(path, "r")) == NULL)
+			break;
+		if (fscanf(f, "%31s", type) != 1)
+			type[0] = '\0';
+		fclose(f);
+		if (strcmp(type, "Data") != 0 && strcmp(type, "Unified") != 0)
+			continue;
+		sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%u/level", idx);
+		if (linux_read_sysfs_size(path) != level)
+			continue;
+		sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%u/size", idx);
+		return linux_read_sysfs_size(path);
+	}
+	{
+		long value = -1;
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE) && defined(_SC_LEVEL3_CACHE_SIZE)
+		if (level == 1)
+			value = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+		else if (level == 2)
+			value = sysconf(_SC_LEVEL2_CACHE_SIZE);
+		else if (level == 3)
+			value = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+		return (value < 0) ? 0 : (size_t)value;
+	}
+#elif __APPLE__
+	if (level == 1)
+		return apple_sysctl_value("hw.l1dcachesize");
+	if (level == 2)
+		return apple_sysctl_value("hw.l2cachesize");
+	if (level == 3)
+		return apple_sysctl_value("hw.l3cachesize");
+	return 0;
+#elif _WIN32
+	DWORD                                 i, count;
+	size_t                                value = 0;
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION *info  = win_get_processor_info(&count);
+	if (info == NULL)
+		return 0;
+	for (i = 0; i < count && value == 0; i++)
+		if (info[i].Relationship == RelationCache && info[i].Cache.Level == level && info[i].Cache.Type != CacheInstruction)
+			value = info[i].Cache.Size;
+	free(info);
+	return value;
+#else
+	return 0;
+#endif
+}
+
+unsigned cop_cpu_query_logical_cores()
+{
+#if defined(__linux__) || defined(__APPLE__)
+	long value = sysconf(_SC_NPROCESSORS_ONLN);
+	return (value < 0) ? 0 : (unsigned)value;
+#elif _WIN32
+	SYSTEM_INFO sysinfo;
+	GetSystemInfo(&sysinfo);
+	return sysinfo.dwNumberOfProcessors;
+#else
+	return 0;
+#endif
+}
+
+unsigned cop_cpu_query_physical_cores()
+{
+#ifdef __linux__
+	/* A core is counted once through the lowest numbered processor in its
+	 * list of thread siblings. Offline processors have no topology
+	 * directory and are skipped. */
+	long     nb_conf = sysconf(_SC_NPROCESSORS_CONF);
+	unsigned count   = 0;
+	unsigned cpu;
+	for (cpu = 0; nb_conf > 0 && cpu < (unsigned)nb_conf; cpu++) {
+		char     path[96];
+		unsigned first;
+		sprintf(path, "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+		if (linux_read_sysfs_cpulist(path, &first) && first == cpu)
+			count++;
+	}
+	return count;
+#elif __APPLE__
+	return (unsigned)apple_sysctl_value("hw.physicalcpu");
+#elif _WIN32
+	DWORD                                 i, count;
+	unsigned                              value = 0;
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION *info  = win_get_processor_info(&count);
+	if (info == NULL)
+		return 0;
+	for (i = 0; i < count; i++)
+		if (info[i].Relationship == RelationProcessorCore)
+			value++;
+	free(info);
+	return value;
+#else
+	return 0;
+#endif
+}
+
+unsigned cop_cpu_query_smt_siblings()
+{
+#ifdef __linux__
+	unsigned first;
+	return linux_read_sysfs_cpulist("/sys/devices/system/cpu/cpu0/topology/thread_siblings_list", &first);
+#elif __APPLE__
+	size_t logical  = apple_sysctl_value("hw.logicalcpu");
+	size_t physical = apple_sysctl_value("hw.physicalcpu");
+	return (physical == 0) ? 0 : (unsigned)(logical / physical);
+#elif _WIN32
+	DWORD                                 i, count;
+	unsigned                              value = 0;
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION *info  = win_get_processor_info(&count);
+	if (info == NULL)
+		return 0;
+	for (i = 0; i < count && value == 0; i++)
+		if (info[i].Relationship == RelationProcessorCore)
+			value = win_count_bits(info[i].ProcessorMask);
+	free(info);
+	return value;
+#else
+	return 0;
+#endif
+}
+
+void cop_alloc_budget_init(struct cop_alloc_budget *budget, struct cop_alloc_budget *parent, size_t soft_limit, size_t hard_limit, cop_alloc_budget_fn on_soft, void *context)
+{
+	budget->used       = 0;
+	budget->soft_limit = soft_limit;
+	budget->hard_limit = hard_limit;
+	budget->on_soft    = on_soft;
+	budget->context    = context;
+	budget->parent     = parent;
+}
+
+size_t cop_alloc_budget_used(struct cop_alloc_budget *budget)
+{
+	return cop_atomic_size_load(&(budget->used));
+}
+
+void cop_alloc_budget_release(struct cop_alloc_budget *budget, size_t sz)
+{
+	for (; budget != NULL; budget = budget->parent)
+		cop_atomic_size_fetch_add(&(budget->used), (size_t)0 - sz);
+}
+
+/* Charge the budget and then its parent. A level which fails undoes its own
+ * charge and returns to the level below which does the same. The soft limit
+ * check uses the value seen by this charge's own atomic update so that
+ * exactly one of several concurrent charges reports the crossing. */
+static int budget_charge(struct cop_alloc_budget *budget, size_t sz, int force)
+{
+	size_t old;
+
+	if (budget == NULL)
+		return 0;
+
+	old = cop_atomic_size_fetch_add(&(budget->used), sz);
+	if ((!force && budget->hard_limit && old + sz > budget->hard_limit) || budget_charge(budget->parent, sz, force)) {
+		cop_atomic_size_fetch_add(&(budget->used), (size_t)0 - sz);
+		return -1;
+	}
+
+	if (budget->on_soft != NULL && budget->soft_limit && old <= budget->soft_limit && old + sz > budget->soft_limit)
+		budget->on_soft(budget->context, budget, old + sz);
+	return 0;
+}
+
+int cop_alloc_budget_charge(struct cop_alloc_budget *budget, size_t sz)
+{
+	return budget_charge(budget, sz, 0);
+}
+
 static size_t aalloc_alignoffset(size_t val, size_t align_mask)
 {
 	return (align_mask + 1 - (val & align_mask)) & align_mask;
 }
 
-static void *aalloc_align_alloc(struct cop_alloc_iface *iface, size_t size, size_t align)
+/* Work out how far the committed region should extend given that psz bytes
+ * are currently committed and at least required bytes are needed. The result
+ * is always a multiple of grow_sz and never exceeds the reservation. */
+static size_t aalloc_grow_target(const struct cop_alloc_virtual *s, size_t psz, size_t required)
+{
+	size_t step = s->grow_sz;
+	size_t new_sz;
+
+	if (s->grow_policy != COP_ALLOC_VIRTUAL_GROW_LINEAR && psz > step) {
+		step = psz;
+		if (s->grow_policy == COP_ALLOC_VIRTUAL_GROW_CAPPED_GEOMETRIC && step > s->grow_max)
+			step = s->grow_max;
+	}
+
+	new_sz = psz + step;
+	new_sz = (new_sz < required) ? required : new_sz;
+	new_sz = s->grow_sz * ((new_sz + s->grow_sz - 1) / s->grow_sz);
+	return (new_sz > s->reserve_sz) ? s->reserve_sz : new_sz;
+}
+
+/* Fault in the pages between psz and new_sz and lock them into memory if
+ * the lock budget permits it. The pages are always written to first as
+ * locking is only used to pin them and is not relied upon to fault them in.
+ * Once locking has failed or the budget has been used up, pages are still
+ * faulted in but no further locking is attempted until a decommit releases
+ * locked pages. */
+static void aalloc_lock_range(struct cop_alloc_virtual *s, size_t psz, size_t new_sz)
+{
+	size_t len = new_sz - psz;
+	size_t i;
+
+#if defined(__linux__) && defined(MADV_POPULATE_WRITE)
+	if (madvise(s->base + psz, len, MADV_POPULATE_WRITE) != 0)
+#endif
+	{
+		for (i = 0; i < len; i += s->page_sz)
+			((volatile unsigned char *)(s->base + psz))[i] = 0;
+	}
+
+	if (s->lock_exhausted || len > s->lock_budget - s->locked_sz)
+		s->lock_exhausted = 1;
+#if _WIN32
+	else if (VirtualLock(s->base + psz, len))
+#else
+	else if (mlock(s->base + psz, len) == 0)
+#endif
+		s->locked_sz += len;
+	else
+		s->lock_exhausted = 1;
+}
+
+/* Commit the pages between psz and new_sz. Only the newly required pages are
+ * passed to the system. Returns non-zero on failure. */
+static int aalloc_commit_range(struct cop_alloc_virtual *s, size_t psz, size_t new_sz)
+{
+	if (s->budget != NULL && cop_alloc_budget_charge(s->budget, new_sz - psz))
+		return -1;
+#if _WIN32
+	if (VirtualAlloc(s->base + psz, new_sz - psz, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+#else
+	if (mprotect(s->base + psz, new_sz - psz, PROT_READ | PROT_WRITE) == -1) {
+#endif
+		if (s->budget != NULL)
+			cop_alloc_budget_release(s->budget, new_sz - psz);
+		return -1;
+	}
+	s->nb_commits++;
+	if (s->flags & COP_ALLOC_VIRTUAL_FLAG_LOCKED)
+		aalloc_lock_range(s, psz, new_sz);
+	return 0;
+}
+
+/* Grow the committed region from psz so that it covers at least required
+ * bytes. If a budget refuses the usual growth step, only the pages which are
+ * needed are tried. Returns the new committed size or zero on failure. */
+static size_t aalloc_commit_grow(struct cop_alloc_virtual *s, size_t psz, size_t required)
+{
+	size_t new_sz = aalloc_grow_target(s, psz, required);
+	size_t min_sz;
+	if (aalloc_commit_range(s, psz, new_sz) == 0)
+		return new_sz;
+	if (s->budget == NULL)
+		return 0;
+	min_sz = s->page_sz * ((required + s->page_sz - 1) / s->page_sz);
+	min_sz = (min_sz > s->reserve_sz) ? s->reserve_sz : min_sz;
+	if (min_sz < new_sz && aalloc_commit_range(s, psz, min_sz) == 0)
+		return min_sz;
+	return 0;
+}
+
+/* Make sure that at least end bytes of the arena are committed. */
+static int aalloc_ensure_committed(struct cop_alloc_virtual *s, size_t end)
+{
+	/* Need to protect more pages. */
+	if (end > s->protect_sz) {
+		size_t new_sz;
+		if (end > s->reserve_sz)
+			return -1;
+		if ((new_sz = aalloc_commit_grow(s, s->protect_sz, end)) == 0)
+			return -1;
+		s->protect_sz = new_sz;
+	}
+	return 0;
+}
+
+void *cop_alloc_virtual_alloc(struct cop_alloc_virtual *s, size_t size, size_t align)
 {
 	size_t csz;
 	size_t offset;
-	struct cop_alloc_virtual *s = iface->ctx;
 
 	align = (align == 0) ? s->default_align : align;
 
@@ -115,25 +561,115 @@ static void *aalloc_align_alloc(struct cop_alloc_iface *iface, size_t size, size
 	csz    = s->used_sz;
 	offset = csz + aalloc_alignoffset((size_t)(s->base + csz), align - 1);
 
-	/* Need to protect more pages. */
-	if (offset + size > s->protect_sz) {
-		size_t new_sz;
-		new_sz = offset + size;
-		new_sz = s->grow_sz * ((new_sz + s->grow_sz - 1) / s->grow_sz);
-#if _WIN32
-		if (VirtualAlloc(s->base + s->protect_sz, new_sz - s->protect_sz, MEM_COMMIT, PAGE_READWRITE) == NULL)
-			return NULL;
-#else
-		if (mprotect(s->base, new_sz, PROT_READ | PROT_WRITE) == -1)
-			return NULL;
-#endif
-		s->protect_sz = new_sz;
-	}
+	if (offset > s->reserve_sz || size > s->reserve_sz - offset)
+		return NULL;
+	if (aalloc_ensure_committed(s, offset + size))
+		return NULL;
+
+	COP_ALLOC_STAT(s->stats.nb_allocs++);
+	COP_ALLOC_STAT(s->stats.bytes_requested += size);
+	COP_ALLOC_STAT(s->stats.bytes_padding += offset - csz);
+	COP_ALLOC_STAT(s->stats.peak_used = (offset + size > s->stats.peak_used) ? (offset + size) : s->stats.peak_used);
 
 	s->used_sz = offset + size;
 	return s->base + offset;
 }
 
+static void *aalloc_align_alloc(struct cop_alloc_iface *iface, size_t size, size_t align)
+{
+	return cop_alloc_virtual_alloc(iface->ctx, size, align);
+}
+
+void cop_alloc_virtual_set_growth(struct cop_alloc_virtual *s, unsigned policy, size_t max_step)
+{
+	assert(policy <= COP_ALLOC_VIRTUAL_GROW_CAPPED_GEOMETRIC);
+	s->grow_policy = policy;
+	s->grow_max    = s->grow_sz * ((max_step + s->grow_sz - 1) / s->grow_sz);
+	s->grow_max    = (s->grow_max < s->grow_sz) ? s->grow_sz : s->grow_max;
+}
+
+int cop_alloc_virtual_precommit(struct cop_alloc_virtual *s, size_t sz)
+{
+	size_t new_sz;
+	if (sz > s->reserve_sz)
+		return -1;
+	if (sz <= s->protect_sz)
+		return 0;
+	new_sz = s->grow_sz * ((sz + s->grow_sz - 1) / s->grow_sz);
+	new_sz = (new_sz > s->reserve_sz) ? s->reserve_sz : new_sz;
+	if (aalloc_commit_range(s, s->protect_sz, new_sz))
+		return -1;
+	s->protect_sz = new_sz;
+	return 0;
+}
+
+int cop_alloc_virtual_lock_status(const struct cop_alloc_virtual *s, size_t *p_locked)
+{
+	if (p_locked != NULL)
+		*p_locked = s->locked_sz;
+	return s->lock_exhausted;
+}
+
+size_t cop_alloc_virtual_commit_count(const struct cop_alloc_virtual *s)
+{
+	return s->nb_commits;
+}
+
+void cop_alloc_virtual_get_stats(const struct cop_alloc_virtual *s, struct cop_alloc_stats *stats)
+{
+#if COP_ALLOC_STATS
+	*stats = s->stats;
+#else
+	memset(stats, 0, sizeof(*stats));
+#endif
+	stats->used       = s->used_sz;
+	stats->committed  = s->protect_sz;
+	stats->nb_commits = s->nb_commits;
+}
+
+static int aalloc_extend(struct cop_salloc_iface *a, void *ptr, size_t old_size, size_t new_size)
+{
+	struct cop_alloc_virtual *s     = a->iface.ctx;
+	size_t                    start = (unsigned char *)ptr - s->base;
+
+	if (start + old_size != s->used_sz || new_size > s->reserve_sz - start)
+		return -1;
+	if (aalloc_ensure_committed(s, start + new_size))
+		return -1;
+
+	COP_ALLOC_STAT(s->stats.bytes_requested += new_size - old_size);
+	COP_ALLOC_STAT(s->stats.peak_used = (start + new_size > s->stats.peak_used) ? (start + new_size) : s->stats.peak_used);
+
+	if (s->used_sz > s->zero_sz)
+		s->zero_sz = s->used_sz;
+	s->used_sz = start + new_size;
+	return 0;
+}
+
+/* Memory above both the zero watermark and the current position has never
+ * been handed out since it was committed, so only the part of the allocation
+ * below them needs to be cleared. */
+static void *aalloc_zalloc(struct cop_salloc_iface *a, size_t size, size_t align)
+{
+	struct cop_alloc_virtual *s = a->iface.ctx;
+	unsigned char            *p;
+	size_t                    start;
+
+	if (s->used_sz > s->zero_sz)
+		s->zero_sz = s->used_sz;
+
+	if ((p = cop_alloc_virtual_alloc(s, size, align)) == NULL)
+		return NULL;
+
+	start = p - s->base;
+	if (start < s->zero_sz) {
+		size_t len = s->zero_sz - start;
+		len = (len > size) ? size : len;
+		memset(p, 0, len);
+		COP_ALLOC_STAT(s->stats.bytes_zeroed += len);
+	}
+	return p;
+}
 
 static size_t aalloc_save(struct cop_salloc_iface *a)
 {
@@ -141,16 +677,142 @@ static size_t aalloc_save(struct cop_salloc_iface *a)
 	return ctx->used_sz;
 }
 
+/* Release committed pages above keep_sz back to the system. */
+static void aalloc_decommit(struct cop_alloc_virtual *s, size_t keep_sz)
+{
+	size_t len = s->protect_sz - keep_sz;
+	if (s->locked_sz > keep_sz) {
+#if _WIN32
+		VirtualUnlock(s->base + keep_sz, s->locked_sz - keep_sz);
+#else
+		munlock(s->base + keep_sz, s->locked_sz - keep_sz);
+#endif
+		/* Every page which stays committed is locked, so locking may be
+		 * attempted again for later commits. */
+		s->locked_sz      = keep_sz;
+		s->lock_exhausted = 0;
+	}
+#if _WIN32
+	if (!VirtualFree(s->base + keep_sz, len, MEM_DECOMMIT))
+		return;
+#else
+	if (madvise(s->base + keep_sz, len, MADV_DONTNEED) == -1 || mprotect(s->base + keep_sz, len, PROT_NONE) == -1)
+		return;
+#endif
+	COP_ALLOC_STAT(s->stats.nb_decommits++);
+	if (s->budget != NULL)
+		cop_alloc_budget_release(s->budget, len);
+	s->protect_sz = keep_sz;
+	if (s->zero_sz > keep_sz)
+		s->zero_sz = keep_sz;
+}
+
+/* Called on each restore when a decommit policy is set. The arena must have
+ * been restored nb_restores times in a row with its usage staying below the
+ * low water mark before anything is released, and then only the pages above
+ * the highest usage seen over those restores are given back. A loop which
+ * alternates between large and small usage will keep resetting the count and
+ * so will not thrash between committing and decommitting. */
+static void aalloc_decommit_check(struct cop_alloc_virtual *s)
+{
+	size_t keep_sz;
+
+	if (s->used_sz > s->dc_peak)
+		s->dc_peak = s->used_sz;
+
+	if (s->dc_peak >= (s->protect_sz / 100) * s->dc_percent) {
+		s->dc_count = 0;
+		s->dc_peak  = 0;
+		return;
+	}
+
+	if (++s->dc_count < s->dc_restores)
+		return;
+
+	keep_sz = s->grow_sz * ((s->dc_peak + s->grow_sz - 1) / s->grow_sz);
+	if (keep_sz < s->protect_sz)
+		aalloc_decommit(s, keep_sz);
+
+	s->dc_count = 0;
+	s->dc_peak  = 0;
+}
+
 static void aalloc_restore(struct cop_salloc_iface *a, size_t s)
 {
 	struct cop_alloc_virtual *ctx = a->iface.ctx;
 	assert(s <= ctx->used_sz);
+	if (ctx->used_sz > ctx->zero_sz)
+		ctx->zero_sz = ctx->used_sz;
+	if (ctx->dc_restores)
+		aalloc_decommit_check(ctx);
 	/* TODO: change protection flags on the memory - maybe only in debug
 	 * builds. This would be helpful in catching issues. */
 	ctx->used_sz = s;
 }
 
-int cop_alloc_virtual_init(struct cop_alloc_virtual *s, struct cop_salloc_iface *iface, size_t reserve_sz, size_t default_align, size_t grow_sz)
+void cop_alloc_virtual_set_decommit(struct cop_alloc_virtual *s, unsigned low_percent, unsigned nb_restores)
+{
+	assert(low_percent <= 100);
+	s->dc_percent  = low_percent;
+	s->dc_restores = nb_restores;
+	s->dc_count    = 0;
+	s->dc_peak     = 0;
+}
+
+#ifdef __linux__
+/* Try to reserve address space backed by huge pages of size hps. MAP_HUGETLB
+ * is attempted first; it only succeeds when the system huge page pool can
+ * back the entire reservation. Otherwise, a normal reservation is aligned to
+ * the huge page size and advised for transparent huge pages. Returns zero if
+ * a reservation was made (which may still end up using normal pages if the
+ * advice could not be applied). */
+static int aalloc_reserve_huge(struct cop_alloc_virtual *s, size_t reserve_sz, size_t hps, size_t ps)
+{
+	size_t         hreserve = hps * ((reserve_sz + hps - 1) / hps);
+	unsigned char *p;
+#ifdef MADV_HUGEPAGE
+	size_t         offset;
+#endif
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, hreserve, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		s->base       = p;
+		s->reserve_sz = hreserve;
+		s->page_sz    = hps;
+		s->page_kind  = COP_ALLOC_VIRTUAL_PAGES_HUGETLB;
+		return 0;
+	}
+#endif
+
+#ifdef MADV_HUGEPAGE
+	/* Over-reserve by one huge page so that the start can be aligned, then
+	 * give back the unaligned head and the excess tail. */
+	p = mmap(NULL, hreserve + hps, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	offset = aalloc_alignoffset((size_t)p, hps - 1);
+	if (offset)
+		munmap(p, offset);
+	munmap(p + offset + hreserve, hps - offset);
+	s->base       = p + offset;
+	s->reserve_sz = hreserve;
+	if (madvise(s->base, hreserve, MADV_HUGEPAGE) == 0) {
+		s->page_sz   = hps;
+		s->page_kind = COP_ALLOC_VIRTUAL_PAGES_TRANSPARENT;
+	} else {
+		s->page_sz   = ps;
+		s->page_kind = COP_ALLOC_VIRTUAL_PAGES_NORMAL;
+	}
+	return 0;
+#else
+	(void)ps;
+	return -1;
+#endif
+}
+#endif
+
+int cop_alloc_virtual_init_ex(struct cop_alloc_virtual *s, struct cop_salloc_iface *iface, size_t reserve_sz, size_t default_align, size_t grow_sz, unsigned flags)
 {
 	size_t ps;
 
@@ -160,73 +822,628 @@ int cop_alloc_virtual_init(struct cop_alloc_virtual *s, struct cop_salloc_iface
 	if ((ps = cop_memory_query_page_size()) == 0)
 		return -1;
 
+	memset(iface, 0, sizeof(*iface));
 	iface->iface.ctx   = s;
 	iface->iface.alloc = aalloc_align_alloc;
 	iface->save        = aalloc_save;
 	iface->restore     = aalloc_restore;
+	iface->extend      = aalloc_extend;
+	iface->zalloc      = aalloc_zalloc;
 
-	s->reserve_sz      = ps * ((reserve_sz + ps - 1) / ps);
 	s->default_align   = default_align;
-	s->grow_sz         = ps * ((grow_sz == 0) ? 1 : ((grow_sz + ps - 1) / ps));
 	s->used_sz         = 0;
+	s->zero_sz         = 0;
 	s->protect_sz      = 0;
+	s->committing      = 0;
+	s->flags           = flags;
+	s->base            = NULL;
+	s->dc_percent      = 0;
+	s->dc_restores     = 0;
+	s->dc_count        = 0;
+	s->dc_peak         = 0;
+	s->locked_sz       = 0;
+	s->lock_exhausted  = 0;
+	s->budget          = NULL;
+	s->lock_budget     = (flags & COP_ALLOC_VIRTUAL_FLAG_LOCKED) ? cop_memory_query_current_lockable() : 0;
+
+#ifdef __linux__
+	if (flags & COP_ALLOC_VIRTUAL_FLAG_HUGEPAGES) {
+		size_t hps = cop_memory_query_huge_page_size();
+		if (hps > ps && aalloc_reserve_huge(s, reserve_sz, hps, ps) == 0)
+			ps = s->page_sz;
+	}
+#endif
 
+	if (s->base == NULL) {
+		s->reserve_sz    = ps * ((reserve_sz + ps - 1) / ps);
+		s->page_sz       = ps;
+		s->page_kind     = COP_ALLOC_VIRTUAL_PAGES_NORMAL;
 #if _WIN32
-	s->base          = VirtualAlloc(NULL, s->reserve_sz, MEM_RESERVE, PAGE_NOACCESS);
-	if (s->base == NULL)
-		return -1;
+		s->base          = VirtualAlloc(NULL, s->reserve_sz, MEM_RESERVE, PAGE_NOACCESS);
+		if (s->base == NULL)
+			return -1;
 #else
-	s->base          = mmap(NULL, s->reserve_sz, PROT_NONE, MAP_SHARED | MAP_ANON, -1, 0);
-	if (s->base == MAP_FAILED)
-		return -1;
+		s->base          = mmap(NULL, s->reserve_sz, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (s->base == MAP_FAILED)
+			return -1;
 #endif
+	}
+
+	s->grow_sz         = ps * ((grow_sz == 0) ? 1 : ((grow_sz + ps - 1) / ps));
+	s->grow_max        = s->grow_sz;
+	s->grow_policy     = COP_ALLOC_VIRTUAL_GROW_LINEAR;
+	s->nb_commits      = 0;
+	COP_ALLOC_STAT(memset(&(s->stats), 0, sizeof(s->stats)));
 
 	return 0;
 }
 
-void cop_alloc_virtual_free(struct cop_alloc_virtual *s)
+int cop_alloc_virtual_init(struct cop_alloc_virtual *s, struct cop_salloc_iface *iface, size_t reserve_sz, size_t default_align, size_t grow_sz)
 {
-#if _WIN32
+	return cop_alloc_virtual_init_ex(s, iface, reserve_sz, default_align, grow_sz, 0);
+}
+
+size_t cop_alloc_virtual_page_size(const struct cop_alloc_virtual *s)
+{
+	return s->page_sz;
+}
+
+unsigned cop_alloc_virtual_page_kind(const struct cop_alloc_virtual *s)
+{
+	return s->page_kind;
+}
+
+int cop_alloc_virtual_snapshot(const struct cop_alloc_virtual *s, const char *filename)
+{
+	return cop_file_dump(filename, s->base, s->used_sz);
+}
+
+void *cop_alloc_virtual_base(const struct cop_alloc_virtual *s)
+{
+	return s->base;
+}
+
+void cop_alloc_snapshot_relocate(void *image, const size_t *fixup_offsets, size_t nb_fixups, ptrdiff_t delta)
+{
+	size_t i;
+	for (i = 0; i < nb_fixups; i++) {
+		unsigned char **pp = (unsigned char **)((unsigned char *)image + fixup_offsets[i]);
+		if (*pp != NULL)
+			*pp += delta;
+	}
+}
+
+/* Commit pages so that at least the first required bytes of the arena are
+ * accessible. Only one thread may commit at a time; if another thread holds
+ * the commit flag, this yields and returns zero and the caller should check
+ * protect_sz again. Returns non-zero if the pages could not be committed. */
+static int aalloc_concurrent_commit(struct cop_alloc_virtual *s, size_t required)
+{
+	size_t idle = 0;
+	size_t psz;
+	size_t new_sz;
+
+	if (!cop_atomic_size_cas(&(s->committing), &idle, 1)) {
+		cop_thread_yield();
+		return 0;
+	}
+
+	psz = cop_atomic_size_load(&(s->protect_sz));
+	if (psz < required) {
+		if ((new_sz = aalloc_commit_grow(s, psz, required)) == 0) {
+			cop_atomic_size_store(&(s->committing), 0);
+			return -1;
+		}
+		cop_atomic_size_store(&(s->protect_sz), new_sz);
+	}
+
+	cop_atomic_size_store(&(s->committing), 0);
+	return 0;
+}
+
+static void *aalloc_concurrent_alloc(struct cop_alloc_iface *iface, size_t size, size_t align)
+{
+	size_t csz;
+	size_t offset;
+	struct cop_alloc_virtual *s = iface->ctx;
+
+	align = (align == 0) ? s->default_align : align;
+
+	assert(align && (((align - 1) & align) == 0) && "align must be positive and a power of two");
+
+	/* Claim the space. A compare-and-swap is used rather than a fetch-add so
+	 * that the alignment padding is exact and a failed allocation leaves the
+	 * allocator untouched. */
+	csz = cop_atomic_size_load(&(s->used_sz));
+	do {
+		offset = csz + aalloc_alignoffset((size_t)(s->base + csz), align - 1);
+		if (offset + size > s->reserve_sz || offset + size < offset)
+			return NULL;
+	} while (!cop_atomic_size_cas(&(s->used_sz), &csz, offset + size));
+
+	while (COP_HINT_FALSE(offset + size > cop_atomic_size_load(&(s->protect_sz)))) {
+		if (aalloc_concurrent_commit(s, offset + size)) {
+			/* Give the space back if nothing has been allocated after it. */
+			size_t top = offset + size;
+			cop_atomic_size_cas(&(s->used_sz), &top, csz);
+			return NULL;
+		}
+	}
+
+#if COP_ALLOC_STATS
+	cop_atomic_size_fetch_add(&(s->stats.nb_allocs), 1);
+	cop_atomic_size_fetch_add(&(s->stats.bytes_requested), size);
+	cop_atomic_size_fetch_add(&(s->stats.bytes_padding), offset - csz);
+	csz = cop_atomic_size_load(&(s->stats.peak_used));
+	while (csz < offset + size && !cop_atomic_size_cas(&(s->stats.peak_used), &csz, offset + size));
+#endif
+
+	return s->base + offset;
+}
+
+/* The allocation can only be resized if no other thread has allocated after
+ * it, which the compare-and-swap on used_sz establishes. */
+static int aalloc_concurrent_extend(struct cop_salloc_iface *a, void *ptr, size_t old_size, size_t new_size)
+{
+	struct cop_alloc_virtual *s     = a->iface.ctx;
+	size_t                    start = (unsigned char *)ptr - s->base;
+	size_t                    csz   = start + old_size;
+#if COP_ALLOC_STATS
+	size_t                    peak;
+#endif
+
+	if (new_size > s->reserve_sz - start)
+		return -1;
+	if (!cop_atomic_size_cas(&(s->used_sz), &csz, start + new_size))
+		return -1;
+
+	while (COP_HINT_FALSE(start + new_size > cop_atomic_size_load(&(s->protect_sz)))) {
+		if (aalloc_concurrent_commit(s, start + new_size)) {
+			/* Give the space back if nothing has been allocated after it. */
+			csz = start + new_size;
+			cop_atomic_size_cas(&(s->used_sz), &csz, start + old_size);
+			return -1;
+		}
+	}
+
+#if COP_ALLOC_STATS
+	cop_atomic_size_fetch_add(&(s->stats.bytes_requested), new_size - old_size);
+	peak = cop_atomic_size_load(&(s->stats.peak_used));
+	while (peak < start + new_size && !cop_atomic_size_cas(&(s->stats.peak_used), &peak, start + new_size));
+#endif
+
+	return 0;
+}
+
+int cop_alloc_virtual_init_concurrent(struct cop_alloc_virtual *s, struct cop_salloc_iface *iface, size_t reserve_sz, size_t default_align, size_t grow_sz)
+{
+	if (cop_alloc_virtual_init(s, iface, reserve_sz, default_align, grow_sz))
+		return -1;
+	iface->iface.alloc = aalloc_concurrent_alloc;
+	iface->extend      = aalloc_concurrent_extend;
+	iface->zalloc      = NULL;
+	return 0;
+}
+
+void cop_alloc_virtual_set_budget(struct cop_alloc_virtual *s, struct cop_alloc_budget *budget)
+{
+	if (s->budget != NULL)
+		cop_alloc_budget_release(s->budget, s->protect_sz);
+	if (budget != NULL)
+		budget_charge(budget, s->protect_sz, 1);
+	s->budget = budget;
+}
+
+void cop_alloc_virtual_free(struct cop_alloc_virtual *s)
+{
+	if (s->budget != NULL)
+		cop_alloc_budget_release(s->budget, s->protect_sz);
+#if _WIN32
 	VirtualFree(s->base, 0, MEM_RELEASE);
 #else
 	munmap(s->base, s->reserve_sz);
 #endif
 }
 
-static void *alloc_grp_temps(struct cop_alloc_iface *a, size_t size, size_t align)
+#if defined(__linux__) || defined(__APPLE__)
+/* Get a file descriptor for size bytes of shared memory which is not visible
+ * in any namespace. Returns -1 on failure. */
+static int anon_shm_create_fd(size_t size)
+{
+	int fd = -1;
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	fd = memfd_create("cop_alloc", MFD_CLOEXEC);
+#endif
+	if (fd == -1) {
+		/* Fall back to a POSIX shared memory object which is unlinked as
+		 * soon as it has been opened. */
+		char     name[64];
+		unsigned attempt;
+		for (attempt = 0; attempt < 16 && fd == -1; attempt++) {
+			sprintf(name, "/cop_anon_%ld_%lu_%u", (long)getpid(), (unsigned long)size, attempt);
+			fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+			if (fd != -1)
+				shm_unlink(name);
+		}
+		if (fd == -1)
+			return -1;
+	}
+	if (ftruncate(fd, (off_t)size) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+#endif
+
+int cop_alloc_mirror_init(struct cop_alloc_mirror *m, size_t size)
+{
+#if _WIN32
+	SYSTEM_INFO sysinfo;
+	unsigned    attempt;
+	GetSystemInfo(&sysinfo);
+	size = sysinfo.dwAllocationGranularity * ((size + sysinfo.dwAllocationGranularity - 1) / sysinfo.dwAllocationGranularity);
+	if (size == 0 || size > SIZE_MAX / 2)
+		return -1;
+	m->mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)size >> 32), (DWORD)size, NULL);
+	if (m->mapping == NULL)
+		return -1;
+	/* There is no way to map a view into a reserved region, so find a free
+	 * region of 2*size, release it and map into it. Another thread could take
+	 * the space in between, so try a few times. */
+	for (attempt = 0; attempt < 16; attempt++) {
+		unsigned char *p = VirtualAlloc(NULL, 2 * size, MEM_RESERVE, PAGE_NOACCESS);
+		if (p == NULL)
+			break;
+		VirtualFree(p, 0, MEM_RELEASE);
+		if (MapViewOfFileEx(m->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, p) != p)
+			continue;
+		if (MapViewOfFileEx(m->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size, p + size) != p + size) {
+			UnmapViewOfFile(p);
+			continue;
+		}
+		m->base = p;
+		m->size = size;
+		return 0;
+	}
+	CloseHandle(m->mapping);
+	return -1;
+#elif defined(__linux__) || defined(__APPLE__)
+	size_t         psz = cop_memory_query_page_size();
+	unsigned char *p;
+	int            fd;
+	size = psz * ((size + psz - 1) / psz);
+	if (size == 0 || size > SIZE_MAX / 2)
+		return -1;
+	if ((fd = anon_shm_create_fd(size)) == -1)
+		return -1;
+	/* Reserve the whole range first so that nothing else can be placed in
+	 * the second half, then replace both halves with the shared pages. */
+	p = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	if (mmap(p, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED || mmap(p + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(p, 2 * size);
+		close(fd);
+		return -1;
+	}
+	/* The mappings keep the memory alive. */
+	close(fd);
+	m->base = p;
+	m->size = size;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void cop_alloc_mirror_free(struct cop_alloc_mirror *m)
+{
+#if _WIN32
+	UnmapViewOfFile(m->base);
+	UnmapViewOfFile(m->base + m->size);
+	CloseHandle(m->mapping);
+#else
+	munmap(m->base, 2 * m->size);
+#endif
+}
+
+unsigned char *cop_alloc_mirror_base(const struct cop_alloc_mirror *m)
+{
+	return m->base;
+}
+
+size_t cop_alloc_mirror_size(const struct cop_alloc_mirror *m)
+{
+	return m->size;
+}
+
+/* The first bytes of a shared arena hold this header. Everything after it
+ * (rounded up to SHARED_DATA_OFFSET) is handed out by the allocator. */
+struct cop_alloc_shared_header {
+	size_t magic;
+	size_t size;
+	size_t used;
+};
+
+#define SHARED_MAGIC       ((size_t)0x636F7053u) /* "copS" */
+#define SHARED_DATA_OFFSET ((size_t)64)
+
+static void *alloc_shared(struct cop_alloc_iface *a, size_t size, size_t align)
+{
+	struct cop_alloc_shared        *sh  = a->ctx;
+	struct cop_alloc_shared_header *hdr = (struct cop_alloc_shared_header *)sh->base;
+	size_t                          csz;
+	size_t                          offset;
+
+	align = (align == 0) ? 16 : align;
+	assert(align && (((align - 1) & align) == 0) && "align must be positive and a power of two");
+
+	/* Other processes may be allocating at the same time. */
+	csz = cop_atomic_size_load(&(hdr->used));
+	do {
+		offset = csz + aalloc_alignoffset((size_t)(sh->base + csz), align - 1);
+		if (offset > sh->size || size > sh->size - offset)
+			return NULL;
+	} while (!cop_atomic_size_cas(&(hdr->used), &csz, offset + size));
+
+	return sh->base + offset;
+}
+
+static int shared_map(struct cop_alloc_shared *sh, struct cop_alloc_iface *iface, size_t size, int init)
+{
+	struct cop_alloc_shared_header *hdr;
+#if _WIN32
+	sh->base = MapViewOfFile(sh->handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (sh->base == NULL)
+		return -1;
+	if (size == 0) {
+		MEMORY_BASIC_INFORMATION mbi;
+		if (!VirtualQuery(sh->base, &mbi, sizeof(mbi))) {
+			UnmapViewOfFile(sh->base);
+			return -1;
+		}
+		size = mbi.RegionSize;
+	}
+#else
+	sh->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sh->fd, 0);
+	if (sh->base == MAP_FAILED)
+		return -1;
+#endif
+	hdr = (struct cop_alloc_shared_header *)sh->base;
+	if (init) {
+		hdr->size = size;
+		cop_atomic_size_store(&(hdr->used), SHARED_DATA_OFFSET);
+		cop_atomic_size_store(&(hdr->magic), SHARED_MAGIC);
+	} else if (cop_atomic_size_load(&(hdr->magic)) != SHARED_MAGIC || hdr->size > size) {
+#if _WIN32
+		UnmapViewOfFile(sh->base);
+#else
+		munmap(sh->base, size);
+#endif
+		return -1;
+	}
+	sh->size         = hdr->size;
+	iface->ctx       = sh;
+	iface->alloc     = alloc_shared;
+	return 0;
+}
+
+int cop_alloc_shared_create(struct cop_alloc_shared *sh, struct cop_alloc_iface *iface, const char *name, size_t size)
+{
+	size_t psz = cop_memory_query_page_size();
+	size = psz * ((size + SHARED_DATA_OFFSET + psz - 1) / psz);
+#if _WIN32
+	sh->handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)size >> 32), (DWORD)size, name);
+	if (sh->handle == NULL)
+		return -1;
+	if (name != NULL && GetLastError() == ERROR_ALREADY_EXISTS) {
+		CloseHandle(sh->handle);
+		return -1;
+	}
+	if (shared_map(sh, iface, size, 1)) {
+		CloseHandle(sh->handle);
+		return -1;
+	}
+	return 0;
+#elif defined(__linux__) || defined(__APPLE__)
+	if (name == NULL) {
+		if ((sh->fd = anon_shm_create_fd(size)) == -1)
+			return -1;
+	} else {
+		if ((sh->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1)
+			return -1;
+		if (ftruncate(sh->fd, (off_t)size) == -1) {
+			close(sh->fd);
+			shm_unlink(name);
+			return -1;
+		}
+	}
+	if (shared_map(sh, iface, size, 1)) {
+		close(sh->fd);
+		if (name != NULL)
+			shm_unlink(name);
+		return -1;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int cop_alloc_shared_attach(struct cop_alloc_shared *sh, struct cop_alloc_iface *iface, const char *name)
+{
+#if _WIN32
+	if ((sh->handle = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name)) == NULL)
+		return -1;
+	if (shared_map(sh, iface, 0, 0)) {
+		CloseHandle(sh->handle);
+		return -1;
+	}
+	return 0;
+#elif defined(__linux__) || defined(__APPLE__)
+	int fd = shm_open(name, O_RDWR, 0600);
+	if (fd == -1)
+		return -1;
+	if (cop_alloc_shared_attach_fd(sh, iface, fd)) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+#if !_WIN32
+int cop_alloc_shared_attach_fd(struct cop_alloc_shared *sh, struct cop_alloc_iface *iface, int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)SHARED_DATA_OFFSET)
+		return -1;
+	sh->fd = fd;
+	return shared_map(sh, iface, (size_t)st.st_size, 0);
+}
+
+int cop_alloc_shared_fd(const struct cop_alloc_shared *sh)
+{
+	return sh->fd;
+}
+#endif
+
+void cop_alloc_shared_detach(struct cop_alloc_shared *sh)
+{
+#if _WIN32
+	UnmapViewOfFile(sh->base);
+	CloseHandle(sh->handle);
+#else
+	munmap(sh->base, sh->size);
+	close(sh->fd);
+#endif
+}
+
+int cop_alloc_shared_unlink(const char *name)
+{
+#if _WIN32
+	/* Named sections disappear once the last handle is closed. */
+	(void)name;
+	return 0;
+#else
+	return shm_unlink(name) ? -1 : 0;
+#endif
+}
+
+void *cop_alloc_grp_temps_alloc(struct cop_alloc_grp_temps *ctx, size_t size, size_t align)
 {
-	struct cop_alloc_grp_temps *ctx = a->ctx;
 	size_t start;
 	if (align == 0)
 		align = ctx->default_align;
 	assert(align);
 	start = ctx->head->size + aalloc_alignoffset((size_t)(ctx->head + 1) + ctx->head->size, align - 1);
 	if (start + size > ctx->head->alloc_sz) {
-		struct cop_alloc_grp_temps_buf *nb;
+		struct cop_alloc_grp_temps_buf  *nb;
+		struct cop_alloc_grp_temps_buf **pp_cached;
 		size_t min_alloc    = size + align - 1;
 		size_t actual_alloc = ctx->head->size * 2;
 		actual_alloc = (actual_alloc > ctx->max_grow) ? ctx->max_grow : actual_alloc;
 		actual_alloc = (actual_alloc < min_alloc) ? min_alloc : actual_alloc;
-		nb = malloc(sizeof(*nb) + actual_alloc);
-		if (nb == NULL)
-			return NULL;
-		nb->alloc_sz        = actual_alloc;
+		for (pp_cached = &(ctx->cache); *pp_cached != NULL && (*pp_cached)->alloc_sz < min_alloc; pp_cached = &((*pp_cached)->prev));
+		if ((nb = *pp_cached) != NULL) {
+			*pp_cached      = nb->prev;
+			ctx->cache_sz  -= nb->alloc_sz;
+		} else {
+			if (ctx->budget != NULL && cop_alloc_budget_charge(ctx->budget, sizeof(*nb) + actual_alloc)) {
+				/* Try again with just enough for the request. */
+				actual_alloc = min_alloc;
+				if (cop_alloc_budget_charge(ctx->budget, sizeof(*nb) + actual_alloc))
+					return NULL;
+			}
+			nb = malloc(sizeof(*nb) + actual_alloc);
+			if (nb == NULL) {
+				if (ctx->budget != NULL)
+					cop_alloc_budget_release(ctx->budget, sizeof(*nb) + actual_alloc);
+				return NULL;
+			}
+			COP_ALLOC_STAT(ctx->stats.nb_chunk_allocs++);
+			nb->alloc_sz    = actual_alloc;
+		}
 		nb->size            = 0;
 		nb->prev            = ctx->head;
 		ctx->pre_head_size += ctx->head->size;
 		ctx->head           = nb;
 		start               = aalloc_alignoffset((size_t)(ctx->head + 1), align - 1);
 	}
+	COP_ALLOC_STAT(ctx->stats.nb_allocs++);
+	COP_ALLOC_STAT(ctx->stats.bytes_requested += size);
+	COP_ALLOC_STAT(ctx->stats.bytes_padding += start - ctx->head->size);
+	COP_ALLOC_STAT(ctx->stats.peak_used = (ctx->pre_head_size + start + size > ctx->stats.peak_used) ? (ctx->pre_head_size + start + size) : ctx->stats.peak_used);
 	ctx->head->size = start + size;
 	return (unsigned char *)(ctx->head + 1) + start;
 }
 
+static void *alloc_grp_temps(struct cop_alloc_iface *a, size_t size, size_t align)
+{
+	return cop_alloc_grp_temps_alloc(a->ctx, size, align);
+}
+
+/* Free cached chunks until no more than max_bytes are held in the cache. */
+static void grp_temps_trim_cache(struct cop_alloc_grp_temps *gat, size_t max_bytes)
+{
+	while (gat->cache != NULL && gat->cache_sz > max_bytes) {
+		struct cop_alloc_grp_temps_buf *tmp = gat->cache;
+		gat->cache     = tmp->prev;
+		gat->cache_sz -= tmp->alloc_sz;
+		if (gat->budget != NULL)
+			cop_alloc_budget_release(gat->budget, sizeof(*tmp) + tmp->alloc_sz);
+		free(tmp);
+		COP_ALLOC_STAT(gat->stats.nb_chunk_frees++);
+	}
+}
+
+/* Keep a chunk which is no longer in use for the next growth if the cache
+ * has space for it. Otherwise free it. */
+static void cop_alloc_grp_temps_release(struct cop_alloc_grp_temps *gat, struct cop_alloc_grp_temps_buf *buf) {
+	if (gat->cache_sz + buf->alloc_sz <= gat->cache_max) {
+		buf->prev      = gat->cache;
+		gat->cache     = buf;
+		gat->cache_sz += buf->alloc_sz;
+	} else {
+		if (gat->budget != NULL)
+			cop_alloc_budget_release(gat->budget, sizeof(*buf) + buf->alloc_sz);
+		free(buf);
+		COP_ALLOC_STAT(gat->stats.nb_chunk_frees++);
+	}
+}
+
 static size_t cop_alloc_grp_temps_save(struct cop_salloc_iface *a) {
 	struct cop_alloc_grp_temps     *gat = a->iface.ctx;
 	struct cop_alloc_grp_temps_buf *buf = gat->head;
 	return gat->pre_head_size + buf->size;
 }
 
+/* Only allocations in the head chunk can be resized and only while there is
+ * room left in it. */
+static int cop_alloc_grp_temps_extend(struct cop_salloc_iface *a, void *ptr, size_t old_size, size_t new_size) {
+	struct cop_alloc_grp_temps     *gat   = a->iface.ctx;
+	struct cop_alloc_grp_temps_buf *buf   = gat->head;
+	unsigned char                  *data  = (unsigned char *)(buf + 1);
+	size_t                          start;
+
+	if ((unsigned char *)ptr < data || (unsigned char *)ptr > data + buf->size)
+		return -1;
+	start = (unsigned char *)ptr - data;
+	if (start + old_size != buf->size || new_size > buf->alloc_sz - start)
+		return -1;
+
+	COP_ALLOC_STAT(gat->stats.bytes_requested += new_size - old_size);
+	COP_ALLOC_STAT(gat->stats.peak_used = (gat->pre_head_size + start + new_size > gat->stats.peak_used) ? (gat->pre_head_size + start + new_size) : gat->stats.peak_used);
+
+	buf->size = start + new_size;
+	return 0;
+}
+
 static void cop_alloc_grp_temps_restore(struct cop_salloc_iface *a, size_t s) {
 	struct cop_alloc_grp_temps     *gat        = a->iface.ctx;
 	struct cop_alloc_grp_temps_buf *buf        = gat->head;
@@ -236,7 +1453,7 @@ static void cop_alloc_grp_temps_restore(struct cop_salloc_iface *a, size_t s) {
 	while (deallocate > buf->size) {
 		gat->head           = buf->prev;
 		deallocate         -= buf->size;
-		free(buf);
+		cop_alloc_grp_temps_release(gat, buf);
 		buf                 = gat->head;
 		if (buf == NULL) {
 			assert(gat->pre_head_size == 0);
@@ -251,14 +1468,25 @@ static void cop_alloc_grp_temps_restore(struct cop_salloc_iface *a, size_t s) {
 	}
 	
 	if (gat->pre_head_size == 0 && buf->size == 0 && total_size > buf->alloc_sz) {
-		gat->head = malloc(sizeof(*buf) + total_size);
-		if (gat->head != NULL) {
-			gat->head->size     = 0;
-			gat->head->alloc_sz = total_size;
-			gat->head->prev     = NULL;
-			free(buf);
-		} else {
-			gat->head = buf;
+		/* The replacement is only charged for the bytes it adds. If the
+		 * budget does not permit them, keep the existing chunk. */
+		size_t extra = total_size - buf->alloc_sz;
+		if (gat->budget == NULL || cop_alloc_budget_charge(gat->budget, extra) == 0) {
+			gat->head = malloc(sizeof(*buf) + total_size);
+			if (gat->head != NULL) {
+				gat->head->size     = 0;
+				gat->head->alloc_sz = total_size;
+				gat->head->prev     = NULL;
+				free(buf);
+				COP_ALLOC_STAT(gat->stats.nb_chunk_allocs++);
+				COP_ALLOC_STAT(gat->stats.nb_chunk_frees++);
+				/* The new head holds everything the cached chunks did. */
+				grp_temps_trim_cache(gat, 0);
+			} else {
+				if (gat->budget != NULL)
+					cop_alloc_budget_release(gat->budget, extra);
+				gat->head = buf;
+			}
 		}
 	}
 
@@ -278,14 +1506,67 @@ int cop_alloc_grp_temps_init(struct cop_alloc_grp_temps *gat, struct cop_salloc_
 	gat->max_grow        = max_grow ? max_grow : (initial_sz * 2);
 	gat->default_align   = default_align ? default_align : 16;
 	gat->pre_head_size   = 0;
+	gat->cache           = NULL;
+	gat->cache_sz        = 0;
+	gat->cache_max       = gat->max_grow;
+	gat->budget          = NULL;
+	COP_ALLOC_STAT(memset(&(gat->stats), 0, sizeof(gat->stats)));
+	COP_ALLOC_STAT(gat->stats.nb_chunk_allocs = 1);
+	memset(iface, 0, sizeof(*iface));
 	iface->iface.ctx     = gat;
 	iface->iface.alloc   = alloc_grp_temps;
 	iface->save          = cop_alloc_grp_temps_save;
 	iface->restore       = cop_alloc_grp_temps_restore;
+	iface->extend        = cop_alloc_grp_temps_extend;
 	return 0;
 }
 
+void cop_alloc_grp_temps_get_stats(const struct cop_alloc_grp_temps *gat, struct cop_alloc_stats *stats)
+{
+	const struct cop_alloc_grp_temps_buf *buf;
+#if COP_ALLOC_STATS
+	*stats = gat->stats;
+#else
+	memset(stats, 0, sizeof(*stats));
+#endif
+	stats->used      = gat->pre_head_size + gat->head->size;
+	stats->committed = 0;
+	for (buf = gat->head; buf != NULL; buf = buf->prev)
+		stats->committed += buf->alloc_sz;
+	stats->committed += gat->cache_sz;
+}
+
+/* Get the number of bytes charged to the budget for the chunks held. */
+static size_t grp_temps_held(const struct cop_alloc_grp_temps *gat)
+{
+	const struct cop_alloc_grp_temps_buf *buf;
+	size_t                                held = 0;
+	for (buf = gat->head; buf != NULL; buf = buf->prev)
+		held += sizeof(*buf) + buf->alloc_sz;
+	for (buf = gat->cache; buf != NULL; buf = buf->prev)
+		held += sizeof(*buf) + buf->alloc_sz;
+	return held;
+}
+
+void cop_alloc_grp_temps_set_budget(struct cop_alloc_grp_temps *gat, struct cop_alloc_budget *budget)
+{
+	size_t held = grp_temps_held(gat);
+	if (gat->budget != NULL)
+		cop_alloc_budget_release(gat->budget, held);
+	if (budget != NULL)
+		budget_charge(budget, held, 1);
+	gat->budget = budget;
+}
+
+void cop_alloc_grp_temps_set_cache(struct cop_alloc_grp_temps *gat, size_t max_bytes)
+{
+	gat->cache_max = max_bytes;
+	grp_temps_trim_cache(gat, max_bytes);
+}
+
 void cop_alloc_grp_temps_free(struct cop_alloc_grp_temps *gat) {
+	cop_alloc_grp_temps_set_budget(gat, NULL);
+	cop_alloc_grp_temps_set_cache(gat, 0);
 	while (gat->head != NULL) {
 		struct cop_alloc_grp_temps_buf *tmp = gat->head;
 		gat->head = tmp->prev;
@@ -296,3 +1577,554 @@ void cop_alloc_grp_temps_free(struct cop_alloc_grp_temps *gat) {
 
 
 
+
+static void *alloc_slab(struct cop_alloc_iface *a, size_t size, size_t align)
+{
+	struct cop_alloc_slab *ctx = a->ctx;
+	unsigned char         *obj;
+
+	assert(align == 0 || (((align - 1) & align) == 0));
+
+	if (size > ctx->obj_sz || align > ctx->obj_align)
+		return NULL;
+
+	if ((obj = ctx->free_list) != NULL) {
+		ctx->free_list = *(void **)obj;
+		return obj;
+	}
+
+	if (ctx->cur == ctx->end) {
+		unsigned char *slab;
+		if (ctx->parent != NULL) {
+			slab = cop_alloc(ctx->parent, ctx->slab_sz, ctx->obj_align);
+			if (slab == NULL)
+				return NULL;
+		} else {
+			/* The first pointer of a malloced slab links it into the list of
+			 * slabs to be freed. The objects begin at the first aligned
+			 * address after it. */
+			void **hdr = malloc(sizeof(void *) + ctx->obj_align - 1 + ctx->slab_sz);
+			if (hdr == NULL)
+				return NULL;
+			*hdr       = ctx->slabs;
+			ctx->slabs = hdr;
+			slab       = (unsigned char *)(hdr + 1);
+			slab      += aalloc_alignoffset((size_t)slab, ctx->obj_align - 1);
+		}
+		ctx->cur = slab;
+		ctx->end = slab + ctx->slab_sz;
+	}
+
+	obj       = ctx->cur;
+	ctx->cur += ctx->obj_sz;
+	return obj;
+}
+
+static void free_slab(struct cop_falloc_iface *a, void *ptr)
+{
+	struct cop_alloc_slab *ctx = a->iface.ctx;
+	if (ptr != NULL) {
+		*(void **)ptr  = ctx->free_list;
+		ctx->free_list = ptr;
+	}
+}
+
+int cop_alloc_slab_init(struct cop_alloc_slab *slab, struct cop_falloc_iface *iface, struct cop_alloc_iface *parent, size_t obj_sz, size_t obj_align, size_t objs_per_slab)
+{
+	obj_align = obj_align ? obj_align : 16;
+	assert((((obj_align - 1) & obj_align) == 0) && "obj_align must be a power of two");
+	assert(obj_sz != 0);
+
+	/* Every object must be able to hold the free list pointer. */
+	obj_align = (obj_align < sizeof(void *)) ? sizeof(void *) : obj_align;
+	obj_sz    = (obj_sz < sizeof(void *)) ? sizeof(void *) : obj_sz;
+	obj_sz    = (obj_sz + obj_align - 1) & ~(obj_align - 1);
+
+	slab->obj_sz    = obj_sz;
+	slab->obj_align = obj_align;
+	slab->slab_sz   = obj_sz * (objs_per_slab ? objs_per_slab : 64);
+	slab->parent    = parent;
+	slab->free_list = NULL;
+	slab->cur       = NULL;
+	slab->end       = NULL;
+	slab->slabs     = NULL;
+	iface->iface.ctx   = slab;
+	iface->iface.alloc = alloc_slab;
+	iface->free        = free_slab;
+	return 0;
+}
+
+void cop_alloc_slab_free(struct cop_alloc_slab *slab)
+{
+	while (slab->slabs != NULL) {
+		void **tmp  = slab->slabs;
+		slab->slabs = *tmp;
+		free(tmp);
+	}
+}
+
+/* Each block begins with this header. The free list pointers are only
+ * valid while the block is free and occupy the first bytes of what would
+ * otherwise be the user data. The low bit of size is set for free blocks. A
+ * zero-sized used block terminates the region so that the last real block
+ * always has a physical successor. */
+struct cop_alloc_tlsf_block {
+	struct cop_alloc_tlsf_block *prev_phys;
+	size_t                       size;
+	struct cop_alloc_tlsf_block *next_free;
+	struct cop_alloc_tlsf_block *prev_free;
+};
+
+#define TLSF_HDR_SZ    (offsetof(struct cop_alloc_tlsf_block, next_free))
+#define TLSF_MIN_SZ    (sizeof(struct cop_alloc_tlsf_block) - TLSF_HDR_SZ)
+#define TLSF_SMALL_SZ  ((size_t)1 << COP_ALLOC_TLSF_FL_SHIFT)
+#define TLSF_FREE_BIT  ((size_t)1)
+
+static unsigned tlsf_ffs(unsigned x)
+{
+	assert(x != 0);
+#if defined(__clang__) || defined(__GNUC__)
+	return (unsigned)__builtin_ctz(x);
+#elif defined(_MSC_VER)
+	{
+		unsigned long idx;
+		_BitScanForward(&idx, x);
+		return (unsigned)idx;
+	}
+#else
+	{
+		unsigned i = 0;
+		while (!(x & 1u)) {
+			x >>= 1;
+			i++;
+		}
+		return i;
+	}
+#endif
+}
+
+static unsigned tlsf_fls(size_t x)
+{
+	assert(x != 0);
+#if defined(__clang__) || defined(__GNUC__)
+	return (unsigned)(sizeof(unsigned long long) * CHAR_BIT - 1 - __builtin_clzll(x));
+#elif defined(_MSC_VER) && defined(_WIN64)
+	{
+		unsigned long idx;
+		_BitScanReverse64(&idx, x);
+		return (unsigned)idx;
+	}
+#elif defined(_MSC_VER)
+	{
+		unsigned long idx;
+		_BitScanReverse(&idx, x);
+		return (unsigned)idx;
+	}
+#else
+	{
+		unsigned i = 0;
+		while (x >>= 1)
+			i++;
+		return i;
+	}
+#endif
+}
+
+static size_t tlsf_block_size(const struct cop_alloc_tlsf_block *b)
+{
+	return b->size & ~TLSF_FREE_BIT;
+}
+
+static struct cop_alloc_tlsf_block *tlsf_next_phys(const struct cop_alloc_tlsf_block *b)
+{
+	return (struct cop_alloc_tlsf_block *)((unsigned char *)b + TLSF_HDR_SZ + tlsf_block_size(b));
+}
+
+static void tlsf_mapping(size_t size, unsigned *p_fl, unsigned *p_sl)
+{
+	if (size < TLSF_SMALL_SZ) {
+		*p_fl = 0;
+		*p_sl = (unsigned)(size / (TLSF_SMALL_SZ / COP_ALLOC_TLSF_SL_COUNT));
+	} else {
+		unsigned f = tlsf_fls(size);
+		*p_sl = (unsigned)(size >> (f - COP_ALLOC_TLSF_SL_LOG2)) ^ (1u << COP_ALLOC_TLSF_SL_LOG2);
+		*p_fl = f - (COP_ALLOC_TLSF_FL_SHIFT - 1);
+	}
+}
+
+static void tlsf_insert(struct cop_alloc_tlsf *t, struct cop_alloc_tlsf_block *b)
+{
+	unsigned fl, sl;
+	tlsf_mapping(tlsf_block_size(b), &fl, &sl);
+	assert(fl < COP_ALLOC_TLSF_FL_COUNT);
+	b->size         |= TLSF_FREE_BIT;
+	b->prev_free     = NULL;
+	b->next_free     = t->blocks[fl][sl];
+	if (b->next_free != NULL)
+		b->next_free->prev_free = b;
+	t->blocks[fl][sl] = b;
+	t->fl_bitmap     |= 1u << fl;
+	t->sl_bitmap[fl] |= 1u << sl;
+	t->free_sz       += TLSF_HDR_SZ + tlsf_block_size(b);
+}
+
+static void tlsf_remove(struct cop_alloc_tlsf *t, struct cop_alloc_tlsf_block *b)
+{
+	unsigned fl, sl;
+	tlsf_mapping(tlsf_block_size(b), &fl, &sl);
+	if (b->next_free != NULL)
+		b->next_free->prev_free = b->prev_free;
+	if (b->prev_free != NULL) {
+		b->prev_free->next_free = b->next_free;
+	} else {
+		t->blocks[fl][sl] = b->next_free;
+		if (b->next_free == NULL) {
+			t->sl_bitmap[fl] &= ~(1u << sl);
+			if (t->sl_bitmap[fl] == 0)
+				t->fl_bitmap &= ~(1u << fl);
+		}
+	}
+	b->size    &= ~TLSF_FREE_BIT;
+	t->free_sz -= TLSF_HDR_SZ + tlsf_block_size(b);
+}
+
+/* Find a free block of at least size bytes. The size is first rounded up to
+ * the next list boundary so that any block in the list which is found is big
+ * enough. */
+static struct cop_alloc_tlsf_block *tlsf_locate(struct cop_alloc_tlsf *t, size_t size)
+{
+	unsigned fl, sl;
+	unsigned sl_map;
+
+	if (size >= TLSF_SMALL_SZ) {
+		size_t round = ((size_t)1 << (tlsf_fls(size) - COP_ALLOC_TLSF_SL_LOG2)) - 1;
+		if (size + round < size)
+			return NULL;
+		size += round;
+	}
+	tlsf_mapping(size, &fl, &sl);
+	if (fl >= COP_ALLOC_TLSF_FL_COUNT)
+		return NULL;
+
+	sl_map = t->sl_bitmap[fl] & (~0u << sl);
+	if (sl_map == 0) {
+		unsigned fl_map = (fl + 1 < COP_ALLOC_TLSF_FL_COUNT) ? (t->fl_bitmap & (~0u << (fl + 1))) : 0;
+		if (fl_map == 0)
+			return NULL;
+		fl     = tlsf_ffs(fl_map);
+		sl_map = t->sl_bitmap[fl];
+	}
+	sl = tlsf_ffs(sl_map);
+	return t->blocks[fl][sl];
+}
+
+/* Split the used block b so that it holds size bytes and return the remainder
+ * to the free lists if it is big enough to form a block. */
+static void tlsf_trim(struct cop_alloc_tlsf *t, struct cop_alloc_tlsf_block *b, size_t size)
+{
+	size_t bsz = tlsf_block_size(b);
+	if (bsz >= size + TLSF_HDR_SZ + TLSF_MIN_SZ) {
+		struct cop_alloc_tlsf_block *r = (struct cop_alloc_tlsf_block *)((unsigned char *)b + TLSF_HDR_SZ + size);
+		r->prev_phys = b;
+		r->size      = bsz - size - TLSF_HDR_SZ;
+		b->size      = size;
+		tlsf_next_phys(r)->prev_phys = r;
+		tlsf_insert(t, r);
+	}
+}
+
+static void *alloc_tlsf(struct cop_alloc_iface *a, size_t size, size_t align)
+{
+	struct cop_alloc_tlsf       *ctx = a->ctx;
+	struct cop_alloc_tlsf_block *b;
+	size_t                       gap;
+
+	assert(align == 0 || (((align - 1) & align) == 0));
+
+	if (size > ((size_t)1 << COP_ALLOC_TLSF_FL_MAX))
+		return NULL;
+	size = (size + COP_ALLOC_TLSF_ALIGN - 1) & ~(COP_ALLOC_TLSF_ALIGN - 1);
+	size = (size < TLSF_MIN_SZ) ? TLSF_MIN_SZ : size;
+
+	if (align <= COP_ALLOC_TLSF_ALIGN) {
+		if ((b = tlsf_locate(ctx, size)) == NULL)
+			return NULL;
+		tlsf_remove(ctx, b);
+		tlsf_trim(ctx, b, size);
+		return (unsigned char *)b + TLSF_HDR_SZ;
+	}
+
+	/* Over-allocate so that the leading gap can always be made into a free
+	 * block of its own. */
+	if ((b = tlsf_locate(ctx, size + align + TLSF_HDR_SZ + TLSF_MIN_SZ)) == NULL)
+		return NULL;
+	tlsf_remove(ctx, b);
+
+	gap = aalloc_alignoffset((size_t)b + TLSF_HDR_SZ, align - 1);
+	if (gap != 0 && gap < TLSF_HDR_SZ + TLSF_MIN_SZ)
+		gap += align * ((TLSF_HDR_SZ + TLSF_MIN_SZ - gap + align - 1) / align);
+	if (gap != 0) {
+		/* The block before b cannot be free as free blocks are always
+		 * merged, so the gap does not need to be merged with anything. */
+		struct cop_alloc_tlsf_block *lead = b;
+		b            = (struct cop_alloc_tlsf_block *)((unsigned char *)lead + gap);
+		b->prev_phys = lead;
+		b->size      = tlsf_block_size(lead) - gap;
+		lead->size   = gap - TLSF_HDR_SZ;
+		tlsf_next_phys(b)->prev_phys = b;
+		tlsf_insert(ctx, lead);
+	}
+	tlsf_trim(ctx, b, size);
+	return (unsigned char *)b + TLSF_HDR_SZ;
+}
+
+static void free_tlsf(struct cop_falloc_iface *a, void *ptr)
+{
+	struct cop_alloc_tlsf       *ctx = a->iface.ctx;
+	struct cop_alloc_tlsf_block *b;
+	struct cop_alloc_tlsf_block *next;
+
+	if (ptr == NULL)
+		return;
+
+	b = (struct cop_alloc_tlsf_block *)((unsigned char *)ptr - TLSF_HDR_SZ);
+	assert(!(b->size & TLSF_FREE_BIT) && "double free");
+
+	if (b->prev_phys != NULL && (b->prev_phys->size & TLSF_FREE_BIT)) {
+		struct cop_alloc_tlsf_block *prev = b->prev_phys;
+		tlsf_remove(ctx, prev);
+		prev->size += TLSF_HDR_SZ + b->size;
+		b           = prev;
+	}
+
+	next = tlsf_next_phys(b);
+	if (next->size & TLSF_FREE_BIT) {
+		tlsf_remove(ctx, next);
+		b->size += TLSF_HDR_SZ + next->size;
+		next     = tlsf_next_phys(b);
+	}
+
+	next->prev_phys = b;
+	tlsf_insert(ctx, b);
+}
+
+int cop_alloc_tlsf_init(struct cop_alloc_tlsf *tlsf, struct cop_falloc_iface *iface, struct cop_alloc_iface *parent, size_t pool_sz)
+{
+	unsigned char               *mem;
+	struct cop_alloc_tlsf_block *b;
+	struct cop_alloc_tlsf_block *end;
+
+	pool_sz &= ~(COP_ALLOC_TLSF_ALIGN - 1);
+	if (pool_sz < 2 * TLSF_HDR_SZ + TLSF_MIN_SZ || pool_sz - 2 * TLSF_HDR_SZ >= ((size_t)1 << COP_ALLOC_TLSF_FL_MAX))
+		return -1;
+
+	if (parent != NULL) {
+		tlsf->malloc_mem = NULL;
+		mem = cop_alloc(parent, pool_sz, COP_ALLOC_TLSF_ALIGN);
+	} else {
+		tlsf->malloc_mem = malloc(pool_sz + COP_ALLOC_TLSF_ALIGN - 1);
+		mem = tlsf->malloc_mem;
+		if (mem != NULL)
+			mem += aalloc_alignoffset((size_t)mem, COP_ALLOC_TLSF_ALIGN - 1);
+	}
+	if (mem == NULL)
+		return -1;
+
+	memset(tlsf->sl_bitmap, 0, sizeof(tlsf->sl_bitmap));
+	memset(tlsf->blocks, 0, sizeof(tlsf->blocks));
+	tlsf->fl_bitmap = 0;
+	tlsf->free_sz   = 0;
+	tlsf->pool_sz   = pool_sz;
+
+	b              = (struct cop_alloc_tlsf_block *)mem;
+	b->prev_phys   = NULL;
+	b->size        = pool_sz - 2 * TLSF_HDR_SZ;
+	end            = tlsf_next_phys(b);
+	end->prev_phys = b;
+	end->size      = 0;
+	tlsf_insert(tlsf, b);
+
+	iface->iface.ctx   = tlsf;
+	iface->iface.alloc = alloc_tlsf;
+	iface->free        = free_tlsf;
+	return 0;
+}
+
+void cop_alloc_tlsf_free(struct cop_alloc_tlsf *tlsf)
+{
+	free(tlsf->malloc_mem);
+}
+
+size_t cop_alloc_tlsf_used(const struct cop_alloc_tlsf *tlsf)
+{
+	return tlsf->pool_sz - tlsf->free_sz;
+}
+
+#if !_WIN32
+
+/* The interface handed to threads wraps the arena's virtual allocator so
+ * that its used and committed sizes can be published with atomic stores.
+ * The owner thread changes the allocator without holding the pool lock, so
+ * cop_alloc_tls_pool_query() must only read the published copies. */
+static void tls_pool_publish(struct cop_alloc_tls_pool_arena *arena)
+{
+	cop_atomic_size_store(&(arena->used_sz), arena->mem.used_sz);
+	cop_atomic_size_store(&(arena->committed_sz), arena->mem.protect_sz);
+}
+
+static void *tls_pool_alloc(struct cop_alloc_iface *a, size_t size, size_t align)
+{
+	struct cop_alloc_tls_pool_arena *arena = a->ctx;
+	void *p = cop_salloc(&(arena->inner), size, align);
+	tls_pool_publish(arena);
+	return p;
+}
+
+static size_t tls_pool_save(struct cop_salloc_iface *a)
+{
+	struct cop_alloc_tls_pool_arena *arena = a->iface.ctx;
+	return cop_salloc_save(&(arena->inner));
+}
+
+static void tls_pool_restore(struct cop_salloc_iface *a, size_t s)
+{
+	struct cop_alloc_tls_pool_arena *arena = a->iface.ctx;
+	cop_salloc_restore(&(arena->inner), s);
+	tls_pool_publish(arena);
+}
+
+static int tls_pool_extend(struct cop_salloc_iface *a, void *ptr, size_t old_size, size_t new_size)
+{
+	struct cop_alloc_tls_pool_arena *arena = a->iface.ctx;
+	int err = cop_salloc_extend(&(arena->inner), ptr, old_size, new_size);
+	tls_pool_publish(arena);
+	return err;
+}
+
+static void *tls_pool_zalloc(struct cop_salloc_iface *a, size_t size, size_t align)
+{
+	struct cop_alloc_tls_pool_arena *arena = a->iface.ctx;
+	void *p = cop_salloc_zalloc(&(arena->inner), size, align);
+	tls_pool_publish(arena);
+	return p;
+}
+
+static void cop_alloc_tls_pool_put(struct cop_alloc_tls_pool_arena *arena)
+{
+	struct cop_alloc_tls_pool *pool = arena->pool;
+	cop_salloc_restore(&(arena->iface), 0);
+	cop_mutex_lock(&(pool->lock));
+	arena->next_free = pool->free_list;
+	pool->free_list  = arena;
+	cop_mutex_unlock(&(pool->lock));
+}
+
+/* Called by the thread-local storage implementation when a thread which owns
+ * an arena exits. */
+static void cop_alloc_tls_pool_thread_exit(void *value)
+{
+	cop_alloc_tls_pool_put(value);
+}
+
+int cop_alloc_tls_pool_init(struct cop_alloc_tls_pool *pool, size_t reserve_sz, size_t default_align, size_t grow_sz)
+{
+	if (cop_mutex_create(&(pool->lock)))
+		return -1;
+	if (cop_tlskey_create_with_destructor(&(pool->key), cop_alloc_tls_pool_thread_exit)) {
+		cop_mutex_destroy(&(pool->lock));
+		return -1;
+	}
+	pool->reserve_sz    = reserve_sz;
+	pool->default_align = default_align;
+	pool->grow_sz       = grow_sz;
+	pool->arenas        = NULL;
+	pool->free_list     = NULL;
+	return 0;
+}
+
+void cop_alloc_tls_pool_free(struct cop_alloc_tls_pool *pool)
+{
+	/* Destroy the key first so that no destructors can run while we tear
+	 * down the arenas. */
+	cop_tlskey_destroy(pool->key);
+	while (pool->arenas != NULL) {
+		struct cop_alloc_tls_pool_arena *tmp = pool->arenas;
+		pool->arenas = tmp->next;
+		cop_alloc_virtual_free(&(tmp->mem));
+		free(tmp);
+	}
+	cop_mutex_destroy(&(pool->lock));
+}
+
+struct cop_salloc_iface *cop_alloc_tls_pool_get(struct cop_alloc_tls_pool *pool)
+{
+	struct cop_alloc_tls_pool_arena *arena = cop_tlskey_get_pointer(pool->key);
+
+	if (arena != NULL)
+		return &(arena->iface);
+
+	cop_mutex_lock(&(pool->lock));
+	if ((arena = pool->free_list) != NULL) {
+		pool->free_list = arena->next_free;
+	} else if ((arena = malloc(sizeof(*arena))) != NULL) {
+		if (cop_alloc_virtual_init(&(arena->mem), &(arena->inner), pool->reserve_sz, pool->default_align, pool->grow_sz)) {
+			free(arena);
+			arena = NULL;
+		} else {
+			memset(&(arena->iface), 0, sizeof(arena->iface));
+			arena->iface.iface.ctx   = arena;
+			arena->iface.iface.alloc = tls_pool_alloc;
+			arena->iface.save        = tls_pool_save;
+			arena->iface.restore     = tls_pool_restore;
+			arena->iface.extend      = tls_pool_extend;
+			arena->iface.zalloc      = tls_pool_zalloc;
+			arena->used_sz           = 0;
+			arena->committed_sz      = 0;
+			tls_pool_publish(arena);
+			arena->pool  = pool;
+			arena->next  = pool->arenas;
+			pool->arenas = arena;
+		}
+	}
+	cop_mutex_unlock(&(pool->lock));
+
+	if (arena == NULL)
+		return NULL;
+
+	cop_tlskey_set_pointer(pool->key, arena);
+	return &(arena->iface);
+}
+
+void cop_alloc_tls_pool_release(struct cop_alloc_tls_pool *pool)
+{
+	struct cop_alloc_tls_pool_arena *arena = cop_tlskey_get_pointer(pool->key);
+	if (arena != NULL) {
+		cop_tlskey_set_pointer(pool->key, NULL);
+		cop_alloc_tls_pool_put(arena);
+	}
+}
+
+void cop_alloc_tls_pool_query(struct cop_alloc_tls_pool *pool, struct cop_alloc_tls_pool_usage *usage)
+{
+	struct cop_alloc_tls_pool_arena *arena;
+
+	usage->nb_arenas = 0;
+	usage->nb_active = 0;
+	usage->reserved  = 0;
+	usage->committed = 0;
+	usage->used      = 0;
+
+	cop_mutex_lock(&(pool->lock));
+	for (arena = pool->arenas; arena != NULL; arena = arena->next) {
+		usage->nb_arenas++;
+		usage->reserved  += arena->mem.reserve_sz;
+		usage->committed += cop_atomic_size_load(&(arena->committed_sz));
+		usage->used      += cop_atomic_size_load(&(arena->used_sz));
+	}
+	for (arena = pool->free_list; arena != NULL; arena = arena->next_free)
+		usage->nb_active++;
+	usage->nb_active = usage->nb_arenas - usage->nb_active;
+	cop_mutex_unlock(&(pool->lock));
+}
+
+#endif
@@ -0,0 +1,257 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#include "cop/cop_alloc_trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char trace_magic[8] = "COPTRC1";
+
+static int trace_get_varint(const unsigned char *buf, size_t size, size_t *p_pos, size_t *p_value)
+{
+	size_t   value = 0;
+	unsigned shift = 0;
+	size_t   pos   = *p_pos;
+	for (;;) {
+		unsigned char c;
+		if (pos >= size || shift >= sizeof(size_t) * 8)
+			return -1;
+		c      = buf[pos++];
+		value |= (size_t)(c & 0x7F) << shift;
+		shift += 7;
+		if (!(c & 0x80))
+			break;
+	}
+	*p_pos   = pos;
+	*p_value = value;
+	return 0;
+}
+
+int cop_alloc_trace_decode(const unsigned char *buf, size_t size, size_t *p_pos, size_t *p_nb_saves, struct cop_alloc_trace_event *event)
+{
+	size_t pos = *p_pos;
+	size_t distance;
+
+	if (pos == 0) {
+		if (size < sizeof(trace_magic) || memcmp(buf, trace_magic, sizeof(trace_magic)) != 0)
+			return -1;
+		pos = sizeof(trace_magic);
+	}
+	if (pos >= size) {
+		*p_pos = pos;
+		return 0;
+	}
+
+	memset(event, 0, sizeof(*event));
+	event->type = buf[pos++];
+	switch (event->type) {
+	case COP_ALLOC_TRACE_ALLOC:
+	case COP_ALLOC_TRACE_ZALLOC:
+		if (trace_get_varint(buf, size, &pos, &(event->size)) || trace_get_varint(buf, size, &pos, &(event->align)))
+			return -1;
+		break;
+	case COP_ALLOC_TRACE_SAVE:
+		event->save_id = (*p_nb_saves)++;
+		break;
+	case COP_ALLOC_TRACE_RESTORE:
+		if (trace_get_varint(buf, size, &pos, &distance) || distance >= *p_nb_saves)
+			return -1;
+		event->save_id = *p_nb_saves - 1 - distance;
+		break;
+	case COP_ALLOC_TRACE_EXTEND:
+		if (trace_get_varint(buf, size, &pos, &(event->old_size)) || trace_get_varint(buf, size, &pos, &(event->size)))
+			return -1;
+		break;
+	case COP_ALLOC_TRACE_RESTORE_START:
+		break;
+	default:
+		return -1;
+	}
+
+	*p_pos = pos;
+	return 1;
+}
+
+#if COP_ALLOC_TRACE
+
+static void trace_put_varint(FILE *f, size_t value)
+{
+	while (value >= 0x80) {
+		putc((int)((value & 0x7F) | 0x80), f);
+		value >>= 7;
+	}
+	putc((int)value, f);
+}
+
+static void *trace_alloc_common(struct cop_alloc_trace *t, unsigned type, size_t size, size_t align)
+{
+	putc(type, t->f);
+	trace_put_varint(t->f, size);
+	trace_put_varint(t->f, align);
+	if (type == COP_ALLOC_TRACE_ZALLOC)
+		return cop_salloc_zalloc(t->target, size, align);
+	return cop_alloc(t->alloc_target, size, align);
+}
+
+static void *trace_alloc(struct cop_alloc_iface *a, size_t size, size_t align)
+{
+	return trace_alloc_common(a->ctx, COP_ALLOC_TRACE_ALLOC, size, align);
+}
+
+static void *trace_zalloc(struct cop_salloc_iface *a, size_t size, size_t align)
+{
+	return trace_alloc_common(a->iface.ctx, COP_ALLOC_TRACE_ZALLOC, size, align);
+}
+
+static size_t trace_save(struct cop_salloc_iface *a)
+{
+	struct cop_alloc_trace *t     = a->iface.ctx;
+	size_t                  value = cop_salloc_save(t->target);
+
+	/* Saves and restores are nested so the ids of the saves which may still
+	 * be restored to are kept on a stack. */
+	if (t->stack_sz == t->stack_cap) {
+		size_t                       new_cap = t->stack_cap ? (t->stack_cap * 2) : 64;
+		struct cop_alloc_trace_save *ns      = realloc(t->stack, new_cap * sizeof(*ns));
+		if (ns != NULL) {
+			t->stack     = ns;
+			t->stack_cap = new_cap;
+		}
+	}
+	if (t->stack_sz < t->stack_cap) {
+		t->stack[t->stack_sz].value = value;
+		t->stack[t->stack_sz].id    = t->nb_saves;
+		t->stack_sz++;
+	} else {
+		/* A restore to this save could not be recorded correctly. Zero is
+		 * not an event type so decoding fails from here. */
+		putc(0, t->f);
+	}
+
+	putc(COP_ALLOC_TRACE_SAVE, t->f);
+	t->nb_saves++;
+	return value;
+}
+
+static void trace_restore(struct cop_salloc_iface *a, size_t s)
+{
+	struct cop_alloc_trace *t = a->iface.ctx;
+
+	/* Saves above the one being restored to can no longer be used. */
+	while (t->stack_sz && t->stack[t->stack_sz - 1].value > s)
+		t->stack_sz--;
+	if (t->stack_sz && t->stack[t->stack_sz - 1].value == s) {
+		putc(COP_ALLOC_TRACE_RESTORE, t->f);
+		trace_put_varint(t->f, t->nb_saves - 1 - t->stack[t->stack_sz - 1].id);
+	} else {
+		/* The replay goes back to the start so none of the saves it has
+		 * seen may be restored to afterwards. */
+		putc(COP_ALLOC_TRACE_RESTORE_START, t->f);
+		t->stack_sz = 0;
+	}
+
+	cop_salloc_restore(t->target, s);
+}
+
+static int trace_extend(struct cop_salloc_iface *a, void *ptr, size_t old_size, size_t new_size)
+{
+	struct cop_alloc_trace *t = a->iface.ctx;
+	int                     err = cop_salloc_extend(t->target, ptr, old_size, new_size);
+	if (!err) {
+		putc(COP_ALLOC_TRACE_EXTEND, t->f);
+		trace_put_varint(t->f, old_size);
+		trace_put_varint(t->f, new_size);
+	}
+	return err;
+}
+
+static int trace_open_file(struct cop_alloc_trace *trace, const char *filename)
+{
+	if ((trace->f = fopen(filename, "wb")) == NULL)
+		return -1;
+	if (fwrite(trace_magic, 1, sizeof(trace_magic), trace->f) != sizeof(trace_magic)) {
+		fclose(trace->f);
+		return -1;
+	}
+	trace->alloc_target = NULL;
+	trace->target       = NULL;
+	trace->nb_saves     = 0;
+	trace->stack        = NULL;
+	trace->stack_sz     = 0;
+	trace->stack_cap    = 0;
+	return 0;
+}
+
+int cop_alloc_trace_open(struct cop_alloc_trace *trace, struct cop_salloc_iface *traced, struct cop_salloc_iface *target, const char *filename)
+{
+	if (trace_open_file(trace, filename))
+		return -1;
+	trace->alloc_target = &(target->iface);
+	trace->target       = target;
+	memset(traced, 0, sizeof(*traced));
+	traced->iface.ctx   = trace;
+	traced->iface.alloc = trace_alloc;
+	traced->save        = trace_save;
+	traced->restore     = trace_restore;
+	traced->extend      = (target->extend != NULL) ? trace_extend : NULL;
+	traced->zalloc      = trace_zalloc;
+	return 0;
+}
+
+int cop_alloc_trace_open_alloc(struct cop_alloc_trace *trace, struct cop_alloc_iface *traced, struct cop_alloc_iface *target, const char *filename)
+{
+	if (trace_open_file(trace, filename))
+		return -1;
+	trace->alloc_target = target;
+	traced->ctx         = trace;
+	traced->alloc       = trace_alloc;
+	return 0;
+}
+
+void cop_alloc_trace_close(struct cop_alloc_trace *trace)
+{
+	fclose(trace->f);
+	free(trace->stack);
+}
+
+#else
+
+int cop_alloc_trace_open(struct cop_alloc_trace *trace, struct cop_salloc_iface *traced, struct cop_salloc_iface *target, const char *filename)
+{
+	(void)trace;
+	(void)filename;
+	*traced = *target;
+	return 0;
+}
+
+int cop_alloc_trace_open_alloc(struct cop_alloc_trace *trace, struct cop_alloc_iface *traced, struct cop_alloc_iface *target, const char *filename)
+{
+	(void)trace;
+	(void)filename;
+	*traced = *target;
+	return 0;
+}
+
+void cop_alloc_trace_close(struct cop_alloc_trace *trace)
+{
+	(void)trace;
+}
+
+#endif
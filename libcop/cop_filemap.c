@@ -62,7 +62,7 @@ int cop_file_dump(const char *filename, const void *buffer, size_t size) {
 	return 0;
 }
 
-int cop_filemap_open(struct cop_filemap *map, const char *filename, unsigned flags) {
+int cop_filemap_open_at(struct cop_filemap *map, const char *filename, unsigned flags, void *addr) {
 	DWORD faccess;
 	DWORD mapprotect;
 	DWORD mapaccess;
@@ -115,7 +115,9 @@ int cop_filemap_open(struct cop_filemap *map, const char *filename, unsigned fla
 		return -1;
 	}
 
-	map->ptr = MapViewOfFile(map->maphandle, mapaccess, 0, 0, 0);
+	map->ptr = MapViewOfFileEx(map->maphandle, mapaccess, 0, 0, 0, addr);
+	if (map->ptr == NULL && addr != NULL && !(flags & COP_FILEMAP_FLAG_FIXED))
+		map->ptr = MapViewOfFile(map->maphandle, mapaccess, 0, 0, 0);
 	if (map->ptr == NULL) {
 		CloseHandle(map->maphandle);
 		CloseHandle(map->filehandle);
@@ -125,6 +127,10 @@ int cop_filemap_open(struct cop_filemap *map, const char *filename, unsigned fla
 	return 0;
 }
 
+int cop_filemap_open(struct cop_filemap *map, const char *filename, unsigned flags) {
+	return cop_filemap_open_at(map, filename, flags, NULL);
+}
+
 void cop_filemap_close(struct cop_filemap *map)
 {
 	UnmapViewOfFile(map->ptr);
@@ -140,8 +146,9 @@ void cop_filemap_close(struct cop_filemap *map)
 #include <sys/stat.h>
 #include <sys/mman.h>
 
-int cop_filemap_open(struct cop_filemap *map, const char *filename, unsigned flags)
+int cop_filemap_open_at(struct cop_filemap *map, const char *filename, unsigned flags, void *addr)
 {
+	int         mflags = (flags & COP_FILEMAP_SHARED) ? MAP_SHARED : MAP_PRIVATE;
 	int         oflags;
 	int         fd;
 	struct stat fs;
@@ -165,12 +172,32 @@ int cop_filemap_open(struct cop_filemap *map, const char *filename, unsigned fla
 		return COP_FILEMAP_ERR_FILE;
 	}
 
+#ifdef MAP_FIXED_NOREPLACE
+	if (addr != NULL && (flags & COP_FILEMAP_FLAG_FIXED))
+		mflags |= MAP_FIXED_NOREPLACE;
+#endif
+
 	map->size = fs.st_size;
-	map->ptr  = mmap(0, fs.st_size, prot, (flags & COP_FILEMAP_SHARED) ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	map->ptr  = mmap(addr, fs.st_size, prot, mflags, fd, 0);
 
 	close(fd);
 
-	return (map->ptr == MAP_FAILED) ? COP_FILEMAP_ERR_MAPPING : 0;
+	if (map->ptr == MAP_FAILED)
+		return COP_FILEMAP_ERR_MAPPING;
+
+	/* Without MAP_FIXED_NOREPLACE (or on kernels which do not know it), the
+	 * address is only a hint. */
+	if (addr != NULL && (flags & COP_FILEMAP_FLAG_FIXED) && map->ptr != addr) {
+		munmap(map->ptr, map->size);
+		return COP_FILEMAP_ERR_MAPPING;
+	}
+
+	return 0;
+}
+
+int cop_filemap_open(struct cop_filemap *map, const char *filename, unsigned flags)
+{
+	return cop_filemap_open_at(map, filename, flags, NULL);
 }
 
 void cop_filemap_close(struct cop_filemap *map)
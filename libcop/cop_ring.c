@@ -0,0 +1,90 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#include "cop/cop_ring.h"
+#include "cop/cop_thread.h"
+#include <assert.h>
+#include <string.h>
+
+void cop_ring_init(struct cop_ring *r, unsigned char *buf, size_t size)
+{
+	assert(size != 0 && size <= ((size_t)-1) / 2);
+	r->buf       = buf;
+	r->size      = size;
+	r->write_pos = 0;
+	r->read_pos  = 0;
+}
+
+static COP_ATTR_ALWAYSINLINE size_t cop_ring_fill_(const struct cop_ring *r, size_t write_pos, size_t read_pos)
+{
+	return (write_pos >= read_pos) ? (write_pos - read_pos) : (write_pos + 2 * r->size - read_pos);
+}
+
+static COP_ATTR_ALWAYSINLINE size_t cop_ring_advance_(const struct cop_ring *r, size_t pos, size_t nb)
+{
+	pos += nb;
+	return (pos >= 2 * r->size) ? (pos - 2 * r->size) : pos;
+}
+
+unsigned char *cop_ring_write_ptr(struct cop_ring *r, size_t *p_avail)
+{
+	size_t wp = r->write_pos;
+	*p_avail  = r->size - cop_ring_fill_(r, wp, cop_atomic_size_load(&(r->read_pos)));
+	return r->buf + ((wp >= r->size) ? (wp - r->size) : wp);
+}
+
+void cop_ring_commit_write(struct cop_ring *r, size_t nb)
+{
+	assert(nb <= r->size - cop_ring_fill_(r, r->write_pos, cop_atomic_size_load(&(r->read_pos))));
+	cop_atomic_size_store(&(r->write_pos), cop_ring_advance_(r, r->write_pos, nb));
+}
+
+const unsigned char *cop_ring_read_ptr(struct cop_ring *r, size_t *p_avail)
+{
+	size_t rp = r->read_pos;
+	*p_avail  = cop_ring_fill_(r, cop_atomic_size_load(&(r->write_pos)), rp);
+	return r->buf + ((rp >= r->size) ? (rp - r->size) : rp);
+}
+
+void cop_ring_commit_read(struct cop_ring *r, size_t nb)
+{
+	assert(nb <= cop_ring_fill_(r, cop_atomic_size_load(&(r->write_pos)), r->read_pos));
+	cop_atomic_size_store(&(r->read_pos), cop_ring_advance_(r, r->read_pos, nb));
+}
+
+size_t cop_ring_write(struct cop_ring *r, const void *data, size_t nb)
+{
+	size_t         avail;
+	unsigned char *p = cop_ring_write_ptr(r, &avail);
+	nb = (nb > avail) ? avail : nb;
+	memcpy(p, data, nb);
+	cop_ring_commit_write(r, nb);
+	return nb;
+}
+
+size_t cop_ring_read(struct cop_ring *r, void *data, size_t nb)
+{
+	size_t               avail;
+	const unsigned char *p = cop_ring_read_ptr(r, &avail);
+	nb = (nb > avail) ? avail : nb;
+	memcpy(data, p, nb);
+	cop_ring_commit_read(r, nb);
+	return nb;
+}
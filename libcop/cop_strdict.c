@@ -1,5 +1,7 @@
 #include "cop/cop_strdict.h"
+#include "cop/cop_thread.h"
 #include <string.h>
+#include <assert.h>
 
 static COP_ATTR_ALWAYSINLINE uint_fast64_t getikey(const struct cop_strh *p_str) {
 	return (((uint_fast64_t)p_str->len) << 32) | p_str->hash;
@@ -9,13 +11,72 @@ static COP_ATTR_ALWAYSINLINE uint_fast32_t keytolen(uint_fast64_t key) {
 	return (uint_least32_t)(key >> 32);
 }
 
+#if COP_STRDICT_PACKED
+
+/* The low bits of the hash are shared by every node in a subtree so the key
+ * is mixed before taking the tag from the top bits. */
+static COP_ATTR_ALWAYSINLINE unsigned keytotag(uint_fast64_t key) {
+	return (unsigned)(((((key ^ (key >> 16)) & 0xFFFFFFFFu) * 2654435761u) & 0xFFFFFFFFu) >> 20);
+}
+
+static void setsummary(struct cop_strdict_node *p_node, unsigned idx) {
+	const struct cop_strdict_node *p_kid   = p_node->kids[idx];
+	unsigned                       summary = 0;
+	unsigned                       i;
+	if (p_kid != NULL) {
+		summary = keytotag(p_kid->key) << COP_STRDICT_CHID_NB;
+		for (i = 0; i < COP_STRDICT_CHID_NB; i++)
+			if (p_kid->kids[i] != NULL)
+				summary |= 1u << i;
+	}
+	p_node->summaries[idx] = (uint_least16_t)summary;
+}
+
+/* Returns non-zero if a search for a key with the given tag which is about
+ * to move to child idx of p_node and then to child next_idx of that child
+ * can stop because the child neither has the key nor leads anywhere. */
+static COP_ATTR_ALWAYSINLINE int summarymiss(const struct cop_strdict_node *p_node, unsigned idx, unsigned tag, unsigned next_idx) {
+	unsigned summary = p_node->summaries[idx];
+	return (summary >> COP_STRDICT_CHID_NB) != tag && !(summary & (1u << next_idx));
+}
+
+#else
+
+static COP_ATTR_ALWAYSINLINE unsigned keytotag(uint_fast64_t key) {
+	(void)key;
+	return 0;
+}
+
+static COP_ATTR_ALWAYSINLINE void setsummary(struct cop_strdict_node *p_node, unsigned idx) {
+	(void)p_node;
+	(void)idx;
+}
+
+static COP_ATTR_ALWAYSINLINE int summarymiss(const struct cop_strdict_node *p_node, unsigned idx, unsigned tag, unsigned next_idx) {
+	(void)p_node;
+	(void)idx;
+	(void)tag;
+	(void)next_idx;
+	return 0;
+}
+
+#endif
+
+static void setsummaries(struct cop_strdict_node *p_node) {
+	unsigned i;
+	for (i = 0; i < COP_STRDICT_CHID_NB; i++)
+		setsummary(p_node, i);
+}
+
 void cop_strdict_node_init(struct cop_strdict_node *p_node, const struct cop_strh *p_strh, void *p_data) {
 	unsigned i;
+	assert(COP_STRDICT_NODE_ALIGN == 0 || ((size_t)p_node & (COP_STRDICT_NODE_ALIGN - 1u)) == 0);
 	p_node->key      = getikey(p_strh);
 	p_node->key_data = p_strh->ptr;
 	p_node->data     = p_data;
 	for (i = 0; i < COP_STRDICT_CHID_NB; i++)
 		p_node->kids[i] = NULL;
+	setsummaries(p_node);
 }
 
 void cop_strdict_node_init_by_cstr(struct cop_strdict_node *p_node, const char *p_persistent_cstr, void *p_data) {
@@ -64,18 +125,94 @@ cop_strdict_get
 	) {
 	uint_fast64_t ikey = getikey(p_key);
 	uint_fast64_t ukey = ikey;
+	unsigned      tag  = keytotag(ikey);
 	while (p_root != NULL) {
+		unsigned idx;
 		if (p_root->key == ikey && !memcmp(p_root->key_data, p_key->ptr, p_key->len)) {
 			if (pp_value != NULL)
 				*pp_value = p_root->data;
 			return 0;
 		}
-		p_root   = p_root->kids[ukey & COP_STRDICT_CHID_MASK];
-		ukey   >>= COP_STRDICT_CHID_BITS;
+		idx    = ukey & COP_STRDICT_CHID_MASK;
+		ukey >>= COP_STRDICT_CHID_BITS;
+		if (summarymiss(p_root, idx, tag, ukey & COP_STRDICT_CHID_MASK))
+			return -1;
+		p_root = p_root->kids[idx];
 	}
 	return -1;
 }
 
+size_t
+cop_strdict_get_multi
+	(const struct cop_strdict_node  *p_root
+	,const struct cop_strh          *p_keys
+	,size_t                          nb
+	,void                          **pp_values
+	,unsigned char                  *p_found
+	) {
+	const struct cop_strdict_node *p_node[COP_STRDICT_MULTI_LANES];
+	uint_fast64_t                  ikey[COP_STRDICT_MULTI_LANES];
+	uint_fast64_t                  ukey[COP_STRDICT_MULTI_LANES];
+	unsigned                       tag[COP_STRDICT_MULTI_LANES];
+	size_t                         idx[COP_STRDICT_MULTI_LANES];
+	size_t                         nb_found = 0;
+	size_t                         next     = 0;
+	unsigned                       nb_lanes = 0;
+	unsigned                       i;
+
+	if (p_root != NULL)
+		COP_HINT_PREFETCH(p_root);
+
+	while (next < nb || nb_lanes) {
+		/* Fill empty lanes with new searches. */
+		while (nb_lanes < COP_STRDICT_MULTI_LANES && next < nb) {
+			p_node[nb_lanes] = p_root;
+			ikey[nb_lanes]   = getikey(&(p_keys[next]));
+			ukey[nb_lanes]   = ikey[nb_lanes];
+			tag[nb_lanes]    = keytotag(ikey[nb_lanes]);
+			idx[nb_lanes]    = next++;
+			nb_lanes++;
+		}
+
+		/* Advance every search by one level. The child which each search
+		 * moves to is prefetched and not touched again until every other
+		 * search has moved. Finished searches are replaced by the last lane. */
+		for (i = 0; i < nb_lanes;) {
+			const struct cop_strdict_node *p_cur = p_node[i];
+			const struct cop_strh         *p_key = &(p_keys[idx[i]]);
+			void                          *p_val = NULL;
+			int                            found = 0;
+			if (p_cur != NULL) {
+				if (p_cur->key != ikey[i] || memcmp(p_cur->key_data, p_key->ptr, p_key->len)) {
+					unsigned kid = ukey[i] & COP_STRDICT_CHID_MASK;
+					ukey[i]  >>= COP_STRDICT_CHID_BITS;
+					p_cur      = summarymiss(p_cur, kid, tag[i], ukey[i] & COP_STRDICT_CHID_MASK) ? NULL : p_cur->kids[kid];
+					if (p_cur != NULL)
+						COP_HINT_PREFETCH(p_cur);
+					p_node[i]  = p_cur;
+					i++;
+					continue;
+				}
+				p_val = p_cur->data;
+				found = 1;
+			}
+			if (pp_values != NULL)
+				pp_values[idx[i]] = p_val;
+			if (p_found != NULL)
+				p_found[idx[i]] = (unsigned char)found;
+			nb_found += found;
+			nb_lanes--;
+			p_node[i] = p_node[nb_lanes];
+			ikey[i]   = ikey[nb_lanes];
+			ukey[i]   = ukey[nb_lanes];
+			tag[i]    = tag[nb_lanes];
+			idx[i]    = idx[nb_lanes];
+		}
+	}
+
+	return nb_found;
+}
+
 int
 cop_strdict_update
 	(struct cop_strdict_node *p_root
@@ -84,34 +221,116 @@ cop_strdict_update
 	) {
 	uint_fast64_t ikey = getikey(p_key);
 	uint_fast64_t ukey = ikey;
+	unsigned      tag  = keytotag(ikey);
 	while (p_root != NULL) {
+		unsigned idx;
 		if (p_root->key == ikey && !memcmp(p_root->key_data, p_key->ptr, p_key->len)) {
 			p_root->data = p_value;
 			return 0;
 		}
-		p_root   = p_root->kids[ukey & COP_STRDICT_CHID_MASK];
-		ukey   >>= COP_STRDICT_CHID_BITS;
+		idx    = ukey & COP_STRDICT_CHID_MASK;
+		ukey >>= COP_STRDICT_CHID_BITS;
+		if (summarymiss(p_root, idx, tag, ukey & COP_STRDICT_CHID_MASK))
+			return -1;
+		p_root = p_root->kids[idx];
 	}
 	return -1;
 }
 
+/* Update the summaries after a new leaf was linked in as child idx of
+ * p_parent which is child pidx of p_gparent. Either may be NULL if the leaf
+ * was linked in at or just below the root. */
+static COP_ATTR_ALWAYSINLINE void summariselink(struct cop_strdict_node *p_parent, unsigned idx, struct cop_strdict_node *p_gparent, unsigned pidx) {
+	if (p_parent != NULL)
+		setsummary(p_parent, idx);
+	if (p_gparent != NULL)
+		setsummary(p_gparent, pidx);
+}
+
+/* Returns the node with the same key as p_item if one exists. Otherwise,
+ * links in p_item and returns NULL. The link is a release store so that
+ * concurrent readers of a cop_strdict_rcu see an initialised node. */
+static
+struct cop_strdict_node *
+findorlink
+	(struct cop_strdict_node **pp_root
+	,struct cop_strdict_node  *p_item
+	) {
+	uint_fast32_t             len       = keytolen(p_item->key);
+	uint_fast64_t             ukey      = p_item->key;
+	struct cop_strdict_node  *p_node    = *pp_root;
+	struct cop_strdict_node  *p_parent  = NULL;
+	struct cop_strdict_node  *p_gparent = NULL;
+	unsigned                  idx       = 0;
+	unsigned                  pidx      = 0;
+	while (p_node != NULL) {
+		if (p_node->key == p_item->key && !memcmp(p_node->key_data, p_item->key_data, len))
+			return p_node;
+		p_gparent = p_parent;
+		pidx      = idx;
+		p_parent  = p_node;
+		idx       = ukey & COP_STRDICT_CHID_MASK;
+		pp_root   = &(p_node->kids[idx]);
+		p_node    = *pp_root;
+		ukey    >>= COP_STRDICT_CHID_BITS;
+	}
+	cop_atomic_ptr_store((void **)pp_root, p_item);
+	summariselink(p_parent, idx, p_gparent, pidx);
+	return NULL;
+}
+
 int
 cop_strdict_insert
 	(struct cop_strdict_node **pp_root
 	,struct cop_strdict_node  *p_item
 	) {
-	uint_fast32_t             len    = keytolen(p_item->key);
-	uint_fast64_t             ukey   = p_item->key;
-	struct cop_strdict_node  *p_node = *pp_root;
+	return (findorlink(pp_root, p_item) != NULL) ? -1 : 0;
+}
+
+struct cop_strdict_node *
+cop_strdict_find_or_insert
+	(struct cop_strdict_node **pp_root
+	,struct cop_strdict_node  *p_item
+	) {
+	struct cop_strdict_node *p_node = findorlink(pp_root, p_item);
+	return (p_node != NULL) ? p_node : p_item;
+}
+
+struct cop_strdict_node *
+cop_strdict_find_or_create
+	(struct cop_strdict_node **pp_root
+	,const struct cop_strh    *p_key
+	,cop_strdict_create_fn    *p_fn
+	,void                     *p_context
+	,int                      *p_created
+	) {
+	uint_fast64_t             ikey      = getikey(p_key);
+	uint_fast64_t             ukey      = ikey;
+	struct cop_strdict_node  *p_node    = *pp_root;
+	struct cop_strdict_node  *p_parent  = NULL;
+	struct cop_strdict_node  *p_gparent = NULL;
+	unsigned                  idx       = 0;
+	unsigned                  pidx      = 0;
+	if (p_created != NULL)
+		*p_created = 0;
 	while (p_node != NULL) {
-		if (p_node->key == p_item->key && !memcmp(p_node->key_data, p_item->key_data, len)) 
-			return -1;
-		pp_root  = &(p_node->kids[ukey & COP_STRDICT_CHID_MASK]);
-		p_node   = *pp_root;
-		ukey   >>= COP_STRDICT_CHID_BITS;
+		if (p_node->key == ikey && !memcmp(p_node->key_data, p_key->ptr, p_key->len))
+			return p_node;
+		p_gparent = p_parent;
+		pidx      = idx;
+		p_parent  = p_node;
+		idx       = ukey & COP_STRDICT_CHID_MASK;
+		pp_root   = &(p_node->kids[idx]);
+		p_node    = *pp_root;
+		ukey    >>= COP_STRDICT_CHID_BITS;
 	}
-	*pp_root = p_item;
-	return 0;
+	if ((p_node = p_fn(p_context, p_key)) != NULL) {
+		*pp_root = p_node;
+		summariselink(p_parent, idx, p_gparent, pidx);
+		if (p_created != NULL)
+			*p_created = 1;
+	}
+	return p_node;
 }
 
 static int findkid(const struct cop_strdict_node *p_node, uint_fast64_t offset) {
@@ -130,14 +349,22 @@ cop_strdict_delete
 	,const struct cop_strh    *p_key
 	) {
 
-	uint_fast64_t             ikey  = getikey(p_key);
-	uint_fast64_t             ukey  = ikey;
-	struct cop_strdict_node  *p_ret = *pp_root;
+	uint_fast64_t             ikey     = getikey(p_key);
+	uint_fast64_t             ukey     = ikey;
+	struct cop_strdict_node  *p_ret    = *pp_root;
+	struct cop_strdict_node  *p_owner  = NULL; /* node holding *pp_root */
+	struct cop_strdict_node  *p_oowner = NULL; /* node holding p_owner */
+	unsigned                  idx      = 0;
+	unsigned                  oidx     = 0;
 	while (p_ret != NULL) {
 		if (p_ret->key == ikey && !memcmp(p_ret->key_data, p_key->ptr, p_key->len))
 			break;
-		pp_root  = &(p_ret->kids[ukey & COP_STRDICT_CHID_MASK]);
-		p_ret   = *pp_root;
+		p_oowner = p_owner;
+		oidx     = idx;
+		p_owner  = p_ret;
+		idx      = ukey & COP_STRDICT_CHID_MASK;
+		pp_root  = &(p_ret->kids[idx]);
+		p_ret    = *pp_root;
 		ukey   >>= COP_STRDICT_CHID_BITS;
 	}
 	if (p_ret != NULL) {
@@ -154,8 +381,21 @@ cop_strdict_delete
 			pp_root                = &(p_kid->kids[kid_idx]);
 			p_kid->kids[kid_idx]   = p_ret;
 			ukey                 >>= COP_STRDICT_CHID_BITS;
+
+			/* The children of the owner are now final. */
+			if (p_owner != NULL)
+				setsummaries(p_owner);
+			p_oowner = p_owner;
+			oidx     = idx;
+			p_owner  = p_kid;
+			idx      = kid_idx;
 		}
 		*pp_root = NULL;
+		if (p_owner != NULL)
+			setsummaries(p_owner);
+		if (p_oowner != NULL)
+			setsummary(p_oowner, oidx);
+		setsummaries(p_ret);
 	}
 	return p_ret;
 }
@@ -189,6 +429,163 @@ cop_strdict_enumerate
 	return cop_strdict_enumerate_rec(p_root, p_fn, p_context, 0);
 }
 
+size_t cop_strdict_count(const struct cop_strdict_node *p_root) {
+	size_t   nb = 0;
+	unsigned i;
+	if (p_root != NULL) {
+		nb = 1;
+		for (i = 0; i < COP_STRDICT_CHID_NB; i++)
+			nb += cop_strdict_count(p_root->kids[i]);
+	}
+	return nb;
+}
+
+static unsigned getheight(const struct cop_strdict_node *p_node) {
+	unsigned height = 0;
+	unsigned i;
+	if (p_node == NULL)
+		return 0;
+	for (i = 0; i < COP_STRDICT_CHID_NB; i++) {
+		unsigned h = getheight(p_node->kids[i]);
+		if (h > height)
+			height = h;
+	}
+	return height + 1;
+}
+
+static void vebappend(struct cop_strdict_node *p_node, unsigned height, struct cop_strdict_node **pp_order, size_t *p_pos);
+
+/* Append the subtrees rooted depth levels below p_node in van Emde Boas
+ * order, keeping only the first height levels of each. */
+static void vebappendbottoms(struct cop_strdict_node *p_node, unsigned depth, unsigned height, struct cop_strdict_node **pp_order, size_t *p_pos) {
+	unsigned i;
+	if (p_node == NULL)
+		return;
+	if (depth == 0) {
+		vebappend(p_node, height, pp_order, p_pos);
+		return;
+	}
+	for (i = 0; i < COP_STRDICT_CHID_NB; i++)
+		vebappendbottoms(p_node->kids[i], depth - 1, height, pp_order, p_pos);
+}
+
+/* Append the first height levels of the subtree rooted at p_node in van Emde
+ * Boas order: the top half of the levels followed by each of the subtrees
+ * hanging from the bottom of the top half. */
+static void vebappend(struct cop_strdict_node *p_node, unsigned height, struct cop_strdict_node **pp_order, size_t *p_pos) {
+	unsigned top;
+	if (height == 1) {
+		pp_order[(*p_pos)++] = p_node;
+		return;
+	}
+	top = height / 2;
+	vebappend(p_node, top, pp_order, p_pos);
+	vebappendbottoms(p_node, top, height - top, pp_order, p_pos);
+}
+
+/* Everything needed to write a relocated node. This is held separately so
+ * that the destination array may overlap the nodes being relocated. */
+struct reloc {
+	uint_fast64_t            key;
+	const unsigned char     *key_data;
+	void                    *data;
+	struct cop_strdict_node *kids[COP_STRDICT_CHID_NB];
+};
+
+int
+cop_strdict_compact
+	(struct cop_strdict_node **pp_root
+	,struct cop_strdict_node  *p_nodes
+	,int                       layout
+	,struct cop_salloc_iface  *scratch
+	) {
+	size_t                    nb = cop_strdict_count(*pp_root);
+	size_t                    save;
+	size_t                    i;
+	unsigned                  j;
+	struct cop_strdict_node **pp_order;
+	struct reloc             *p_reloc;
+
+	assert(COP_STRDICT_NODE_ALIGN == 0 || ((size_t)p_nodes & (COP_STRDICT_NODE_ALIGN - 1u)) == 0);
+	if (nb == 0)
+		return 0;
+
+	save     = cop_salloc_save(scratch);
+	pp_order = cop_salloc(scratch, sizeof(*pp_order) * nb, 0);
+	p_reloc  = cop_salloc(scratch, sizeof(*p_reloc) * nb, 0);
+	if (pp_order == NULL || p_reloc == NULL) {
+		cop_salloc_restore(scratch, save);
+		return -1;
+	}
+
+	/* Find the order the nodes will be placed in. */
+	if (layout == COP_STRDICT_LAYOUT_VEB) {
+		size_t pos = 0;
+		vebappend(*pp_root, getheight(*pp_root), pp_order, &pos);
+	} else {
+		size_t head;
+		size_t tail = 1;
+		pp_order[0] = *pp_root;
+		for (head = 0; head < tail; head++)
+			for (j = 0; j < COP_STRDICT_CHID_NB; j++)
+				if (pp_order[head]->kids[j] != NULL)
+					pp_order[tail++] = pp_order[head]->kids[j];
+	}
+
+	/* Temporarily point the data of every node at its new location so that
+	 * the new child pointers can be found, then put the data back. */
+	for (i = 0; i < nb; i++) {
+		p_reloc[i].key      = pp_order[i]->key;
+		p_reloc[i].key_data = pp_order[i]->key_data;
+		p_reloc[i].data     = pp_order[i]->data;
+		pp_order[i]->data   = &(p_nodes[i]);
+	}
+	for (i = 0; i < nb; i++)
+		for (j = 0; j < COP_STRDICT_CHID_NB; j++)
+			p_reloc[i].kids[j] = (pp_order[i]->kids[j] != NULL) ? pp_order[i]->kids[j]->data : NULL;
+	for (i = 0; i < nb; i++)
+		pp_order[i]->data = p_reloc[i].data;
+
+	for (i = 0; i < nb; i++) {
+		p_nodes[i].key      = p_reloc[i].key;
+		p_nodes[i].key_data = p_reloc[i].key_data;
+		p_nodes[i].data     = p_reloc[i].data;
+		for (j = 0; j < COP_STRDICT_CHID_NB; j++)
+			p_nodes[i].kids[j] = p_reloc[i].kids[j];
+	}
+	for (i = 0; i < nb; i++)
+		setsummaries(&(p_nodes[i]));
+	*pp_root = p_nodes;
+
+	cop_salloc_restore(scratch, save);
+	return 0;
+}
+
+int
+cop_strdict_build
+	(struct cop_strdict_node **pp_root
+	,struct cop_strdict_node  *p_nodes
+	,const struct cop_strh    *p_keys
+	,void             *const  *pp_data
+	,size_t                    nb
+	,int                       layout
+	,struct cop_salloc_iface  *scratch
+	) {
+	struct cop_strdict_node *p_root = NULL;
+	size_t                   i;
+
+	/* Insert everything in place and then lay it out within the same array. */
+	for (i = 0; i < nb; i++) {
+		cop_strdict_node_init(&(p_nodes[i]), &(p_keys[i]), (pp_data != NULL) ? pp_data[i] : NULL);
+		if (cop_strdict_insert(&p_root, &(p_nodes[i])))
+			return -1;
+	}
+	if (cop_strdict_compact(&p_root, p_nodes, layout, scratch))
+		return -1;
+	*pp_root = p_root;
+	return 0;
+}
+
 void cop_strdict_node_to_key(const struct cop_strdict_node *p_node, struct cop_strh *p_key) {
 	p_key->hash = p_node->key & 0xFFFFFFFFu;
 	p_key->len  = p_node->key >> 32;
@@ -199,3 +596,234 @@ void *cop_strdict_node_to_data(const struct cop_strdict_node *p_node) {
 	return p_node->data;
 }
 
+/* The list of readers only changes when readers come and go, so a spin lock
+ * which yields is enough to protect it. */
+static void lockreaders(struct cop_strdict_rcu *p_rcu) {
+	size_t idle = 0;
+	while (!cop_atomic_size_cas(&(p_rcu->lock), &idle, 1)) {
+		idle = 0;
+		cop_thread_yield();
+	}
+}
+
+static void unlockreaders(struct cop_strdict_rcu *p_rcu) {
+	cop_atomic_size_store(&(p_rcu->lock), 0);
+}
+
+int cop_strdict_rcu_init(struct cop_strdict_rcu *p_rcu) {
+	p_rcu->root    = NULL;
+	p_rcu->seq     = 0;
+	p_rcu->epoch   = 1;
+	p_rcu->lock    = 0;
+	p_rcu->readers = NULL;
+	return 0;
+}
+
+void cop_strdict_rcu_destroy(struct cop_strdict_rcu *p_rcu) {
+	assert(p_rcu->readers == NULL);
+	(void)p_rcu;
+}
+
+void cop_strdict_rcu_reader_register(struct cop_strdict_rcu *p_rcu, struct cop_strdict_rcu_reader *p_reader) {
+	p_reader->rcu   = p_rcu;
+	p_reader->epoch = 0;
+	lockreaders(p_rcu);
+	p_reader->next  = p_rcu->readers;
+	p_rcu->readers  = p_reader;
+	unlockreaders(p_rcu);
+}
+
+void cop_strdict_rcu_reader_unregister(struct cop_strdict_rcu_reader *p_reader) {
+	struct cop_strdict_rcu         *p_rcu = p_reader->rcu;
+	struct cop_strdict_rcu_reader **pp_r;
+	lockreaders(p_rcu);
+	for (pp_r = &(p_rcu->readers); *pp_r != p_reader; pp_r = &((*pp_r)->next))
+		assert(*pp_r != NULL);
+	*pp_r = p_reader->next;
+	unlockreaders(p_rcu);
+}
+
+int
+cop_strdict_rcu_get
+	(struct cop_strdict_rcu_reader  *p_reader
+	,const struct cop_strh          *p_key
+	,void                          **pp_value
+	) {
+	struct cop_strdict_rcu  *p_rcu = p_reader->rcu;
+	uint_fast64_t            ikey  = getikey(p_key);
+	int                      ret;
+
+	/* Announce the search before loading anything from the dictionary. */
+	cop_atomic_size_store(&(p_reader->epoch), cop_atomic_size_load(&(p_rcu->epoch)));
+	cop_atomic_fence();
+
+	for (;;) {
+		size_t                   seq  = cop_atomic_size_load(&(p_rcu->seq));
+		uint_fast64_t            ukey = ikey;
+		struct cop_strdict_node *p_node;
+		if (seq & 1) {
+			cop_thread_yield();
+			continue;
+		}
+		p_node = cop_atomic_ptr_load((void **)&(p_rcu->root));
+		while (p_node != NULL) {
+			if (p_node->key == ikey && !memcmp(p_node->key_data, p_key->ptr, p_key->len))
+				break;
+			p_node   = cop_atomic_ptr_load((void **)&(p_node->kids[ukey & COP_STRDICT_CHID_MASK]));
+			ukey   >>= COP_STRDICT_CHID_BITS;
+		}
+		if (p_node != NULL) {
+			if (pp_value != NULL)
+				*pp_value = cop_atomic_ptr_load(&(p_node->data));
+			ret = 0;
+			break;
+		}
+
+		/* A miss is only trustworthy if no nodes were moved meanwhile. */
+		cop_atomic_fence();
+		if (cop_atomic_size_load(&(p_rcu->seq)) == seq) {
+			ret = -1;
+			break;
+		}
+	}
+
+	cop_atomic_size_store(&(p_reader->epoch), 0);
+	return ret;
+}
+
+int
+cop_strdict_rcu_insert
+	(struct cop_strdict_rcu  *p_rcu
+	,struct cop_strdict_node *p_item
+	) {
+	return (findorlink(&(p_rcu->root), p_item) != NULL) ? -1 : 0;
+}
+
+int
+cop_strdict_rcu_update
+	(struct cop_strdict_rcu  *p_rcu
+	,const struct cop_strh   *p_key
+	,void                    *p_value
+	) {
+	uint_fast64_t            ikey   = getikey(p_key);
+	uint_fast64_t            ukey   = ikey;
+	struct cop_strdict_node *p_node = p_rcu->root;
+	while (p_node != NULL) {
+		if (p_node->key == ikey && !memcmp(p_node->key_data, p_key->ptr, p_key->len)) {
+			cop_atomic_ptr_store(&(p_node->data), p_value);
+			return 0;
+		}
+		p_node   = p_node->kids[ukey & COP_STRDICT_CHID_MASK];
+		ukey   >>= COP_STRDICT_CHID_BITS;
+	}
+	return -1;
+}
+
+/* Unlike cop_strdict_delete(), which pushes the deleted node down to a leaf
+ * by swapping it with its children, this replaces the deleted node with a
+ * leaf from below it. Only the leaf moves (so only searches for the leaf can
+ * miss). The deleted node keeps all of its other children while it is
+ * reachable; if the leaf hangs directly from it, the link to the leaf is
+ * cleared which is why the move happens inside an odd seq window. */
+struct cop_strdict_node *
+cop_strdict_rcu_delete
+	(struct cop_strdict_rcu  *p_rcu
+	,const struct cop_strh   *p_key
+	) {
+	uint_fast64_t             ikey      = getikey(p_key);
+	uint_fast64_t             ukey      = ikey;
+	struct cop_strdict_node **pp_slot   = &(p_rcu->root);
+	struct cop_strdict_node  *p_ret     = *pp_slot;
+	struct cop_strdict_node  *p_owner   = NULL; /* node holding *pp_slot */
+	struct cop_strdict_node  *p_oowner  = NULL; /* node holding p_owner */
+	struct cop_strdict_node  *p_leaf;
+	struct cop_strdict_node  *p_lparent = NULL;
+	struct cop_strdict_node  *p_lgparent = NULL;
+	unsigned                  idx       = 0;
+	unsigned                  oidx      = 0;
+	unsigned                  lidx      = 0;
+	unsigned                  lgidx     = 0;
+	unsigned                  i;
+	int                       kid_idx;
+	size_t                    seq;
+
+	while (p_ret != NULL) {
+		if (p_ret->key == ikey && !memcmp(p_ret->key_data, p_key->ptr, p_key->len))
+			break;
+		p_oowner = p_owner;
+		oidx     = idx;
+		p_owner  = p_ret;
+		idx      = ukey & COP_STRDICT_CHID_MASK;
+		pp_slot  = &(p_ret->kids[idx]);
+		p_ret    = *pp_slot;
+		ukey   >>= COP_STRDICT_CHID_BITS;
+	}
+	if (p_ret == NULL)
+		return NULL;
+
+	/* Any leaf below the node has a key which may live in its place. */
+	p_leaf = p_ret;
+	while ((kid_idx = findkid(p_leaf, 0)) >= 0) {
+		p_lgparent = p_lparent;
+		lgidx      = lidx;
+		p_lparent  = p_leaf;
+		lidx       = kid_idx;
+		p_leaf     = p_leaf->kids[kid_idx];
+	}
+
+	if (p_leaf == p_ret) {
+		/* Unlinking a leaf cannot hide any other key. */
+		cop_atomic_ptr_store((void **)pp_slot, NULL);
+		if (p_owner != NULL)
+			setsummary(p_owner, idx);
+		if (p_oowner != NULL)
+			setsummary(p_oowner, oidx);
+		return p_ret;
+	}
+
+	seq = p_rcu->seq;
+	cop_atomic_size_store(&(p_rcu->seq), seq + 1);
+	cop_atomic_fence();
+
+	/* Unlink the leaf, give it the children of the deleted node (which no
+	 * longer include the leaf) and then put it in place of the node. */
+	cop_atomic_ptr_store((void **)&(p_lparent->kids[lidx]), NULL);
+	for (i = 0; i < COP_STRDICT_CHID_NB; i++)
+		cop_atomic_ptr_store((void **)&(p_leaf->kids[i]), p_ret->kids[i]);
+	cop_atomic_ptr_store((void **)pp_slot, p_leaf);
+
+	cop_atomic_size_store(&(p_rcu->seq), seq + 2);
+
+	/* Summaries are only used by the writer so can be fixed afterwards. */
+	if (p_lparent != p_ret) {
+		setsummary(p_lparent, lidx);
+		if (p_lgparent != p_ret)
+			setsummary(p_lgparent, lgidx);
+	}
+	setsummaries(p_leaf);
+	if (p_owner != NULL)
+		setsummary(p_owner, idx);
+
+	return p_ret;
+}
+
+void cop_strdict_rcu_synchronize(struct cop_strdict_rcu *p_rcu) {
+	size_t                         epoch = cop_atomic_size_fetch_add(&(p_rcu->epoch), 2) + 2;
+	struct cop_strdict_rcu_reader *p_reader;
+
+	/* Order the unlinking of nodes and the new epoch before looking at the
+	 * readers. Any reader which starts later cannot reach deleted nodes. */
+	cop_atomic_fence();
+
+	lockreaders(p_rcu);
+	for (p_reader = p_rcu->readers; p_reader != NULL; p_reader = p_reader->next) {
+		size_t e;
+		while ((e = cop_atomic_size_load(&(p_reader->epoch))) != 0 && e != epoch)
+			cop_thread_yield();
+	}
+	unlockreaders(p_rcu);
+}
+
+struct cop_strdict_node *cop_strdict_rcu_root(struct cop_strdict_rcu *p_rcu) {
+	return p_rcu->root;
+}
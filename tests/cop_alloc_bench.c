@@ -0,0 +1,387 @@
+#include "cop/cop_main.h"
+#include "cop/cop_alloc.h"
+#include "cop/cop_thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if _WIN32
+#include <windows.h>
+#include <malloc.h>
+#include <psapi.h>
+#else
+#include <time.h>
+#include <sys/resource.h>
+#endif
+
+/* Benchmark comparing the stack allocators (through the allocator interface
+ * and through the inline fast paths) with the system malloc over a matrix
+ * of allocation size distributions, alignments, save/restore nesting depths
+ * and thread counts. This is not run as part of the test suite.
+ *
+ * Usage: cop_alloc_bench [--json] [rounds]
+ *
+ * One line of CSV (or one JSON object) is written per configuration. Each
+ * thread owns its own allocator and performs the same work; ns_per_op is
+ * the wall time for all threads to complete divided by the number of
+ * operations made by one thread, so it stays constant when the allocator
+ * scales perfectly. Each round saves at every nesting level, makes a share
+ * of NB_ALLOCS_PER_ROUND allocations at each level and then restores every
+ * level (malloc frees the allocations made since the matching save).
+ *
+ * peak_rss_kb is the peak resident set size while the configuration ran.
+ * Only Linux allows the peak to be reset between configurations; elsewhere
+ * it is the peak of the process so far. */
+
+#define NB_ALLOCS_PER_ROUND (1024)
+#define DEFAULT_ROUNDS      (200)
+#define MAX_DEPTH           (16)
+#define MAX_THREADS         (4)
+
+#define ALLOC_MALLOC         (0)
+#define ALLOC_VIRTUAL        (1)
+#define ALLOC_VIRTUAL_FAST   (2)
+#define ALLOC_GRP_TEMPS      (3)
+#define ALLOC_GRP_TEMPS_FAST (4)
+#define NB_ALLOCATORS        (5)
+
+#define SIZES_SMALL (0)
+#define SIZES_MIXED (1)
+#define SIZES_LARGE (2)
+#define NB_SIZES    (3)
+
+static const char *allocator_names[NB_ALLOCATORS] = {"malloc", "virtual", "virtual_fast", "grp_temps", "grp_temps_fast"};
+static const char *size_names[NB_SIZES]           = {"small", "mixed", "large"};
+static const size_t   aligns[]                    = {0, 64, 4096};
+static const unsigned depths[]                    = {1, 4, 16};
+static const unsigned thread_counts[]             = {1, 2, MAX_THREADS};
+
+struct bench_job {
+	unsigned      allocator;
+	size_t        align;
+	unsigned      depth;
+	unsigned      rounds;
+	const size_t *sizes;
+	int           failed;
+};
+
+static double get_time_ns(void)
+{
+#if _WIN32
+	LARGE_INTEGER c, f;
+	QueryPerformanceCounter(&c);
+	QueryPerformanceFrequency(&f);
+	return c.QuadPart * (1e9 / f.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+static void peak_rss_reset(void)
+{
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if (f != NULL) {
+		fputs("5", f);
+		fclose(f);
+	}
+#endif
+}
+
+static unsigned long peak_rss_kb(void)
+{
+#if _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return 0;
+	return (unsigned long)(pmc.PeakWorkingSetSize / 1024);
+#else
+	struct rusage ru;
+#ifdef __linux__
+	char          line[128];
+	unsigned long kb = 0;
+	FILE         *f = fopen("/proc/self/status", "r");
+	if (f != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL && sscanf(line, "VmHWM: %lu kB", &kb) != 1)
+			kb = 0;
+		fclose(f);
+		if (kb)
+			return kb;
+	}
+#endif
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+#if __APPLE__
+	return (unsigned long)(ru.ru_maxrss / 1024);
+#else
+	return (unsigned long)ru.ru_maxrss;
+#endif
+#endif
+}
+
+/* Fill sizes with NB_ALLOCS_PER_ROUND values from the given distribution:
+ * small is uniform over 8-64 bytes, mixed is log-uniform over 8 bytes to
+ * 4 kB and large is uniform over 4-64 kB. */
+static void make_sizes(size_t *sizes, unsigned dist)
+{
+	unsigned long x = 0x12345678ul;
+	unsigned      i;
+	for (i = 0; i < NB_ALLOCS_PER_ROUND; i++) {
+		x = (x * 1103515245ul + 12345ul) & 0xFFFFFFFFul;
+		switch (dist) {
+		case SIZES_SMALL:
+			sizes[i] = 8 + (x >> 8) % 57;
+			break;
+		case SIZES_MIXED:
+			sizes[i] = ((size_t)8 << ((x >> 8) % 10)) + (x >> 20) % 8;
+			break;
+		default:
+			sizes[i] = 4096 + (x >> 8) % (60 * 1024 + 1);
+			break;
+		}
+	}
+}
+
+static volatile size_t sink;
+
+static void run_malloc(struct bench_job *job)
+{
+	void    *ptrs[NB_ALLOCS_PER_ROUND];
+	unsigned marks[MAX_DEPTH];
+	unsigned per_level = NB_ALLOCS_PER_ROUND / job->depth;
+	unsigned r, d, i;
+	for (r = 0; r < job->rounds; r++) {
+		i = 0;
+		for (d = 0; d < job->depth; d++) {
+			marks[d] = i;
+			for (; i < (d + 1) * per_level; i++) {
+				unsigned char *p;
+#if _WIN32
+				p = job->align ? _aligned_malloc(job->sizes[i], job->align) : malloc(job->sizes[i]);
+#else
+				void *vp = NULL;
+				if (!job->align)
+					vp = malloc(job->sizes[i]);
+				else if (posix_memalign(&vp, job->align, job->sizes[i]))
+					vp = NULL;
+				p = vp;
+#endif
+				if (p == NULL) {
+					job->failed = 1;
+					return;
+				}
+				p[0] = (unsigned char)i;
+				sink += (size_t)p;
+				ptrs[i] = p;
+			}
+		}
+		while (d--) {
+			while (i > marks[d]) {
+#if _WIN32
+				if (job->align)
+					_aligned_free(ptrs[--i]);
+				else
+					free(ptrs[--i]);
+#else
+				free(ptrs[--i]);
+#endif
+			}
+		}
+	}
+}
+
+static void run_iface(struct bench_job *job, struct cop_salloc_iface *iface)
+{
+	size_t   saves[MAX_DEPTH];
+	unsigned per_level = NB_ALLOCS_PER_ROUND / job->depth;
+	unsigned r, d, i;
+	for (r = 0; r < job->rounds; r++) {
+		i = 0;
+		for (d = 0; d < job->depth; d++) {
+			saves[d] = cop_salloc_save(iface);
+			for (; i < (d + 1) * per_level; i++) {
+				unsigned char *p = cop_salloc(iface, job->sizes[i], job->align);
+				if (p == NULL) {
+					job->failed = 1;
+					return;
+				}
+				p[0] = (unsigned char)i;
+				sink += (size_t)p;
+			}
+		}
+		while (d--)
+			cop_salloc_restore(iface, saves[d]);
+	}
+}
+
+static void run_virtual_fast(struct bench_job *job, struct cop_alloc_virtual *virt, struct cop_salloc_iface *iface)
+{
+	size_t   saves[MAX_DEPTH];
+	unsigned per_level = NB_ALLOCS_PER_ROUND / job->depth;
+	unsigned r, d, i;
+	for (r = 0; r < job->rounds; r++) {
+		i = 0;
+		for (d = 0; d < job->depth; d++) {
+			saves[d] = cop_salloc_save(iface);
+			for (; i < (d + 1) * per_level; i++) {
+				unsigned char *p = cop_alloc_virtual_alloc_fast(virt, job->sizes[i], job->align);
+				if (p == NULL) {
+					job->failed = 1;
+					return;
+				}
+				p[0] = (unsigned char)i;
+				sink += (size_t)p;
+			}
+		}
+		while (d--)
+			cop_salloc_restore(iface, saves[d]);
+	}
+}
+
+static void run_grp_temps_fast(struct bench_job *job, struct cop_alloc_grp_temps *gat, struct cop_salloc_iface *iface)
+{
+	size_t   saves[MAX_DEPTH];
+	unsigned per_level = NB_ALLOCS_PER_ROUND / job->depth;
+	unsigned r, d, i;
+	for (r = 0; r < job->rounds; r++) {
+		i = 0;
+		for (d = 0; d < job->depth; d++) {
+			saves[d] = cop_salloc_save(iface);
+			for (; i < (d + 1) * per_level; i++) {
+				unsigned char *p = cop_alloc_grp_temps_alloc_fast(gat, job->sizes[i], job->align);
+				if (p == NULL) {
+					job->failed = 1;
+					return;
+				}
+				p[0] = (unsigned char)i;
+				sink += (size_t)p;
+			}
+		}
+		while (d--)
+			cop_salloc_restore(iface, saves[d]);
+	}
+}
+
+static void *bench_thread(void *argument)
+{
+	struct bench_job          *job = argument;
+	struct cop_alloc_virtual   virt;
+	struct cop_alloc_grp_temps gat;
+	struct cop_salloc_iface    iface;
+
+	switch (job->allocator) {
+	case ALLOC_MALLOC:
+		run_malloc(job);
+		break;
+	case ALLOC_VIRTUAL:
+	case ALLOC_VIRTUAL_FAST:
+		if (cop_alloc_virtual_init(&virt, &iface, 256*1024*1024, 16, 1024*1024)) {
+			job->failed = 1;
+			break;
+		}
+		if (job->allocator == ALLOC_VIRTUAL)
+			run_iface(job, &iface);
+		else
+			run_virtual_fast(job, &virt, &iface);
+		cop_alloc_virtual_free(&virt);
+		break;
+	default:
+		if (cop_alloc_grp_temps_init(&gat, &iface, 64*1024, 1024*1024, 16)) {
+			job->failed = 1;
+			break;
+		}
+		if (job->allocator == ALLOC_GRP_TEMPS)
+			run_iface(job, &iface);
+		else
+			run_grp_temps_fast(job, &gat, &iface);
+		cop_alloc_grp_temps_free(&gat);
+		break;
+	}
+
+	return NULL;
+}
+
+int test_main(int argc, char *argv[]) {
+	static size_t sizes[NB_SIZES][NB_ALLOCS_PER_ROUND];
+	unsigned      rounds = DEFAULT_ROUNDS;
+	int           json = 0;
+	int           first = 1;
+	int           failed = 0;
+	unsigned      a, s, al, d, t, i;
+
+	for (i = 1; i < (unsigned)argc; i++) {
+		if (!strcmp(argv[i], "--json"))
+			json = 1;
+		else if ((rounds = (unsigned)strtoul(argv[i], NULL, 0)) == 0) {
+			fprintf(stderr, "usage: %s [--json] [rounds]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (s = 0; s < NB_SIZES; s++)
+		make_sizes(sizes[s], s);
+
+	if (json)
+		printf("[");
+	else
+		printf("allocator,sizes,align,depth,threads,ns_per_op,peak_rss_kb\n");
+
+	for (a = 0; a < NB_ALLOCATORS; a++) {
+		for (s = 0; s < NB_SIZES; s++) {
+			for (al = 0; al < sizeof(aligns) / sizeof(aligns[0]); al++) {
+				for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+					for (t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+						struct bench_job jobs[MAX_THREADS];
+						cop_thread       threads[MAX_THREADS];
+						unsigned         nb_threads = thread_counts[t];
+						double           t0;
+						double           ns_per_op;
+						int              job_failed = 0;
+
+						for (i = 0; i < nb_threads; i++) {
+							jobs[i].allocator = a;
+							jobs[i].align     = aligns[al];
+							jobs[i].depth     = depths[d];
+							jobs[i].rounds    = rounds;
+							jobs[i].sizes     = sizes[s];
+							jobs[i].failed    = 0;
+						}
+
+						peak_rss_reset();
+						t0 = get_time_ns();
+						for (i = 1; i < nb_threads; i++)
+							if (cop_thread_create(&(threads[i]), bench_thread, &(jobs[i]), 0, 0))
+								abort();
+						bench_thread(&(jobs[0]));
+						for (i = 1; i < nb_threads; i++)
+							cop_thread_join(threads[i], NULL);
+						ns_per_op = (get_time_ns() - t0) / ((double)rounds * NB_ALLOCS_PER_ROUND);
+
+						for (i = 0; i < nb_threads; i++)
+							job_failed |= jobs[i].failed;
+						if (job_failed) {
+							fprintf(stderr, "%s failed with sizes=%s align=%lu depth=%u threads=%u\n", allocator_names[a], size_names[s], (unsigned long)aligns[al], depths[d], nb_threads);
+							failed = 1;
+							continue;
+						}
+
+						if (json)
+							printf("%s\n {\"allocator\": \"%s\", \"sizes\": \"%s\", \"align\": %lu, \"depth\": %u, \"threads\": %u, \"ns_per_op\": %.3f, \"peak_rss_kb\": %lu}", first ? "" : ",", allocator_names[a], size_names[s], (unsigned long)aligns[al], depths[d], nb_threads, ns_per_op, peak_rss_kb());
+						else
+							printf("%s,%s,%lu,%u,%u,%.3f,%lu\n", allocator_names[a], size_names[s], (unsigned long)aligns[al], depths[d], nb_threads, ns_per_op, peak_rss_kb());
+						fflush(stdout);
+						first = 0;
+					}
+				}
+			}
+		}
+	}
+
+	if (json)
+		printf("\n]\n");
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+COP_MAIN(test_main)
@@ -0,0 +1,239 @@
+#include "cop/cop_main.h"
+#include "cop/cop_alloc.h"
+#include "cop/cop_alloc_trace.h"
+#include "cop/cop_filemap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* Replays an allocation trace recorded with cop_alloc_trace_open() against
+ * each of the stack allocator implementations and reports the time taken
+ * per operation, the peak memory committed and the fragmentation (the
+ * fraction of the memory committed at the moment of the peak of live
+ * requested bytes which was not holding requested bytes).
+ *
+ * Usage: cop_alloc_replay trace [grow_sz [initial_sz [max_grow]]]
+ *
+ * grow_sz is used by the virtual allocators and initial_sz and max_grow by
+ * the group temporaries allocator. */
+
+#define TARGET_VIRTUAL            (0)
+#define TARGET_VIRTUAL_CONCURRENT (1)
+#define TARGET_GRP_TEMPS          (2)
+#define NB_TARGETS                (3)
+
+static const char *target_names[NB_TARGETS] = {"virtual", "virtual_concurrent", "grp_temps"};
+
+struct replay_params {
+	size_t reserve_sz;
+	size_t grow_sz;
+	size_t initial_sz;
+	size_t max_grow;
+};
+
+struct replay_target {
+	unsigned                   kind;
+	struct cop_alloc_virtual   virt;
+	struct cop_alloc_grp_temps gat;
+	struct cop_salloc_iface    iface;
+};
+
+struct replay_result {
+	double ns_per_op;
+	size_t peak_committed;
+	size_t peak_live;
+	size_t committed_at_peak_live;
+	size_t nb_failed;
+};
+
+static double get_time_ns(void)
+{
+#if _WIN32
+	LARGE_INTEGER c, f;
+	QueryPerformanceCounter(&c);
+	QueryPerformanceFrequency(&f);
+	return c.QuadPart * (1e9 / f.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+static int target_init(struct replay_target *t, unsigned kind, const struct replay_params *params)
+{
+	t->kind = kind;
+	switch (kind) {
+	case TARGET_VIRTUAL:
+		return cop_alloc_virtual_init(&(t->virt), &(t->iface), params->reserve_sz, 16, params->grow_sz);
+	case TARGET_VIRTUAL_CONCURRENT:
+		return cop_alloc_virtual_init_concurrent(&(t->virt), &(t->iface), params->reserve_sz, 16, params->grow_sz);
+	default:
+		return cop_alloc_grp_temps_init(&(t->gat), &(t->iface), params->initial_sz, params->max_grow, 16);
+	}
+}
+
+static size_t target_committed(struct replay_target *t)
+{
+	struct cop_alloc_stats stats;
+	if (t->kind == TARGET_GRP_TEMPS)
+		cop_alloc_grp_temps_get_stats(&(t->gat), &stats);
+	else
+		cop_alloc_virtual_get_stats(&(t->virt), &stats);
+	return stats.committed;
+}
+
+static void target_free(struct replay_target *t)
+{
+	if (t->kind == TARGET_GRP_TEMPS)
+		cop_alloc_grp_temps_free(&(t->gat));
+	else
+		cop_alloc_virtual_free(&(t->virt));
+}
+
+/* Run the events against the target. If result is not NULL, the memory use
+ * is measured after every allocation (which makes the timing meaningless).
+ * save_values and save_live must have room for every save in the trace. */
+static void replay(const struct cop_alloc_trace_event *events, size_t nb_events, struct replay_target *t, size_t *save_values, size_t *save_live, struct replay_result *result)
+{
+	unsigned char *last  = NULL;
+	size_t         live  = 0;
+	size_t         start = cop_salloc_save(&(t->iface));
+	size_t         i;
+
+	for (i = 0; i < nb_events; i++) {
+		const struct cop_alloc_trace_event *ev = &(events[i]);
+		switch (ev->type) {
+		case COP_ALLOC_TRACE_ALLOC:
+		case COP_ALLOC_TRACE_ZALLOC:
+			last = (ev->type == COP_ALLOC_TRACE_ZALLOC) ? cop_salloc_zalloc(&(t->iface), ev->size, ev->align) : cop_salloc(&(t->iface), ev->size, ev->align);
+			if (last != NULL) {
+				last[0] = 0;
+				live   += ev->size;
+			}
+			break;
+		case COP_ALLOC_TRACE_SAVE:
+			save_values[ev->save_id] = cop_salloc_save(&(t->iface));
+			save_live[ev->save_id]   = live;
+			break;
+		case COP_ALLOC_TRACE_RESTORE:
+			cop_salloc_restore(&(t->iface), save_values[ev->save_id]);
+			live = save_live[ev->save_id];
+			last = NULL;
+			break;
+		case COP_ALLOC_TRACE_RESTORE_START:
+			cop_salloc_restore(&(t->iface), start);
+			live = 0;
+			last = NULL;
+			break;
+		case COP_ALLOC_TRACE_EXTEND:
+			if (last != NULL && cop_salloc_extend(&(t->iface), last, ev->old_size, ev->size) == 0)
+				live += ev->size - ev->old_size;
+			else if (result != NULL)
+				result->nb_failed++;
+			break;
+		}
+		if (result != NULL) {
+			if ((ev->type == COP_ALLOC_TRACE_ALLOC || ev->type == COP_ALLOC_TRACE_ZALLOC) && last == NULL)
+				result->nb_failed++;
+			if (ev->type != COP_ALLOC_TRACE_SAVE && ev->type != COP_ALLOC_TRACE_RESTORE && ev->type != COP_ALLOC_TRACE_RESTORE_START) {
+				size_t committed = target_committed(t);
+				if (committed > result->peak_committed)
+					result->peak_committed = committed;
+				if (live > result->peak_live) {
+					result->peak_live              = live;
+					result->committed_at_peak_live = committed;
+				}
+			}
+		}
+	}
+}
+
+int test_main(int argc, char *argv[]) {
+	struct cop_filemap            map;
+	struct cop_alloc_trace_event *events;
+	struct replay_params          params;
+	size_t                       *save_values;
+	size_t                       *save_live;
+	size_t                        nb_events = 0;
+	size_t                        cap = 1024;
+	size_t                        nb_saves = 0;
+	size_t                        pos = 0;
+	unsigned                      k;
+	int                           err;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s trace [grow_sz [initial_sz [max_grow]]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	params.reserve_sz = (size_t)1 << ((sizeof(size_t) > 4) ? 36 : 30);
+	params.grow_sz    = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1024*1024;
+	params.initial_sz = (argc > 3) ? strtoul(argv[3], NULL, 0) : 64*1024;
+	params.max_grow   = (argc > 4) ? strtoul(argv[4], NULL, 0) : 1024*1024;
+
+	if (cop_filemap_open(&map, argv[1], COP_FILEMAP_FLAG_R)) {
+		fprintf(stderr, "could not open %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	/* Decode everything up front so that decoding is not timed. */
+	if ((events = malloc(sizeof(*events) * cap)) == NULL)
+		abort();
+	while ((err = cop_alloc_trace_decode(map.ptr, map.size, &pos, &nb_saves, &(events[nb_events]))) == 1) {
+		if (++nb_events == cap) {
+			cap *= 2;
+			if ((events = realloc(events, sizeof(*events) * cap)) == NULL)
+				abort();
+		}
+	}
+	cop_filemap_close(&map);
+	if (err < 0) {
+		fprintf(stderr, "%s is not a valid trace (error at byte %lu)\n", argv[1], (unsigned long)pos);
+		return EXIT_FAILURE;
+	}
+
+	save_values = malloc(sizeof(size_t) * (nb_saves + 1));
+	save_live   = malloc(sizeof(size_t) * (nb_saves + 1));
+	if (save_values == NULL || save_live == NULL)
+		abort();
+
+	printf("%lu events, %lu saves, grow_sz=%lu initial_sz=%lu max_grow=%lu\n", (unsigned long)nb_events, (unsigned long)nb_saves, (unsigned long)params.grow_sz, (unsigned long)params.initial_sz, (unsigned long)params.max_grow);
+	printf("%-20s %12s %16s %16s %14s %8s\n", "allocator", "ns/op", "peak committed", "peak live", "fragmentation", "failed");
+
+	for (k = 0; k < NB_TARGETS; k++) {
+		struct replay_target t;
+		struct replay_result r;
+		double               t0;
+
+		memset(&r, 0, sizeof(r));
+
+		if (target_init(&t, k, &params)) {
+			fprintf(stderr, "could not initialise %s\n", target_names[k]);
+			continue;
+		}
+		t0 = get_time_ns();
+		replay(events, nb_events, &t, save_values, save_live, NULL);
+		r.ns_per_op = (get_time_ns() - t0) / (nb_events ? nb_events : 1);
+		target_free(&t);
+
+		if (target_init(&t, k, &params))
+			continue;
+		replay(events, nb_events, &t, save_values, save_live, &r);
+		target_free(&t);
+
+		printf("%-20s %12.2f %16lu %16lu %13.1f%% %8lu\n", target_names[k], r.ns_per_op, (unsigned long)r.peak_committed, (unsigned long)r.peak_live, r.committed_at_peak_live ? (100.0 * (1.0 - (double)r.peak_live / r.committed_at_peak_live)) : 0.0, (unsigned long)r.nb_failed);
+	}
+
+	free(save_values);
+	free(save_live);
+	free(events);
+	return 0;
+}
+
+COP_MAIN(test_main)
@@ -0,0 +1,1555 @@
+#include "cop/cop_main.h"
+#include "cop/cop_alloc.h"
+#include "cop/cop_alloc_tls_pool.h"
+#include "cop/cop_thread.h"
+#include "cop/cop_strdict.h"
+#include "cop/cop_ring.h"
+#include "cop/cop_filemap.h"
+#include "cop/cop_alloc_trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#if _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define TLS_POOL_THREADS (4)
+
+#if !_WIN32
+struct tls_pool_thread {
+	struct cop_alloc_tls_pool *pool;
+	cop_thread                 thread;
+	int                        failed;
+};
+
+static void *tls_pool_thread_proc(void *argument)
+{
+	struct tls_pool_thread  *ctx   = argument;
+	struct cop_salloc_iface *iface = cop_alloc_tls_pool_get(ctx->pool);
+	unsigned i;
+
+	if (iface == NULL || iface != cop_alloc_tls_pool_get(ctx->pool)) {
+		ctx->failed = 1;
+		return NULL;
+	}
+
+	for (i = 0; i < 1000; i++) {
+		size_t         s = cop_salloc_save(iface);
+		unsigned char *p = cop_salloc(iface, 1000 + i, 64);
+		if (p == NULL || ((size_t)p & 63) != 0) {
+			ctx->failed = 1;
+			return NULL;
+		}
+		memset(p, i & 0xFF, 1000 + i);
+		cop_salloc_restore(iface, s);
+	}
+
+	return NULL;
+}
+
+static int run_tls_pool_threads(struct cop_alloc_tls_pool *pool)
+{
+	struct tls_pool_thread          threads[TLS_POOL_THREADS];
+	struct cop_alloc_tls_pool_usage usage;
+	unsigned i;
+	int failed = 0;
+
+	for (i = 0; i < TLS_POOL_THREADS; i++) {
+		threads[i].pool   = pool;
+		threads[i].failed = 0;
+		if (cop_thread_create(&(threads[i].thread), tls_pool_thread_proc, &(threads[i]), 0, 0)) {
+			fprintf(stderr, "could not create thread\n");
+			abort();
+		}
+	}
+
+	/* Query while the threads are allocating - this must be safe. The used
+	 * and committed figures are read separately so may not agree with each
+	 * other, but nothing can be committed beyond the reservation. */
+	for (i = 0; i < 100; i++) {
+		cop_alloc_tls_pool_query(pool, &usage);
+		if (usage.reserved < usage.committed) {
+			fprintf(stderr, "inconsistent tls pool usage while threads are running\n");
+			failed = 1;
+		}
+	}
+
+	for (i = 0; i < TLS_POOL_THREADS; i++) {
+		cop_thread_join(threads[i].thread, NULL);
+		if (threads[i].failed) {
+			fprintf(stderr, "tls pool thread %u failed\n", i);
+			failed = 1;
+		}
+	}
+
+	return failed ? -1 : 0;
+}
+
+static int test_tls_pool(void)
+{
+	struct cop_alloc_tls_pool       pool;
+	struct cop_alloc_tls_pool_usage usage;
+	struct cop_salloc_iface        *iface;
+
+	if (cop_alloc_tls_pool_init(&pool, 16*1024*1024, 16, 64*1024)) {
+		fprintf(stderr, "could not create tls pool\n");
+		return -1;
+	}
+
+	if (run_tls_pool_threads(&pool) || run_tls_pool_threads(&pool)) {
+		cop_alloc_tls_pool_free(&pool);
+		return -1;
+	}
+
+	cop_alloc_tls_pool_query(&pool, &usage);
+	if (usage.nb_arenas < 1 || usage.nb_arenas > TLS_POOL_THREADS || usage.nb_active != 0 || usage.used != 0) {
+		fprintf(stderr, "expected exited threads to return their arenas to the pool (arenas=%lu, active=%lu, used=%lu)\n", (unsigned long)usage.nb_arenas, (unsigned long)usage.nb_active, (unsigned long)usage.used);
+		cop_alloc_tls_pool_free(&pool);
+		return -1;
+	}
+
+	iface = cop_alloc_tls_pool_get(&pool);
+	if (iface == NULL || cop_salloc(iface, 12345, 0) == NULL) {
+		fprintf(stderr, "expected main thread to be able to use the tls pool\n");
+		cop_alloc_tls_pool_free(&pool);
+		return -1;
+	}
+
+	cop_alloc_tls_pool_query(&pool, &usage);
+	if (usage.nb_active != 1 || usage.used < 12345 || usage.committed < usage.used || usage.reserved < usage.committed) {
+		fprintf(stderr, "unexpected tls pool usage after main thread allocation\n");
+		cop_alloc_tls_pool_free(&pool);
+		return -1;
+	}
+
+	cop_alloc_tls_pool_release(&pool);
+	cop_alloc_tls_pool_query(&pool, &usage);
+	if (usage.nb_active != 0) {
+		fprintf(stderr, "expected release to return the arena\n");
+		cop_alloc_tls_pool_free(&pool);
+		return -1;
+	}
+
+	cop_alloc_tls_pool_free(&pool);
+	return 0;
+}
+#endif
+
+#define CONCURRENT_THREADS (4)
+#define CONCURRENT_RECORDS (4096)
+
+struct concurrent_thread {
+	struct cop_salloc_iface *iface;
+	cop_thread               thread;
+	unsigned char            id;
+	unsigned char           *records[CONCURRENT_RECORDS];
+	int                      failed;
+};
+
+static size_t concurrent_record_size(unsigned i)
+{
+	return 1 + ((i * 37u) % 300u);
+}
+
+static void *concurrent_thread_proc(void *argument)
+{
+	struct concurrent_thread *ctx = argument;
+	unsigned i;
+	for (i = 0; i < CONCURRENT_RECORDS; i++) {
+		size_t         sz = concurrent_record_size(i);
+		unsigned char *p  = cop_salloc(ctx->iface, sz, (i & 1) ? 0 : 32);
+		if (p == NULL || ((i & 1) == 0 && ((size_t)p & 31) != 0)) {
+			ctx->failed = 1;
+			return NULL;
+		}
+		memset(p, ctx->id, sz);
+		ctx->records[i] = p;
+	}
+	return NULL;
+}
+
+static int test_virtual_concurrent(void)
+{
+	struct cop_alloc_virtual mem;
+	struct cop_salloc_iface  iface;
+	struct concurrent_thread threads[CONCURRENT_THREADS];
+	unsigned i, j;
+	size_t   k;
+	int      failed = 0;
+
+	/* Use a small grow size so that the threads contend on commits. */
+	if (cop_alloc_virtual_init_concurrent(&mem, &iface, 64*1024*1024, 16, 4096)) {
+		fprintf(stderr, "could not create concurrent virtual allocator\n");
+		return -1;
+	}
+
+	for (i = 0; i < CONCURRENT_THREADS; i++) {
+		threads[i].iface  = &iface;
+		threads[i].id     = (unsigned char)(i + 1);
+		threads[i].failed = 0;
+		if (cop_thread_create(&(threads[i].thread), concurrent_thread_proc, &(threads[i]), 0, 0)) {
+			fprintf(stderr, "could not create thread\n");
+			abort();
+		}
+	}
+
+	for (i = 0; i < CONCURRENT_THREADS; i++) {
+		cop_thread_join(threads[i].thread, NULL);
+		if (threads[i].failed) {
+			fprintf(stderr, "concurrent allocation failed in thread %u\n", i);
+			failed = 1;
+		}
+	}
+
+	/* If any allocations overlapped, a record will have been overwritten by
+	 * another thread. */
+	for (i = 0; !failed && i < CONCURRENT_THREADS; i++)
+		for (j = 0; !failed && j < CONCURRENT_RECORDS; j++)
+			for (k = 0; k < concurrent_record_size(j); k++)
+				if (threads[i].records[j][k] != threads[i].id) {
+					fprintf(stderr, "concurrent allocations overlapped\n");
+					failed = 1;
+					break;
+				}
+
+	if (!failed) {
+		cop_salloc_restore(&iface, 0);
+		if (cop_salloc_save(&iface) != 0 || cop_salloc(&iface, 100, 0) != (void *)mem.base) {
+			fprintf(stderr, "expected concurrent allocator to restart from the base after restore\n");
+			failed = 1;
+		}
+	}
+
+	/* An allocation which cannot be committed must give its space back. */
+	if (!failed) {
+		struct cop_alloc_budget budget;
+		cop_alloc_budget_init(&budget, NULL, 0, 1, NULL, NULL);
+		cop_alloc_virtual_set_budget(&mem, &budget);
+		if (cop_salloc(&iface, 32*1024*1024, 0) != NULL || cop_salloc(&iface, 12, 0) != (void *)(mem.base + 112)) {
+			fprintf(stderr, "expected a failed concurrent allocation to be rolled back\n");
+			failed = 1;
+		}
+		cop_alloc_virtual_set_budget(&mem, NULL);
+	}
+
+	cop_alloc_virtual_free(&mem);
+	return failed ? -1 : 0;
+}
+
+#define SLAB_KEYS   (1000)
+#define SLAB_ROUNDS (20)
+
+struct slab_node {
+	struct cop_strdict_node node;
+	char                    key[16];
+};
+
+static int slab_churn_round(struct cop_falloc_iface *iface, struct cop_strdict_node **pp_root, unsigned round)
+{
+	unsigned i;
+	for (i = 0; i < SLAB_KEYS; i++) {
+		struct slab_node *p = cop_falloc(iface, sizeof(*p), 0);
+		if (p == NULL) {
+			fprintf(stderr, "slab allocation failed\n");
+			return -1;
+		}
+		sprintf(p->key, "%u-%u", round, i);
+		cop_strdict_node_init_by_cstr(&(p->node), p->key, p);
+		if (cop_strdict_insert(pp_root, &(p->node))) {
+			fprintf(stderr, "expected slab node insert to succeed\n");
+			return -1;
+		}
+	}
+	for (i = 0; i < SLAB_KEYS; i++) {
+		char                     key[16];
+		struct cop_strdict_node *p;
+		sprintf(key, "%u-%u", round, i);
+		if ((p = cop_strdict_delete_by_cstr(pp_root, key)) == NULL) {
+			fprintf(stderr, "expected slab node delete to succeed\n");
+			return -1;
+		}
+		cop_falloc_free(iface, cop_strdict_node_to_data(p));
+	}
+	return 0;
+}
+
+static int test_slab(int use_parent)
+{
+	struct cop_alloc_virtual  mem;
+	struct cop_salloc_iface   parent;
+	struct cop_alloc_slab     slab;
+	struct cop_falloc_iface   iface;
+	struct cop_strdict_node  *p_root = cop_strdict_init();
+	size_t                    first_round_usage = 0;
+	unsigned                  i;
+	int                       failed = 0;
+	void                     *a, *b;
+
+	if (cop_alloc_virtual_init(&mem, &parent, 64*1024*1024, 16, 64*1024))
+		abort();
+	if (cop_alloc_slab_init(&slab, &iface, use_parent ? &(parent.iface) : NULL, sizeof(struct slab_node), 0, 128))
+		abort();
+
+	if (cop_falloc(&iface, 4096, 0) != NULL || cop_falloc(&iface, 1, 64) != NULL) {
+		fprintf(stderr, "expected oversized slab allocation to fail\n");
+		failed = 1;
+	}
+
+	a = cop_falloc(&iface, 1, 0);
+	cop_falloc_free(&iface, a);
+	b = cop_falloc(&iface, 1, 0);
+	if (a == NULL || a != b || ((size_t)a & 15) != 0) {
+		fprintf(stderr, "expected slab allocator to reuse a freed object\n");
+		failed = 1;
+	}
+	cop_falloc_free(&iface, b);
+
+	for (i = 0; !failed && i < SLAB_ROUNDS; i++) {
+		if (slab_churn_round(&iface, &p_root, i)) {
+			failed = 1;
+			break;
+		}
+		if (i == 0)
+			first_round_usage = cop_salloc_save(&parent);
+		else if (cop_salloc_save(&parent) != first_round_usage) {
+			fprintf(stderr, "expected slab allocator memory not to grow when churning keys\n");
+			failed = 1;
+		}
+	}
+
+	if (!failed && p_root != NULL) {
+		fprintf(stderr, "expected dictionary to be empty after churning\n");
+		failed = 1;
+	}
+
+	cop_alloc_slab_free(&slab);
+	cop_alloc_virtual_free(&mem);
+	return failed ? -1 : 0;
+}
+
+static int test_virtual_hugepages(void)
+{
+	struct cop_alloc_virtual mem;
+	struct cop_salloc_iface  iface;
+	unsigned char           *p;
+	size_t                   ps;
+	int                      failed = 0;
+
+	if (cop_alloc_virtual_init_ex(&mem, &iface, 64*1024*1024, 16, 1, COP_ALLOC_VIRTUAL_FLAG_HUGEPAGES)) {
+		fprintf(stderr, "huge page virtual allocator init should never fail\n");
+		return -1;
+	}
+
+	ps = cop_alloc_virtual_page_size(&mem);
+	printf("huge page arena: kind=%u page_size=%lu\n", cop_alloc_virtual_page_kind(&mem), (unsigned long)ps);
+	if (ps == 0 || ((size_t)mem.base & (ps - 1)) != 0) {
+		fprintf(stderr, "expected arena base to be aligned to its page size\n");
+		failed = 1;
+	} else if (cop_alloc_virtual_page_kind(&mem) != COP_ALLOC_VIRTUAL_PAGES_NORMAL && ps <= cop_memory_query_page_size()) {
+		fprintf(stderr, "expected huge page arena to report the huge page size\n");
+		failed = 1;
+	} else if ((p = cop_salloc(&iface, 5*1024*1024, 0)) == NULL) {
+		fprintf(stderr, "expected huge page arena allocation to succeed\n");
+		failed = 1;
+	} else {
+		memset(p, 0x5A, 5*1024*1024);
+		if (mem.grow_sz % ps != 0 || mem.protect_sz % ps != 0) {
+			fprintf(stderr, "expected commits to be in multiples of the page size\n");
+			failed = 1;
+		}
+	}
+
+	cop_alloc_virtual_free(&mem);
+	return failed ? -1 : 0;
+}
+
+static int test_virtual_decommit(void)
+{
+	struct cop_alloc_virtual mem;
+	struct cop_salloc_iface  iface;
+	unsigned char           *p;
+	unsigned                 i;
+	int                      failed = 0;
+
+	if (cop_alloc_virtual_init(&mem, &iface, 64*1024*1024, 16, 64*1024))
+		abort();
+	cop_alloc_virtual_set_decommit(&mem, 50, 3);
+
+	/* A burst of large temporaries. */
+	if ((p = cop_salloc(&iface, 8*1024*1024, 0)) == NULL)
+		abort();
+	memset(p, 1, 8*1024*1024);
+	cop_salloc_restore(&iface, 0);
+
+	/* Alternating between small and large usage must never release the
+	 * pages. */
+	for (i = 0; i < 10; i++) {
+		if ((p = cop_salloc(&iface, (i & 1) ? 8*1024*1024 : 1000, 0)) == NULL)
+			abort();
+		cop_salloc_restore(&iface, 0);
+	}
+	if (mem.protect_sz < 8*1024*1024) {
+		failed = 1;
+		fprintf(stderr, "expected alternating usage not to decommit\n");
+	}
+
+	/* Consistently small usage releases the pages. */
+	for (i = 0; i < 2; i++) {
+		if ((p = cop_salloc(&iface, 1000, 0)) == NULL)
+			abort();
+		cop_salloc_restore(&iface, 0);
+	}
+	if (mem.protect_sz < 8*1024*1024) {
+		failed = 1;
+		fprintf(stderr, "expected decommit to wait for enough low restores\n");
+	}
+	if ((p = cop_salloc(&iface, 1000, 0)) == NULL)
+		abort();
+	cop_salloc_restore(&iface, 0);
+	if (mem.protect_sz != 64*1024) {
+		failed = 1;
+		fprintf(stderr, "expected pages above the low usage to be decommitted (%lu committed)\n", (unsigned long)mem.protect_sz);
+	}
+
+	/* And the arena must still be able to grow again. */
+	if ((p = cop_salloc(&iface, 4*1024*1024, 0)) == NULL) {
+		failed = 1;
+		fprintf(stderr, "expected arena to grow after decommit\n");
+	} else {
+		for (i = 64*1024; i < 4*1024*1024; i += 4096)
+			if (p[i] != 0) {
+				failed = 1;
+				fprintf(stderr, "expected decommitted pages to come back zeroed\n");
+				break;
+			}
+	}
+
+	cop_alloc_virtual_free(&mem);
+	return failed ? -1 : 0;
+}
+
+static size_t growth_commits(unsigned policy, size_t max_step)
+{
+	struct cop_alloc_virtual mem;
+	struct cop_salloc_iface  iface;
+	size_t                   commits;
+	unsigned                 i;
+
+	if (cop_alloc_virtual_init(&mem, &iface, 256*1024*1024, 16, 64*1024))
+		abort();
+	cop_alloc_virtual_set_growth(&mem, policy, max_step);
+
+	/* Grow the arena to 128 MB in small steps. */
+	for (i = 0; i < 128*1024; i++) {
+		unsigned char *p = cop_salloc(&iface, 1024, 0);
+		if (p == NULL)
+			abort();
+		p[0] = 1;
+		p[1023] = 1;
+	}
+
+	commits = cop_alloc_virtual_commit_count(&mem);
+	cop_alloc_virtual_free(&mem);
+	return commits;
+}
+
+static int test_virtual_growth(void)
+{
+	size_t linear    = growth_commits(COP_ALLOC_VIRTUAL_GROW_LINEAR, 0);
+	size_t geometric = growth_commits(COP_ALLOC_VIRTUAL_GROW_GEOMETRIC, 0);
+	size_t capped    = growth_commits(COP_ALLOC_VIRTUAL_GROW_CAPPED_GEOMETRIC, 16*1024*1024);
+
+	printf("commits to grow to 128MB: linear=%lu geometric=%lu capped=%lu\n", (unsigned long)linear, (unsigned long)geometric, (unsigned long)capped);
+
+	if (linear != 2048 || geometric > 12 || capped <= geometric || capped >= linear) {
+		fprintf(stderr, "unexpected number of commits for growth policies\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int test_stats(void)
+{
+	struct cop_alloc_virtual   mem;
+	struct cop_alloc_grp_temps gat;
+	struct cop_salloc_iface    viface;
+	struct cop_salloc_iface    giface;
+	struct cop_alloc_stats     vstats;
+	struct cop_alloc_stats     gstats;
+	size_t                     s;
+	int                        failed = 0;
+
+	if (cop_alloc_virtual_init(&mem, &viface, 16*1024*1024, 16, 64*1024))
+		abort();
+	if (cop_alloc_grp_temps_init(&gat, &giface, 1024, 4096, 16))
+		abort();
+
+	cop_salloc(&viface, 1, 0);
+	cop_salloc(&viface, 100, 64);
+	cop_salloc(&giface, 1, 0);
+	s = cop_salloc_save(&giface);
+	cop_salloc(&giface, 2000, 0);
+	cop_salloc_restore(&giface, s);
+
+	cop_alloc_virtual_get_stats(&mem, &vstats);
+	cop_alloc_grp_temps_get_stats(&gat, &gstats);
+
+	if (vstats.used != 164 || vstats.committed != 64*1024 || vstats.nb_commits != 1) {
+		fprintf(stderr, "unexpected virtual allocator usage statistics\n");
+		failed = 1;
+	}
+	if (gstats.used != s || gstats.committed < 1024 + 2000) {
+		fprintf(stderr, "unexpected group allocator usage statistics (used=%lu, committed=%lu)\n", (unsigned long)gstats.used, (unsigned long)gstats.committed);
+		failed = 1;
+	}
+#if COP_ALLOC_STATS
+	if (vstats.nb_allocs != 2 || vstats.bytes_requested != 101 || vstats.bytes_padding != 63 || vstats.peak_used != 164) {
+		fprintf(stderr, "unexpected virtual allocator counters\n");
+		failed = 1;
+	}
+	if (gstats.nb_allocs != 2 || gstats.bytes_requested != 2001 || gstats.nb_chunk_allocs != 2 || gstats.nb_chunk_frees != 0) {
+		fprintf(stderr, "unexpected group allocator counters\n");
+		failed = 1;
+	}
+#endif
+
+	cop_alloc_grp_temps_free(&gat);
+	cop_alloc_virtual_free(&mem);
+	return failed ? -1 : 0;
+}
+
+static int test_virtual_locked(void)
+{
+	struct cop_alloc_virtual mem;
+	struct cop_salloc_iface  iface;
+	size_t                   locked;
+	int                      exhausted;
+	int                      failed = 0;
+
+	if (cop_alloc_virtual_init_ex(&mem, &iface, 64*1024*1024, 16, 64*1024, COP_ALLOC_VIRTUAL_FLAG_LOCKED))
+		abort();
+
+	if (cop_alloc_virtual_precommit(&mem, 1024*1024)) {
+		fprintf(stderr, "expected precommit of a locked arena to succeed\n");
+		cop_alloc_virtual_free(&mem);
+		return -1;
+	}
+
+	exhausted = cop_alloc_virtual_lock_status(&mem, &locked);
+	printf("locked arena: lockable=%lu locked=%lu exhausted=%d\n", (unsigned long)cop_memory_query_current_lockable(), (unsigned long)locked, exhausted);
+	if (mem.protect_sz != 1024*1024 || (!exhausted && locked != mem.protect_sz) || locked > mem.protect_sz) {
+		fprintf(stderr, "unexpected lock accounting\n");
+		failed = 1;
+	}
+
+#ifdef __linux__
+	{
+		size_t        ps = cop_memory_query_page_size();
+		size_t        i;
+		unsigned char vec[1024*1024 / 4096];
+		if (ps == 4096 && mincore(mem.base, 1024*1024, vec) == 0) {
+			for (i = 0; i < sizeof(vec); i++)
+				if ((vec[i] & 1) == 0) {
+					fprintf(stderr, "expected precommitted pages to be resident\n");
+					failed = 1;
+					break;
+				}
+		}
+	}
+#endif
+
+	if (cop_salloc(&iface, 512*1024, 0) == NULL || mem.nb_commits != 1) {
+		fprintf(stderr, "expected allocation within the precommitted region not to commit\n");
+		failed = 1;
+	}
+
+	/* Run the lock budget out and then decommit the locked pages: locking
+	 * should be possible again. This needs a small, known budget. */
+	if (!failed && !exhausted && mem.lock_budget <= 32*1024*1024) {
+		if (cop_alloc_virtual_precommit(&mem, mem.lock_budget + 2*1024*1024) || !cop_alloc_virtual_lock_status(&mem, NULL)) {
+			fprintf(stderr, "expected the lock budget to run out\n");
+			failed = 1;
+		} else {
+			cop_alloc_virtual_set_decommit(&mem, 90, 1);
+			cop_salloc_restore(&iface, 0);
+			if (cop_alloc_virtual_lock_status(&mem, &locked) || locked != mem.protect_sz) {
+				fprintf(stderr, "expected locking to resume after a decommit\n");
+				failed = 1;
+			}
+		}
+	}
+
+	cop_alloc_virtual_free(&mem);
+	return failed ? -1 : 0;
+}
+
+static int test_grp_temps_cache(void)
+{
+	struct cop_alloc_grp_temps gat;
+	struct cop_salloc_iface    iface;
+	struct cop_alloc_stats     stats;
+	size_t                     s;
+	size_t                     committed = 0;
+	unsigned                   i;
+	int                        failed = 0;
+
+	if (cop_alloc_grp_temps_init(&gat, &iface, 1024, 4096, 16))
+		abort();
+
+	cop_salloc(&iface, 10, 0);
+	for (i = 0; i < 100; i++) {
+		unsigned char *p;
+		s = cop_salloc_save(&iface);
+		cop_salloc(&iface, 100, 0);
+		if ((p = cop_salloc(&iface, 2000, 0)) == NULL)
+			abort();
+		memset(p, 0, 2000);
+		cop_salloc_restore(&iface, s);
+		cop_alloc_grp_temps_get_stats(&gat, &stats);
+		if (i == 0) {
+			committed = stats.committed;
+		} else if (stats.committed != committed) {
+			fprintf(stderr, "expected committed memory to be stable with the chunk cache\n");
+			failed = 1;
+			break;
+		}
+	}
+
+#if COP_ALLOC_STATS
+	if (stats.nb_chunk_allocs != 2 || stats.nb_chunk_frees != 0) {
+		fprintf(stderr, "expected the chunk to be recycled (allocs=%lu, frees=%lu)\n", (unsigned long)stats.nb_chunk_allocs, (unsigned long)stats.nb_chunk_frees);
+		failed = 1;
+	}
+#endif
+
+	cop_alloc_grp_temps_set_cache(&gat, 0);
+	cop_alloc_grp_temps_get_stats(&gat, &stats);
+	if (stats.committed != 1024) {
+		fprintf(stderr, "expected disabling the cache to free cached chunks\n");
+		failed = 1;
+	}
+
+	/* Restoring to the start merges everything into a new head chunk which
+	 * makes the cached chunks redundant. */
+	cop_alloc_grp_temps_set_cache(&gat, 4096);
+	s = cop_salloc_save(&iface);
+	cop_salloc(&iface, 2000, 0);
+	cop_salloc_restore(&iface, s);
+	cop_salloc(&iface, 100, 0);
+	cop_salloc(&iface, 2000, 0);
+	cop_salloc_restore(&iface, 0);
+	cop_alloc_grp_temps_get_stats(&gat, &stats);
+	if (stats.committed > gat.head->alloc_sz + gat.cache_max || gat.cache != NULL) {
+		fprintf(stderr, "expected merged chunks to be dropped from the cache (committed=%lu)\n", (unsigned long)stats.committed);
+		failed = 1;
+	}
+
+	cop_alloc_grp_temps_free(&gat);
+	return failed ? -1 : 0;
+}
+
+static int check_extend(struct cop_salloc_iface *iface, const char *name, size_t big_sz)
+{
+	unsigned char *a;
+	unsigned char *b;
+	size_t         s;
+	size_t         i;
+
+	s = cop_salloc_save(iface);
+	a = cop_salloc(iface, 16, 0);
+	b = cop_salloc(iface, 16, 0);
+	if (a == NULL || b == NULL)
+		abort();
+	memset(b, 0x5A, 16);
+
+	if (!cop_salloc_extend(iface, a, 16, 32)) {
+		fprintf(stderr, "%s: extended an allocation which was not the most recent\n", name);
+		return -1;
+	}
+	if (cop_salloc_extend(iface, b, 16, big_sz)) {
+		fprintf(stderr, "%s: could not extend the most recent allocation\n", name);
+		return -1;
+	}
+	for (i = 0; i < 16; i++)
+		if (b[i] != 0x5A) {
+			fprintf(stderr, "%s: extend modified the allocation\n", name);
+			return -1;
+		}
+	memset(b, 0xA5, big_sz);
+	if (cop_salloc_extend(iface, b, big_sz, 8)) {
+		fprintf(stderr, "%s: could not shrink the most recent allocation\n", name);
+		return -1;
+	}
+	a = cop_salloc(iface, 1, 1);
+	if (a != b + 8) {
+		fprintf(stderr, "%s: expected the next allocation to follow the shrunk one\n", name);
+		return -1;
+	}
+	a = cop_salloc(iface, 4, 1);
+	if (cop_salloc_extend(iface, a, 4, ((size_t)-1) / 2)) {
+		if (cop_salloc_extend(iface, a, 4, 5)) {
+			fprintf(stderr, "%s: a failed extend changed the allocation\n", name);
+			return -1;
+		}
+	} else {
+		fprintf(stderr, "%s: an impossible extend succeeded\n", name);
+		return -1;
+	}
+
+	cop_salloc_restore(iface, s);
+	return 0;
+}
+
+static int test_extend(void)
+{
+	struct cop_alloc_virtual   virt;
+	struct cop_alloc_grp_temps gat;
+	struct cop_salloc_iface    iface;
+	unsigned char             *p;
+	int                        failed = 0;
+
+	if (cop_alloc_virtual_init(&virt, &iface, 16*1024*1024, 16, 64*1024))
+		abort();
+	failed |= check_extend(&iface, "virtual", 1024*1024);
+	cop_alloc_virtual_free(&virt);
+
+	if (cop_alloc_virtual_init_concurrent(&virt, &iface, 16*1024*1024, 16, 64*1024))
+		abort();
+	failed |= check_extend(&iface, "concurrent", 1024*1024);
+	cop_alloc_virtual_free(&virt);
+
+	if (cop_alloc_grp_temps_init(&gat, &iface, 4096, 4096, 16))
+		abort();
+	failed |= check_extend(&iface, "grp_temps", 1024);
+	/* The head chunk has no room so this must fail. */
+	p = cop_salloc(&iface, 3000, 0);
+	if (p == NULL)
+		abort();
+	if (!cop_salloc_extend(&iface, p, 3000, 5000)) {
+		fprintf(stderr, "grp_temps: extended past the end of the head chunk\n");
+		failed = 1;
+	}
+	cop_alloc_grp_temps_free(&gat);
+
+	return failed ? -1 : 0;
+}
+
+#define RING_TEST_BYTES (1024*1024)
+
+static void *ring_producer_proc(void *argument)
+{
+	struct cop_ring *ring = argument;
+	size_t           sent = 0;
+	while (sent < RING_TEST_BYTES) {
+		size_t         avail;
+		unsigned char *p = cop_ring_write_ptr(ring, &avail);
+		size_t         i;
+		avail = (avail > RING_TEST_BYTES - sent) ? (RING_TEST_BYTES - sent) : avail;
+		avail = (avail > 1000) ? 1000 : avail;
+		for (i = 0; i < avail; i++)
+			p[i] = (unsigned char)((sent + i) % 251);
+		cop_ring_commit_write(ring, avail);
+		sent += avail;
+	}
+	return NULL;
+}
+
+static int test_mirror_ring(void)
+{
+	struct cop_alloc_mirror mirror;
+	struct cop_ring         ring;
+	cop_thread              producer;
+	unsigned char          *base;
+	unsigned char           tmp[300];
+	size_t                  size;
+	size_t                  i;
+	size_t                  received = 0;
+	int                     failed = 0;
+
+	if (cop_alloc_mirror_init(&mirror, 10000)) {
+		fprintf(stderr, "could not create a mirrored allocation\n");
+		return -1;
+	}
+	base = cop_alloc_mirror_base(&mirror);
+	size = cop_alloc_mirror_size(&mirror);
+	if (size < 10000 || size % cop_memory_query_page_size()) {
+		fprintf(stderr, "unexpected mirrored allocation size %lu\n", (unsigned long)size);
+		failed = 1;
+	}
+	base[5]        = 0x12;
+	base[size + 7] = 0x34;
+	if (base[size + 5] != 0x12 || base[7] != 0x34) {
+		fprintf(stderr, "the two halves of the mirrored allocation are not the same memory\n");
+		failed = 1;
+	}
+
+	/* A write which straddles the end of the ring is a single copy. */
+	cop_ring_init(&ring, base, size);
+	cop_ring_commit_write(&ring, size - 100);
+	cop_ring_commit_read(&ring, size - 100);
+	for (i = 0; i < sizeof(tmp); i++)
+		tmp[i] = (unsigned char)i;
+	if (cop_ring_write(&ring, tmp, sizeof(tmp)) != sizeof(tmp) || memcmp(base + size - 100, tmp, 100) || memcmp(base, tmp + 100, 200)) {
+		fprintf(stderr, "wrapped ring write did not land in both halves\n");
+		failed = 1;
+	}
+	memset(tmp, 0, sizeof(tmp));
+	if (cop_ring_read(&ring, tmp, sizeof(tmp)) != sizeof(tmp) || tmp[0] != 0 || tmp[299] != (unsigned char)299) {
+		fprintf(stderr, "wrapped ring read returned the wrong data\n");
+		failed = 1;
+	}
+
+	/* The ring can be completely filled. */
+	cop_ring_init(&ring, base, size);
+	for (i = 0; i < size; i += cop_ring_write(&ring, tmp, sizeof(tmp)));
+	if (cop_ring_write(&ring, tmp, 1) != 0 || cop_ring_read_ptr(&ring, &i) == NULL || i != size) {
+		fprintf(stderr, "ring did not report being full\n");
+		failed = 1;
+	}
+
+	/* Stream data through the ring from another thread. */
+	cop_ring_init(&ring, base, size);
+	if (cop_thread_create(&producer, ring_producer_proc, &ring, 0, 0))
+		abort();
+	while (received < RING_TEST_BYTES) {
+		size_t               avail;
+		const unsigned char *p = cop_ring_read_ptr(&ring, &avail);
+		for (i = 0; i < avail && !failed; i++) {
+			if (p[i] != (unsigned char)((received + i) % 251)) {
+				fprintf(stderr, "ring data was corrupted at byte %lu\n", (unsigned long)(received + i));
+				failed = 1;
+				break;
+			}
+		}
+		cop_ring_commit_read(&ring, avail);
+		received += avail;
+	}
+	cop_thread_join(producer, NULL);
+
+	cop_alloc_mirror_free(&mirror);
+	return failed ? -1 : 0;
+}
+
+static int test_shared(void)
+{
+	struct cop_alloc_shared a, b;
+	struct cop_alloc_iface  ia, ib;
+	unsigned char          *pa, *pb;
+	char                    name[64];
+	int                     failed = 0;
+
+	if (cop_alloc_shared_create(&a, &ia, NULL, 64*1024)) {
+		fprintf(stderr, "could not create an anonymous shared arena\n");
+		return -1;
+	}
+#if !_WIN32
+	/* A second mapping of the same memory stands in for another process. */
+	if (cop_alloc_shared_attach_fd(&b, &ib, dup(cop_alloc_shared_fd(&a)))) {
+		fprintf(stderr, "could not attach to an anonymous shared arena\n");
+		cop_alloc_shared_detach(&a);
+		return -1;
+	}
+	pa = cop_alloc(&ia, 1000, 64);
+	if (pa == NULL || ((size_t)pa & 63)) {
+		fprintf(stderr, "bad shared arena allocation\n");
+		failed = 1;
+	} else {
+		memset(pa, 0x77, 1000);
+		pb = cop_alloc_shared_ptr(&b, cop_alloc_shared_offset(&a, pa));
+		if (pb == pa || pb[0] != 0x77 || pb[999] != 0x77) {
+			fprintf(stderr, "shared arena offset did not refer to the same memory\n");
+			failed = 1;
+		}
+		/* Allocations from either mapping come from the same space. */
+		pb = cop_alloc(&ib, 16, 0);
+		if (pb == NULL || cop_alloc_shared_offset(&b, pb) < cop_alloc_shared_offset(&a, pa) + 1000) {
+			fprintf(stderr, "shared arena allocations overlap\n");
+			failed = 1;
+		}
+	}
+	if (cop_alloc(&ib, 128*1024, 0) != NULL) {
+		fprintf(stderr, "shared arena allocated beyond its size\n");
+		failed = 1;
+	}
+	cop_alloc_shared_detach(&b);
+#endif
+	cop_alloc_shared_detach(&a);
+
+	sprintf(name, "/cop_alloc_tests_%lu", (unsigned long)(size_t)&name);
+	if (cop_alloc_shared_create(&a, &ia, name, 4096)) {
+		fprintf(stderr, "could not create a named shared arena\n");
+		return -1;
+	}
+	if (cop_alloc_shared_create(&b, &ib, name, 4096) == 0) {
+		fprintf(stderr, "created a shared arena with an existing name\n");
+		cop_alloc_shared_detach(&b);
+		failed = 1;
+	}
+	if (cop_alloc_shared_attach(&b, &ib, name)) {
+		fprintf(stderr, "could not attach to a named shared arena\n");
+		failed = 1;
+	} else {
+		pa = cop_alloc(&ia, 4, 0);
+		memcpy(pa, "abc", 4);
+		pb = cop_alloc_shared_ptr(&b, cop_alloc_shared_offset(&a, pa));
+		if (strcmp((char *)pb, "abc") != 0) {
+			fprintf(stderr, "named shared arena did not share memory\n");
+			failed = 1;
+		}
+		cop_alloc_shared_detach(&b);
+	}
+	cop_alloc_shared_unlink(name);
+	cop_alloc_shared_detach(&a);
+	if (cop_alloc_shared_attach(&b, &ib, name) == 0) {
+		fprintf(stderr, "attached to an unlinked shared arena\n");
+		cop_alloc_shared_detach(&b);
+		failed = 1;
+	}
+
+	return failed ? -1 : 0;
+}
+
+struct snapshot_node {
+	struct snapshot_node *next;
+	unsigned              value;
+};
+
+struct snapshot_root {
+	struct snapshot_root *self;
+	struct snapshot_node *head;
+	size_t               *fixups;
+	size_t                nb_fixups;
+};
+
+static int check_snapshot_list(const struct snapshot_root *root, const char *what)
+{
+	const struct snapshot_node *n;
+	unsigned                    i = 0;
+	for (n = root->head; n != NULL; n = n->next, i++) {
+		if (n->value != i * 3) {
+			fprintf(stderr, "%s: snapshot list is corrupt at %u\n", what, i);
+			return -1;
+		}
+	}
+	if (i != 100) {
+		fprintf(stderr, "%s: snapshot list has %u entries\n", what, i);
+		return -1;
+	}
+	return 0;
+}
+
+static int test_snapshot(void)
+{
+	const char              *filename = "cop_alloc_tests_snapshot.bin";
+	struct cop_alloc_virtual virt;
+	struct cop_salloc_iface  iface;
+	struct cop_filemap       map;
+	struct snapshot_root    *root;
+	struct snapshot_node   **pp_tail;
+	unsigned char           *orig_base;
+	unsigned                 i;
+	int                      failed = 0;
+
+	if (cop_alloc_virtual_init(&virt, &iface, 16*1024*1024, 16, 64*1024))
+		abort();
+	orig_base = cop_alloc_virtual_base(&virt);
+
+	/* Build a linked list with absolute pointers and record where each of
+	 * them lives. */
+	root            = cop_salloc(&iface, sizeof(*root), 0);
+	root->self      = root;
+	root->fixups    = cop_salloc(&iface, sizeof(size_t) * 102, 0);
+	root->nb_fixups = 0;
+	root->fixups[root->nb_fixups++] = (unsigned char *)&(root->self) - orig_base;
+	root->fixups[root->nb_fixups++] = (unsigned char *)&(root->fixups) - orig_base;
+	pp_tail = &(root->head);
+	for (i = 0; i < 100; i++) {
+		struct snapshot_node *n = cop_salloc(&iface, sizeof(*n), 0);
+		n->value = i * 3;
+		*pp_tail = n;
+		root->fixups[root->nb_fixups++] = (unsigned char *)pp_tail - orig_base;
+		pp_tail  = &(n->next);
+	}
+	*pp_tail = NULL;
+
+	if (cop_alloc_virtual_snapshot(&virt, filename)) {
+		fprintf(stderr, "could not write snapshot\n");
+		cop_alloc_virtual_free(&virt);
+		return -1;
+	}
+
+	/* The arena still occupies the original address so a fixed mapping
+	 * must fail. */
+	if (cop_filemap_open_at(&map, filename, COP_FILEMAP_FLAG_R | COP_FILEMAP_FLAG_FIXED, orig_base) == 0) {
+		fprintf(stderr, "fixed snapshot mapping replaced the live arena\n");
+		cop_filemap_close(&map);
+		failed = 1;
+	}
+
+	/* Map copy-on-write somewhere else and relocate. */
+	if (cop_filemap_open_at(&map, filename, COP_FILEMAP_FLAG_R | COP_FILEMAP_FLAG_W, orig_base)) {
+		fprintf(stderr, "could not map snapshot\n");
+		failed = 1;
+	} else {
+		struct snapshot_root *r     = map.ptr;
+		ptrdiff_t             delta = (unsigned char *)map.ptr - (unsigned char *)r->self;
+		cop_alloc_snapshot_relocate(map.ptr, (size_t *)((unsigned char *)r->fixups + delta), r->nb_fixups, delta);
+		if (r->self != r)
+			failed = 1;
+		failed |= check_snapshot_list(r, "relocated");
+		cop_filemap_close(&map);
+	}
+	cop_alloc_virtual_free(&virt);
+
+	/* With the arena gone, the snapshot can normally be mapped read-only at
+	 * its original address and used directly. */
+	if (cop_filemap_open_at(&map, filename, COP_FILEMAP_FLAG_R | COP_FILEMAP_FLAG_FIXED, orig_base) == 0) {
+		if (map.ptr != orig_base) {
+			fprintf(stderr, "fixed snapshot mapping is at the wrong address\n");
+			failed = 1;
+		} else {
+			failed |= check_snapshot_list(map.ptr, "fixed");
+		}
+		cop_filemap_close(&map);
+	}
+
+	remove(filename);
+	return failed ? -1 : 0;
+}
+
+static int check_zeroed(const unsigned char *p, size_t size, const char *what)
+{
+	size_t i;
+	for (i = 0; i < size; i++) {
+		if (p[i] != 0) {
+			fprintf(stderr, "%s: zalloc memory was not zero at %lu\n", what, (unsigned long)i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int test_zalloc(void)
+{
+	struct cop_alloc_virtual   virt;
+	struct cop_alloc_grp_temps gat;
+	struct cop_salloc_iface    iface;
+	struct cop_alloc_stats     stats;
+	unsigned char             *p;
+	unsigned char             *q;
+	size_t                     s;
+	int                        failed = 0;
+
+	if (cop_alloc_virtual_init(&virt, &iface, 16*1024*1024, 16, 64*1024))
+		abort();
+
+	/* Fresh memory is not cleared. */
+	s = cop_salloc_save(&iface);
+	p = cop_salloc_zalloc(&iface, 200000, 0);
+	failed |= check_zeroed(p, 200000, "fresh");
+	cop_alloc_virtual_get_stats(&virt, &stats);
+#if COP_ALLOC_STATS
+	if (stats.bytes_zeroed != 0) {
+		fprintf(stderr, "zalloc cleared fresh memory\n");
+		failed = 1;
+	}
+#endif
+	memset(p, 0xFF, 200000);
+	cop_salloc_restore(&iface, s);
+
+	/* Reused memory is cleared but only as far as it was used. */
+	cop_salloc(&iface, 1000, 0);
+	q = cop_salloc_zalloc(&iface, 300000, 0);
+	failed |= check_zeroed(q, 300000, "reused");
+	cop_alloc_virtual_get_stats(&virt, &stats);
+#if COP_ALLOC_STATS
+	if (stats.bytes_zeroed != 200000 - (size_t)(q - p)) {
+		fprintf(stderr, "zalloc cleared %lu bytes rather than %lu\n", (unsigned long)stats.bytes_zeroed, (unsigned long)(200000 - (size_t)(q - p)));
+		failed = 1;
+	}
+#endif
+	cop_salloc_restore(&iface, s);
+
+	/* Memory which was dirtied by a shrunk allocation is also cleared. */
+	p = cop_salloc(&iface, 5000, 0);
+	memset(p, 0xFF, 5000);
+	if (cop_salloc_extend(&iface, p, 5000, 10))
+		abort();
+	q = cop_salloc_zalloc(&iface, 5000, 1);
+	failed |= check_zeroed(q, 5000, "after shrink");
+	cop_alloc_virtual_free(&virt);
+
+	/* Allocators without their own implementation fall back to memset. */
+	if (cop_alloc_grp_temps_init(&gat, &iface, 4096, 4096, 16))
+		abort();
+	s = cop_salloc_save(&iface);
+	memset(cop_salloc(&iface, 3000, 0), 0xFF, 3000);
+	cop_salloc_restore(&iface, s);
+	failed |= check_zeroed(cop_salloc_zalloc(&iface, 3000, 0), 3000, "grp_temps");
+	cop_alloc_grp_temps_free(&gat);
+
+	return failed ? -1 : 0;
+}
+
+struct budget_events {
+	unsigned                 nb_calls;
+	struct cop_alloc_budget *last;
+	size_t                   last_used;
+};
+
+static void on_budget_soft(void *context, struct cop_alloc_budget *budget, size_t used)
+{
+	struct budget_events *ev = context;
+	ev->nb_calls++;
+	ev->last      = budget;
+	ev->last_used = used;
+}
+
+static int test_budget(void)
+{
+	struct cop_alloc_budget    process, arena_a;
+	struct budget_events       ev_process, ev_a;
+	struct cop_alloc_virtual   va, vb;
+	struct cop_alloc_grp_temps gat;
+	struct cop_salloc_iface    ia, ib, ig;
+	unsigned char             *p;
+	size_t                     s;
+	int                        failed = 0;
+
+	memset(&ev_process, 0, sizeof(ev_process));
+	memset(&ev_a, 0, sizeof(ev_a));
+
+	/* Two arenas share a 2 MB process limit. The first also has its own
+	 * soft limit. */
+	cop_alloc_budget_init(&process, NULL, 0, 2*1024*1024, on_budget_soft, &ev_process);
+	cop_alloc_budget_init(&arena_a, &process, 256*1024, 0, on_budget_soft, &ev_a);
+
+	if (cop_alloc_virtual_init(&va, &ia, 64*1024*1024, 16, 256*1024))
+		abort();
+	if (cop_alloc_virtual_init(&vb, &ib, 64*1024*1024, 16, 1024*1024))
+		abort();
+	cop_alloc_virtual_set_budget(&va, &arena_a);
+	cop_alloc_virtual_set_budget(&vb, &process);
+
+	s = cop_salloc_save(&ia);
+	cop_salloc(&ia, 100*1024, 0);
+	if (ev_a.nb_calls != 0) {
+		fprintf(stderr, "soft limit callback called too early\n");
+		failed = 1;
+	}
+	cop_salloc(&ia, 200*1024, 0);
+	cop_salloc(&ia, 200*1024, 0);
+	if (ev_a.nb_calls != 1 || ev_a.last != &arena_a || ev_a.last_used <= 256*1024 || ev_process.nb_calls != 0) {
+		fprintf(stderr, "expected one soft limit callback (got %u)\n", ev_a.nb_calls);
+		failed = 1;
+	}
+
+	/* 512 KB is committed by the first arena, so the second cannot get
+	 * 1.75 MB. */
+	if (cop_salloc(&ib, 1792*1024, 0) != NULL) {
+		fprintf(stderr, "grouped hard limit was not enforced\n");
+		failed = 1;
+	}
+	/* The failure must not have leaked any charge. */
+	if (cop_alloc_budget_used(&process) != 512*1024 || cop_alloc_budget_used(&arena_a) != 512*1024) {
+		fprintf(stderr, "budget usage is wrong after a failed charge (%lu)\n", (unsigned long)cop_alloc_budget_used(&process));
+		failed = 1;
+	}
+	/* A request which fits when only the required pages are committed still
+	 * succeeds even though the usual 1 MB growth step would not. */
+	if ((p = cop_salloc(&ib, 1500*1024, 0)) == NULL) {
+		fprintf(stderr, "allocation within the hard limit failed\n");
+		failed = 1;
+	} else {
+		memset(p, 0, 1500*1024);
+	}
+	cop_salloc_restore(&ia, s);
+
+	cop_alloc_virtual_free(&vb);
+	cop_alloc_virtual_free(&va);
+	if (cop_alloc_budget_used(&process) != 0 || cop_alloc_budget_used(&arena_a) != 0) {
+		fprintf(stderr, "freeing the arenas did not release their budgets\n");
+		failed = 1;
+	}
+
+	/* Group temporaries charge the chunks that they hold. */
+	if (cop_alloc_grp_temps_init(&gat, &ig, 4096, 4096, 16))
+		abort();
+	cop_alloc_grp_temps_set_budget(&gat, &process);
+	if (cop_alloc_budget_used(&process) < 4096) {
+		fprintf(stderr, "attaching a budget did not charge the existing chunk\n");
+		failed = 1;
+	}
+	if (cop_salloc(&ig, 3*1024*1024, 0) != NULL) {
+		fprintf(stderr, "group temporaries ignored the hard limit\n");
+		failed = 1;
+	}
+	if (cop_salloc(&ig, 1024*1024, 0) == NULL) {
+		fprintf(stderr, "group temporaries failed within the hard limit\n");
+		failed = 1;
+	}
+	cop_alloc_grp_temps_free(&gat);
+	if (cop_alloc_budget_used(&process) != 0) {
+		fprintf(stderr, "freeing group temporaries did not release the budget\n");
+		failed = 1;
+	}
+
+	return failed ? -1 : 0;
+}
+
+static int test_cpu_queries(void)
+{
+	size_t   line     = cop_cpu_query_cache_line_size();
+	size_t   l1       = cop_cpu_query_cache_size(1);
+	size_t   l2       = cop_cpu_query_cache_size(2);
+	size_t   l3       = cop_cpu_query_cache_size(3);
+	unsigned logical  = cop_cpu_query_logical_cores();
+	unsigned physical = cop_cpu_query_physical_cores();
+	unsigned smt      = cop_cpu_query_smt_siblings();
+	int      failed   = 0;
+
+	printf("cpu: line=%lu l1=%lu l2=%lu l3=%lu logical=%u physical=%u smt=%u\n", (unsigned long)line, (unsigned long)l1, (unsigned long)l2, (unsigned long)l3, logical, physical, smt);
+
+	if (logical == 0) {
+		fprintf(stderr, "expected at least one logical processor\n");
+		failed = 1;
+	}
+	if (physical > logical || smt > logical) {
+		fprintf(stderr, "core counts are inconsistent\n");
+		failed = 1;
+	}
+	if (line & (line - 1)) {
+		fprintf(stderr, "cache line size is not a power of two\n");
+		failed = 1;
+	}
+	if (cop_cpu_query_cache_size(0) != 0 || cop_cpu_query_cache_size(9) != 0) {
+		fprintf(stderr, "expected unknown cache levels to report zero\n");
+		failed = 1;
+	}
+
+	return failed ? -1 : 0;
+}
+
+static int test_fast_paths(void)
+{
+	struct cop_alloc_virtual   virt;
+	struct cop_alloc_grp_temps gat;
+	struct cop_salloc_iface    iface;
+	unsigned char             *prev = NULL;
+	unsigned char             *p;
+	size_t                     s;
+	unsigned                   i;
+	int                        failed = 0;
+
+	if (cop_alloc_virtual_init(&virt, &iface, 16*1024*1024, 8, 4096))
+		abort();
+	s = cop_salloc_save(&iface);
+	for (i = 0; i < 10000 && !failed; i++) {
+		size_t align = (i % 5 == 0) ? 64 : 0;
+		p = (i & 1) ? cop_alloc_virtual_alloc_fast(&virt, 8 + (i % 57), align) : cop_salloc(&iface, 8 + (i % 57), align);
+		if (p == NULL || ((size_t)p & ((align ? align : 8) - 1)) || (prev != NULL && p < prev)) {
+			fprintf(stderr, "virtual fast path returned a bad pointer\n");
+			failed = 1;
+		}
+		memset(p, 0, 8 + (i % 57));
+		prev = p + 8 + (i % 57);
+	}
+	cop_salloc_restore(&iface, s);
+	if (cop_alloc_virtual_alloc_fast(&virt, 1, 0) != cop_salloc(&iface, 1, 0) - 8) {
+		fprintf(stderr, "virtual fast path did not respect restore\n");
+		failed = 1;
+	}
+	if (cop_alloc_virtual_alloc_fast(&virt, 32*1024*1024, 0) != NULL) {
+		fprintf(stderr, "virtual fast path allocated more than the reservation\n");
+		failed = 1;
+	}
+	cop_alloc_virtual_free(&virt);
+
+	if (cop_alloc_grp_temps_init(&gat, &iface, 256, 1024, 8))
+		abort();
+	s = cop_salloc_save(&iface);
+	for (i = 0; i < 1000 && !failed; i++) {
+		size_t align = (i % 5 == 0) ? 32 : 0;
+		p = (i & 1) ? cop_alloc_grp_temps_alloc_fast(&gat, 8 + (i % 57), align) : cop_salloc(&iface, 8 + (i % 57), align);
+		if (p == NULL || ((size_t)p & ((align ? align : 8) - 1))) {
+			fprintf(stderr, "group temps fast path returned a bad pointer\n");
+			failed = 1;
+		}
+		memset(p, 0, 8 + (i % 57));
+	}
+	cop_salloc_restore(&iface, s);
+	if (cop_salloc_save(&iface) != s) {
+		fprintf(stderr, "group temps fast path did not respect restore\n");
+		failed = 1;
+	}
+	cop_alloc_grp_temps_free(&gat);
+
+	return failed ? -1 : 0;
+}
+
+static double get_time_ns(void)
+{
+#if _WIN32
+	LARGE_INTEGER c, f;
+	QueryPerformanceCounter(&c);
+	QueryPerformanceFrequency(&f);
+	return c.QuadPart * (1e9 / f.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+#define TLSF_SLOTS (512)
+
+struct tlsf_slot {
+	unsigned char *ptr;
+	size_t         size;
+	unsigned char  fill;
+};
+
+static int test_tlsf(void)
+{
+	struct cop_alloc_virtual virt;
+	struct cop_salloc_iface  parent;
+	struct cop_alloc_tlsf    tlsf;
+	struct cop_falloc_iface  iface;
+	struct tlsf_slot         slots[TLSF_SLOTS];
+	size_t                   empty_used;
+	size_t                   i, j;
+	unsigned                 rng = 1;
+	double                   worst_alloc = 0.0, worst_free = 0.0;
+	double                   total_alloc = 0.0, total_free = 0.0;
+	unsigned long            nb_alloc = 0, nb_free = 0;
+	unsigned char           *p;
+	int                      failed = 0;
+
+	/* Prefault the region as a real-time user would so that page faults do
+	 * not show up in the latency figures. */
+	if (cop_alloc_virtual_init_ex(&virt, &parent, 64*1024*1024, 16, 1024*1024, COP_ALLOC_VIRTUAL_FLAG_LOCKED))
+		abort();
+	if (cop_alloc_virtual_precommit(&virt, 8*1024*1024))
+		abort();
+	if (cop_alloc_tlsf_init(&tlsf, &iface, &parent.iface, 4*1024*1024))
+		abort();
+
+	empty_used = cop_alloc_tlsf_used(&tlsf);
+	memset(slots, 0, sizeof(slots));
+
+	for (i = 0; i < 200000 && !failed; i++) {
+		struct tlsf_slot *slot;
+		double            t0, t1;
+
+		rng  = rng * 1103515245u + 12345u;
+		slot = &(slots[(rng >> 8) % TLSF_SLOTS]);
+
+		if (slot->ptr != NULL) {
+			for (j = 0; j < slot->size; j++) {
+				if (slot->ptr[j] != slot->fill) {
+					fprintf(stderr, "tlsf block was overwritten\n");
+					failed = 1;
+					break;
+				}
+			}
+			t0 = get_time_ns();
+			cop_falloc_free(&iface, slot->ptr);
+			t1 = get_time_ns();
+			worst_free  = (t1 - t0 > worst_free) ? (t1 - t0) : worst_free;
+			total_free += t1 - t0;
+			nb_free++;
+			slot->ptr = NULL;
+		} else {
+			size_t size  = ((rng >> 20) & 3) ? (1 + (rng >> 16) % 256) : (1 + (rng >> 12) % 16384);
+			size_t align = ((rng >> 3) & 7) ? 0 : ((size_t)16 << ((rng >> 4) & 3));
+			t0 = get_time_ns();
+			p  = cop_falloc(&iface, size, align);
+			t1 = get_time_ns();
+			if (p == NULL)
+				continue;
+			worst_alloc  = (t1 - t0 > worst_alloc) ? (t1 - t0) : worst_alloc;
+			total_alloc += t1 - t0;
+			nb_alloc++;
+			if (((size_t)p & ((align ? align : 16) - 1)) != 0) {
+				fprintf(stderr, "tlsf returned a misaligned block\n");
+				failed = 1;
+			}
+			slot->ptr  = p;
+			slot->size = size;
+			slot->fill = (unsigned char)(i & 0xFF);
+			memset(p, slot->fill, size);
+		}
+	}
+
+	for (i = 0; i < TLSF_SLOTS; i++)
+		cop_falloc_free(&iface, slots[i].ptr);
+
+	if (cop_alloc_tlsf_used(&tlsf) != empty_used) {
+		fprintf(stderr, "tlsf did not coalesce all free blocks (%lu used)\n", (unsigned long)cop_alloc_tlsf_used(&tlsf));
+		failed = 1;
+	}
+	/* With everything merged, a block of most of the region should be
+	 * available again. Requests are rounded up to the next size class so
+	 * the whole region cannot be asked for. */
+	if ((p = cop_falloc(&iface, 3*1024*1024, 0)) == NULL) {
+		fprintf(stderr, "tlsf could not allocate the whole region after freeing everything\n");
+		failed = 1;
+	}
+	cop_falloc_free(&iface, p);
+	if (cop_falloc(&iface, 8*1024*1024, 0) != NULL) {
+		fprintf(stderr, "tlsf allocated more than the region\n");
+		failed = 1;
+	}
+
+	printf("tlsf latency: alloc worst %.0f ns mean %.1f ns, free worst %.0f ns mean %.1f ns\n", worst_alloc, total_alloc / (nb_alloc ? nb_alloc : 1), worst_free, total_free / (nb_free ? nb_free : 1));
+
+	cop_alloc_tlsf_free(&tlsf);
+	cop_alloc_virtual_free(&virt);
+	return failed ? -1 : 0;
+}
+
+#if COP_ALLOC_TRACE
+static int test_trace(void)
+{
+	static const struct cop_alloc_trace_event expected[] =
+		{{COP_ALLOC_TRACE_ALLOC,         100,    8, 0,   0}
+		,{COP_ALLOC_TRACE_SAVE,          0,      0, 0,   0}
+		,{COP_ALLOC_TRACE_ZALLOC,        300000, 64, 0,  0}
+		,{COP_ALLOC_TRACE_SAVE,          0,      0, 0,   1}
+		,{COP_ALLOC_TRACE_ALLOC,         10,     0, 0,   0}
+		,{COP_ALLOC_TRACE_EXTEND,        5000,   0, 10,  0}
+		,{COP_ALLOC_TRACE_RESTORE,       0,      0, 0,   1}
+		,{COP_ALLOC_TRACE_RESTORE,       0,      0, 0,   0}
+		,{COP_ALLOC_TRACE_RESTORE_START, 0,      0, 0,   0}
+		};
+	const char                  *filename = "cop_alloc_trace_test.bin";
+	struct cop_alloc_virtual     virt;
+	struct cop_alloc_trace       trace;
+	struct cop_salloc_iface      target;
+	struct cop_salloc_iface      iface;
+	struct cop_alloc_iface       aiface;
+	struct cop_filemap           map;
+	struct cop_alloc_trace_event ev;
+	size_t                       s1, s2;
+	size_t                       pos = 0;
+	size_t                       nb_saves = 0;
+	size_t                       nb = 0;
+	unsigned char               *p;
+	int                          err;
+	int                          failed = 0;
+
+	if (cop_alloc_virtual_init(&virt, &target, 16*1024*1024, 16, 64*1024))
+		abort();
+	if (cop_alloc_trace_open(&trace, &iface, &target, filename)) {
+		fprintf(stderr, "could not open trace\n");
+		cop_alloc_virtual_free(&virt);
+		return -1;
+	}
+	cop_salloc(&iface, 100, 8);
+	s1 = cop_salloc_save(&iface);
+	cop_salloc_zalloc(&iface, 300000, 64);
+	s2 = cop_salloc_save(&iface);
+	p = cop_salloc(&iface, 10, 0);
+	if (cop_salloc_extend(&iface, p, 10, 5000))
+		abort();
+	cop_salloc_restore(&iface, s2);
+	cop_salloc_restore(&iface, s1);
+	cop_salloc_restore(&iface, 0);
+	cop_alloc_trace_close(&trace);
+	cop_alloc_virtual_free(&virt);
+
+	if (cop_filemap_open(&map, filename, COP_FILEMAP_FLAG_R))
+		abort();
+	while ((err = cop_alloc_trace_decode(map.ptr, map.size, &pos, &nb_saves, &ev)) == 1) {
+		if (nb >= sizeof(expected) / sizeof(expected[0])) {
+			fprintf(stderr, "trace has too many events\n");
+			failed = 1;
+			break;
+		}
+		if (ev.type != expected[nb].type || ev.size != expected[nb].size || ev.align != expected[nb].align || ev.old_size != expected[nb].old_size || ev.save_id != expected[nb].save_id) {
+			fprintf(stderr, "trace event %lu did not match (type %u size %lu align %lu old %lu save %lu)\n", (unsigned long)nb, ev.type, (unsigned long)ev.size, (unsigned long)ev.align, (unsigned long)ev.old_size, (unsigned long)ev.save_id);
+			failed = 1;
+		}
+		nb++;
+	}
+	if (err != 0 || nb != sizeof(expected) / sizeof(expected[0]) || nb_saves != 2) {
+		fprintf(stderr, "trace decode ended with %d after %lu events and %lu saves\n", err, (unsigned long)nb, (unsigned long)nb_saves);
+		failed = 1;
+	}
+	cop_filemap_close(&map);
+	remove(filename);
+
+	/* Wrapping a general allocator interface records only allocations. */
+	if (cop_alloc_virtual_init(&virt, &target, 16*1024*1024, 16, 64*1024))
+		abort();
+	if (cop_alloc_trace_open_alloc(&trace, &aiface, &(target.iface), filename)) {
+		fprintf(stderr, "could not open trace\n");
+		cop_alloc_virtual_free(&virt);
+		return -1;
+	}
+	cop_alloc(&aiface, 24, 0);
+	cop_alloc(&aiface, 48, 32);
+	cop_alloc_trace_close(&trace);
+	cop_alloc_virtual_free(&virt);
+
+	if (cop_filemap_open(&map, filename, COP_FILEMAP_FLAG_R))
+		abort();
+	pos      = 0;
+	nb_saves = 0;
+	for (nb = 0; nb < 2; nb++)
+		if (cop_alloc_trace_decode(map.ptr, map.size, &pos, &nb_saves, &ev) != 1 || ev.type != COP_ALLOC_TRACE_ALLOC || ev.size != 24 * (nb + 1) || ev.align != 32 * nb)
+			break;
+	if (nb != 2 || cop_alloc_trace_decode(map.ptr, map.size, &pos, &nb_saves, &ev) != 0) {
+		fprintf(stderr, "general allocator trace did not match\n");
+		failed = 1;
+	}
+	cop_filemap_close(&map);
+	remove(filename);
+
+	return failed ? -1 : 0;
+}
+#endif
+
+int test_main(int argc, char *argv[]) {
+	int rflag = 0;
+
+#if !_WIN32
+	rflag |= test_tls_pool();
+#endif
+	rflag |= test_virtual_concurrent();
+	rflag |= test_slab(1);
+	rflag |= test_slab(0);
+	rflag |= test_virtual_hugepages();
+	rflag |= test_virtual_decommit();
+	rflag |= test_virtual_growth();
+	rflag |= test_stats();
+	rflag |= test_virtual_locked();
+	rflag |= test_grp_temps_cache();
+	rflag |= test_extend();
+	rflag |= test_tlsf();
+	rflag |= test_fast_paths();
+	rflag |= test_cpu_queries();
+	rflag |= test_mirror_ring();
+	rflag |= test_shared();
+	rflag |= test_snapshot();
+	rflag |= test_zalloc();
+	rflag |= test_budget();
+#if COP_ALLOC_TRACE
+	rflag |= test_trace();
+#endif
+
+	if (!rflag) {
+		fprintf(stdout, "alloc tests passed\n");
+	}
+
+	return (rflag) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+COP_MAIN(test_main)
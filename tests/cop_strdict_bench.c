@@ -0,0 +1,167 @@
+#include "cop/cop_main.h"
+#include "cop/cop_strdict.h"
+#include "cop/cop_alloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#if _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* Benchmark of dictionary lookups before and after compaction. The nodes of
+ * the initial dictionary are inserted in key order but placed in memory in a
+ * random order to model nodes which were allocated over a long time. This is
+ * not run as part of the test suite.
+ *
+ * Lookups are also made in batches using cop_strdict_get_multi() and for
+ * keys which do not exist. Build with the COP_STRDICT_PACKED CMake option to
+ * compare with the packed node layout.
+ *
+ * Usage: cop_strdict_bench [nb_keys] */
+
+#define DEFAULT_KEYS (1000000)
+#define KEY_LEN      (16)
+#define BATCH        (128)
+
+static double get_time_ns(void)
+{
+#if _WIN32
+	LARGE_INTEGER c, f;
+	QueryPerformanceCounter(&c);
+	QueryPerformanceFrequency(&f);
+	return c.QuadPart * (1e9 / f.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+static unsigned long rng(unsigned long *p_state)
+{
+	*p_state = (*p_state * 1103515245ul + 12345ul) & 0xFFFFFFFFul;
+	return *p_state >> 8;
+}
+
+static void shuffle(size_t *p_idx, size_t nb, unsigned long seed)
+{
+	size_t i;
+	for (i = 0; i < nb; i++)
+		p_idx[i] = i;
+	for (i = nb; i > 1; i--) {
+		size_t j   = ((size_t)rng(&seed) * 4096u + rng(&seed) % 4096u) % i;
+		size_t tmp = p_idx[i - 1];
+		p_idx[i - 1] = p_idx[j];
+		p_idx[j]     = tmp;
+	}
+}
+
+static volatile size_t sink;
+
+/* Look up every key in the order given by p_order and return ns/lookup.
+ * Every key must exist if hits is non-zero and none may exist otherwise. */
+static double bench_lookups(const struct cop_strdict_node *p_root, const struct cop_strh *p_keys, const size_t *p_order, size_t nb, int hits)
+{
+	double t0 = get_time_ns();
+	size_t i;
+	for (i = 0; i < nb; i++) {
+		void *p_data = NULL;
+		if (!cop_strdict_get(p_root, &(p_keys[p_order[i]]), &p_data) != !!hits)
+			abort();
+		sink += (size_t)p_data;
+	}
+	return (get_time_ns() - t0) / nb;
+}
+
+/* Look up the same keys BATCH at a time using cop_strdict_get_multi(). */
+static double bench_multi_lookups(const struct cop_strdict_node *p_root, const struct cop_strh *p_keys, const size_t *p_order, size_t nb)
+{
+	struct cop_strh batch[BATCH];
+	void           *values[BATCH];
+	double          t0 = get_time_ns();
+	size_t          i, j;
+	for (i = 0; i < nb; i += BATCH) {
+		size_t nb_batch = (nb - i < BATCH) ? (nb - i) : BATCH;
+		for (j = 0; j < nb_batch; j++)
+			batch[j] = p_keys[p_order[i + j]];
+		if (cop_strdict_get_multi(p_root, batch, nb_batch, values, NULL) != nb_batch)
+			abort();
+		sink += (size_t)values[0];
+	}
+	return (get_time_ns() - t0) / nb;
+}
+
+int test_main(int argc, char *argv[]) {
+	struct cop_alloc_virtual  mem;
+	struct cop_salloc_iface   iface;
+	size_t                    nb = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_KEYS;
+	char                     *p_strs;
+	char                     *p_miss_strs;
+	struct cop_strh          *p_keys;
+	struct cop_strh          *p_misses;
+	size_t                   *p_place;
+	size_t                   *p_order;
+	struct cop_strdict_node  *p_scattered;
+	struct cop_strdict_node  *p_compact;
+	struct cop_strdict_node  *p_root = cop_strdict_init();
+	size_t                    i;
+	double                    t0;
+
+	if (nb == 0 || cop_alloc_virtual_init(&mem, &iface, (size_t)1 << ((sizeof(size_t) > 4) ? 36 : 30), 64, 1024*1024))
+		abort();
+
+	p_strs      = cop_salloc(&iface, nb * KEY_LEN, 0);
+	p_miss_strs = cop_salloc(&iface, nb * KEY_LEN, 0);
+	p_keys      = cop_salloc(&iface, nb * sizeof(*p_keys), 0);
+	p_misses    = cop_salloc(&iface, nb * sizeof(*p_misses), 0);
+	p_place     = cop_salloc(&iface, nb * sizeof(*p_place), 0);
+	p_order     = cop_salloc(&iface, nb * sizeof(*p_order), 0);
+	p_scattered = cop_salloc(&iface, nb * sizeof(*p_scattered), 64);
+	p_compact   = cop_salloc(&iface, nb * sizeof(*p_compact), 64);
+	if (p_strs == NULL || p_miss_strs == NULL || p_keys == NULL || p_misses == NULL || p_place == NULL || p_order == NULL || p_scattered == NULL || p_compact == NULL)
+		abort();
+
+	for (i = 0; i < nb; i++) {
+		sprintf(p_strs + i * KEY_LEN, "key%lu", (unsigned long)i);
+		cop_strh_init_shallow(&(p_keys[i]), p_strs + i * KEY_LEN);
+		sprintf(p_miss_strs + i * KEY_LEN, "miss%lu", (unsigned long)i);
+		cop_strh_init_shallow(&(p_misses[i]), p_miss_strs + i * KEY_LEN);
+	}
+	shuffle(p_place, nb, 1);
+	shuffle(p_order, nb, 2);
+
+	for (i = 0; i < nb; i++) {
+		struct cop_strdict_node *p_node = &(p_scattered[p_place[i]]);
+		cop_strdict_node_init(p_node, &(p_keys[i]), p_node);
+		if (cop_strdict_insert(&p_root, p_node))
+			abort();
+	}
+
+	printf("%lu keys, %s node layout (%lu bytes)\n", (unsigned long)nb, COP_STRDICT_NODE_ALIGN ? "packed" : "default", (unsigned long)sizeof(struct cop_strdict_node));
+	printf("scattered nodes:    %8.2f ns/lookup\n", bench_lookups(p_root, p_keys, p_order, nb, 1));
+	printf("  misses:           %8.2f ns/lookup\n", bench_lookups(p_root, p_misses, p_order, nb, 0));
+	printf("  batched:          %8.2f ns/lookup\n", bench_multi_lookups(p_root, p_keys, p_order, nb));
+
+	t0 = get_time_ns();
+	if (cop_strdict_compact(&p_root, p_compact, COP_STRDICT_LAYOUT_BFS, &iface))
+		abort();
+	printf("compact (bfs):      %8.2f ns/lookup (compaction took %.2f ms)\n", bench_lookups(p_root, p_keys, p_order, nb, 1), (get_time_ns() - t0) / 1e6);
+
+	t0 = get_time_ns();
+	if (cop_strdict_compact(&p_root, p_compact, COP_STRDICT_LAYOUT_VEB, &iface))
+		abort();
+	printf("compact (veb):      %8.2f ns/lookup (compaction took %.2f ms)\n", bench_lookups(p_root, p_keys, p_order, nb, 1), (get_time_ns() - t0) / 1e6);
+
+	t0 = get_time_ns();
+	if (cop_strdict_build(&p_root, p_scattered, p_keys, NULL, nb, COP_STRDICT_LAYOUT_VEB, &iface))
+		abort();
+	printf("bulk build (veb):   %8.2f ns/lookup (build took %.2f ms)\n", bench_lookups(p_root, p_keys, p_order, nb, 1), (get_time_ns() - t0) / 1e6);
+	printf("  misses:           %8.2f ns/lookup\n", bench_lookups(p_root, p_misses, p_order, nb, 0));
+	printf("  batched:          %8.2f ns/lookup\n", bench_multi_lookups(p_root, p_keys, p_order, nb));
+
+	cop_alloc_virtual_free(&mem);
+	return 0;
+}
+
+COP_MAIN(test_main)
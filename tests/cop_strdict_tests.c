@@ -1,6 +1,7 @@
 #include "cop/cop_main.h"
 #include "cop/cop_strdict.h"
 #include "cop/cop_alloc.h"
+#include "cop/cop_thread.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -8,7 +9,7 @@
 
 struct cop_strdict_node *make_node(struct cop_salloc_iface *iface, const char *p_id) {
 	size_t                   sl    = strlen(p_id) + 1;
-	struct cop_strdict_node *p_ret = cop_salloc(iface, sizeof(struct cop_strdict_node) + sl, 0);
+	struct cop_strdict_node *p_ret = cop_salloc(iface, sizeof(struct cop_strdict_node) + sl, COP_STRDICT_NODE_ALIGN);
 	if (p_ret == NULL) {
 		fprintf(stderr, "out of memory\n");
 		abort();
@@ -96,6 +97,48 @@ int expect_update(struct cop_strdict_node **pp_root, const char *p_key) {
 	return 0;
 }
 
+#if COP_STRDICT_PACKED
+/* Must match the tag stored in the summaries by libcop/cop_strdict.c. */
+static unsigned expected_tag(uint_fast64_t key) {
+	return (unsigned)(((((key ^ (key >> 16)) & 0xFFFFFFFFu) * 2654435761u) & 0xFFFFFFFFu) >> 20);
+}
+#endif
+
+/* Check that the inline child summaries of packed nodes describe the
+ * children. */
+int expect_summaries(const struct cop_strdict_node *p_node) {
+#if COP_STRDICT_PACKED
+	unsigned i, j;
+	if (p_node == NULL)
+		return 0;
+	if (sizeof(*p_node) != 64 || ((size_t)p_node & 63u)) {
+		fprintf(stderr, "expected packed nodes to be 64 byte aligned cache lines\n");
+		return -1;
+	}
+	for (i = 0; i < COP_STRDICT_CHID_NB; i++) {
+		const struct cop_strdict_node *p_kid = p_node->kids[i];
+		unsigned                       occ   = 0;
+		if (p_kid != NULL)
+			for (j = 0; j < COP_STRDICT_CHID_NB; j++)
+				if (p_kid->kids[j] != NULL)
+					occ |= 1u << j;
+		if ((p_kid == NULL && p_node->summaries[i] != 0) || (p_node->summaries[i] & 0xFu) != occ) {
+			fprintf(stderr, "node %s has a stale summary for child %u\n", p_node->key_data, i);
+			return -1;
+		}
+		if (p_kid != NULL && (unsigned)(p_node->summaries[i] >> COP_STRDICT_CHID_NB) != expected_tag(p_kid->key)) {
+			fprintf(stderr, "node %s has the wrong tag for child %u\n", p_node->key_data, i);
+			return -1;
+		}
+		if (expect_summaries(p_kid))
+			return -1;
+	}
+#else
+	(void)p_node;
+#endif
+	return 0;
+}
+
 static int enumfn(void *p_context, struct cop_strdict_node *p_node, int depth) {
 	printf("%*s%s\n", depth*2, "", p_node->key_data);
 	return 0;
@@ -205,9 +248,343 @@ int runtests(struct cop_salloc_iface *iface) {
 
 	//cop_strdict_enumerate(&p_root, enumfn, NULL);
 
+	return expect_summaries(p_root);
+}
+
+#define BUILD_KEYS (1000)
+
+int expect_all_keys(struct cop_strdict_node *p_root, char (*p_keys)[16], unsigned nb) {
+	unsigned i;
+	char    *val;
+	if (cop_strdict_count(p_root) != nb) {
+		fprintf(stderr, "expected %u nodes but found %lu\n", nb, (unsigned long)cop_strdict_count(p_root));
+		return -1;
+	}
+	for (i = 0; i < nb; i++) {
+		if (cop_strdict_get_by_cstr(p_root, p_keys[i], (void **)&val) || val != p_keys[i]) {
+			fprintf(stderr, "expected to find key %s with its own data after building\n", p_keys[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int compacttests(struct cop_salloc_iface *iface) {
+	char                   (*p_keys)[16] = cop_salloc(iface, sizeof(*p_keys) * (BUILD_KEYS + 1), 0);
+	struct cop_strh         *p_strh      = cop_salloc(iface, sizeof(*p_strh) * BUILD_KEYS, 0);
+	void                   **pp_data     = cop_salloc(iface, sizeof(*pp_data) * BUILD_KEYS, 0);
+	struct cop_strdict_node *p_nodes     = cop_salloc(iface, sizeof(*p_nodes) * BUILD_KEYS, COP_STRDICT_NODE_ALIGN);
+	struct cop_strdict_node *p_root      = cop_strdict_init();
+	struct cop_strdict_node *p_built;
+	unsigned                 i, j;
+
+	for (i = 0; i <= BUILD_KEYS; i++)
+		makekey(p_keys[i], i);
+	for (i = 0; i < BUILD_KEYS; i++) {
+		cop_strh_init_shallow(&(p_strh[i]), p_keys[i]);
+		pp_data[i] = p_keys[i];
+	}
+
+	/* Bulk build in breadth-first order. Every child must come after its
+	 * parent. */
+	if (cop_strdict_build(&p_built, p_nodes, p_strh, pp_data, BUILD_KEYS, COP_STRDICT_LAYOUT_BFS, iface)) {
+		fprintf(stderr, "expected cop_strdict_build to succeed\n");
+		return -1;
+	}
+	if (p_built != p_nodes || expect_all_keys(p_built, p_keys, BUILD_KEYS) || expect_removed(&p_built, p_keys[BUILD_KEYS]))
+		return -1;
+	for (i = 0; i < BUILD_KEYS; i++)
+		for (j = 0; j < COP_STRDICT_CHID_NB; j++)
+			if (p_nodes[i].kids[j] != NULL && p_nodes[i].kids[j] <= &(p_nodes[i])) {
+				fprintf(stderr, "node %u has a child which is not after it in breadth-first order\n", i);
+				return -1;
+			}
+
+	/* Re-layout within the same array and check it still works as a normal
+	 * dictionary. */
+	if (cop_strdict_compact(&p_built, p_nodes, COP_STRDICT_LAYOUT_VEB, iface)) {
+		fprintf(stderr, "expected cop_strdict_compact to succeed in place\n");
+		return -1;
+	}
+	if (expect_all_keys(p_built, p_keys, BUILD_KEYS))
+		return -1;
+	for (i = 10; i < 20; i++)
+		if (expect_delete_ok(&p_built, p_keys[i]) || expect_removed(&p_built, p_keys[i]))
+			return -1;
+	for (i = 0; i < 10; i++)
+		if (expect_exists(&p_built, p_keys[i]))
+			return -1;
+	for (i = 20; i < BUILD_KEYS; i++)
+		if (expect_exists(&p_built, p_keys[i]))
+			return -1;
+	if (expect_summaries(p_built))
+		return -1;
+
+	/* Duplicate keys are rejected. */
+	p_strh[BUILD_KEYS - 1] = p_strh[0];
+	p_root = p_built;
+	if (!cop_strdict_build(&p_built, p_nodes, p_strh, pp_data, BUILD_KEYS, COP_STRDICT_LAYOUT_BFS, iface) || p_built != p_root) {
+		fprintf(stderr, "expected cop_strdict_build to fail with a duplicate key\n");
+		return -1;
+	}
+
+	/* Compact a dictionary of individually allocated nodes. */
+	p_root = cop_strdict_init();
+	for (i = 0; i < BUILD_KEYS; i++)
+		if (cop_strdict_insert(&p_root, make_node(iface, p_keys[i])))
+			return -1;
+	if (cop_strdict_compact(&p_root, p_nodes, COP_STRDICT_LAYOUT_VEB, iface) || p_root != p_nodes || cop_strdict_count(p_root) != BUILD_KEYS) {
+		fprintf(stderr, "expected cop_strdict_compact to succeed\n");
+		return -1;
+	}
+	for (i = 0; i < BUILD_KEYS; i++)
+		if (expect_update(&p_root, p_keys[i]))
+			return -1;
+
+	return expect_summaries(p_root);
+}
+
+#define MULTI_KEYS (300)
+
+int multitests(struct cop_salloc_iface *iface) {
+	char                   (*p_keys)[16] = cop_salloc(iface, sizeof(*p_keys) * MULTI_KEYS, 0);
+	struct cop_strh         *p_strh      = cop_salloc(iface, sizeof(*p_strh) * MULTI_KEYS, 0);
+	void                   **pp_values   = cop_salloc(iface, sizeof(*pp_values) * MULTI_KEYS, 0);
+	unsigned char           *p_found     = cop_salloc(iface, MULTI_KEYS, 0);
+	struct cop_strdict_node *p_root      = cop_strdict_init();
+	unsigned                 i;
+	size_t                   nb_found;
+
+	/* Insert every third key. */
+	for (i = 0; i < MULTI_KEYS; i++) {
+		makekey(p_keys[i], i);
+		cop_strh_init_shallow(&(p_strh[i]), p_keys[i]);
+		if (i % 3 == 0 && expect_insert_ok(&p_root, make_node(iface, p_keys[i])))
+			return -1;
+	}
+
+	if (cop_strdict_get_multi(p_root, p_strh, 0, pp_values, p_found) != 0 || cop_strdict_get_multi(NULL, p_strh, 5, NULL, NULL) != 0) {
+		fprintf(stderr, "expected cop_strdict_get_multi to find nothing\n");
+		return -1;
+	}
+
+	memset(p_found, 0xFF, MULTI_KEYS);
+	nb_found = cop_strdict_get_multi(p_root, p_strh, MULTI_KEYS, pp_values, p_found);
+	if (nb_found != (MULTI_KEYS + 2) / 3) {
+		fprintf(stderr, "expected cop_strdict_get_multi to find %u keys but it found %lu\n", (MULTI_KEYS + 2) / 3, (unsigned long)nb_found);
+		return -1;
+	}
+	for (i = 0; i < MULTI_KEYS; i++) {
+		if (i % 3 == 0 && (p_found[i] != 1 || pp_values[i] == NULL || strcmp(pp_values[i], p_keys[i]))) {
+			fprintf(stderr, "expected cop_strdict_get_multi to find %s\n", p_keys[i]);
+			return -1;
+		}
+		if (i % 3 != 0 && (p_found[i] != 0 || pp_values[i] != NULL)) {
+			fprintf(stderr, "expected cop_strdict_get_multi to not find %s\n", p_keys[i]);
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
+struct create_context {
+	struct cop_salloc_iface *iface;
+	unsigned                 nb_calls;
+	int                      fail;
+};
+
+static struct cop_strdict_node *create_node(void *p_context, const struct cop_strh *p_key) {
+	struct create_context *p_ctx = p_context;
+	p_ctx->nb_calls++;
+	if (p_ctx->fail)
+		return NULL;
+	return make_node(p_ctx->iface, (const char *)p_key->ptr);
+}
+
+int upserttests(struct cop_salloc_iface *iface) {
+	struct cop_strdict_node *p_root = cop_strdict_init();
+	struct cop_strdict_node *p_node;
+	struct cop_strdict_node *p_dup;
+	struct create_context    ctx;
+	struct cop_strh          key;
+	char                     keystr[32];
+	unsigned                 i;
+	int                      created;
+
+	for (i = 0; i < ALLOCATIONS; i++) {
+		makekey(keystr, i);
+		p_node = make_node(iface, keystr);
+		if (cop_strdict_find_or_insert(&p_root, p_node) != p_node) {
+			fprintf(stderr, "expected cop_strdict_find_or_insert to insert %s\n", keystr);
+			return -1;
+		}
+		p_dup = make_node(iface, keystr);
+		if (cop_strdict_find_or_insert(&p_root, p_dup) != p_node) {
+			fprintf(stderr, "expected cop_strdict_find_or_insert to find %s\n", keystr);
+			return -1;
+		}
+	}
+	if (cop_strdict_count(p_root) != ALLOCATIONS) {
+		fprintf(stderr, "expected cop_strdict_find_or_insert to not insert duplicates\n");
+		return -1;
+	}
+
+	/* The callback is only used when a key does not exist. */
+	ctx.iface    = iface;
+	ctx.nb_calls = 0;
+	ctx.fail     = 0;
+	for (i = 0; i < 2 * ALLOCATIONS; i++) {
+		makekey(keystr, i);
+		cop_strh_init_shallow(&key, keystr);
+		p_node = cop_strdict_find_or_create(&p_root, &key, create_node, &ctx, &created);
+		if (p_node == NULL || created != (i >= ALLOCATIONS) || strcmp(cop_strdict_node_to_data(p_node), keystr)) {
+			fprintf(stderr, "cop_strdict_find_or_create gave the wrong result for %s\n", keystr);
+			return -1;
+		}
+	}
+	if (ctx.nb_calls != ALLOCATIONS || cop_strdict_count(p_root) != 2 * ALLOCATIONS) {
+		fprintf(stderr, "expected the create callback to be called %u times (was %u)\n", ALLOCATIONS, ctx.nb_calls);
+		return -1;
+	}
+	for (i = 0; i < 2 * ALLOCATIONS; i++) {
+		makekey(keystr, i);
+		if (expect_exists(&p_root, keystr))
+			return -1;
+	}
+
+	/* A failing callback leaves the dictionary alone. */
+	ctx.fail = 1;
+	makekey(keystr, 2 * ALLOCATIONS);
+	cop_strh_init_shallow(&key, keystr);
+	if (cop_strdict_find_or_create(&p_root, &key, create_node, &ctx, &created) != NULL || created || expect_removed(&p_root, keystr) || cop_strdict_count(p_root) != 2 * ALLOCATIONS) {
+		fprintf(stderr, "expected cop_strdict_find_or_create to fail when the callback fails\n");
+		return -1;
+	}
+
+	return expect_summaries(p_root);
+}
+
+#define RCU_STABLE_KEYS   (256)
+#define RCU_VOLATILE_KEYS (256)
+#define RCU_READERS       (3)
+#define RCU_WRITER_OPS    (20000)
+
+struct rcu_test {
+	struct cop_strdict_rcu   rcu;
+	char                     keys[RCU_STABLE_KEYS + RCU_VOLATILE_KEYS][16];
+	struct cop_strdict_node  nodes[RCU_STABLE_KEYS + RCU_VOLATILE_KEYS];
+	size_t                   stop;
+	size_t                   failed;
+};
+
+static void *rcu_reader(void *argument) {
+	struct rcu_test              *p_test = argument;
+	struct cop_strdict_rcu_reader reader;
+	unsigned                      i = 0;
+	cop_strdict_rcu_reader_register(&(p_test->rcu), &reader);
+	while (!cop_atomic_size_load(&(p_test->stop))) {
+		struct cop_strh key;
+		void           *p_val;
+		unsigned        k = i++ % RCU_STABLE_KEYS;
+		cop_strh_init_shallow(&key, p_test->keys[k]);
+		if (cop_strdict_rcu_get(&reader, &key, &p_val) || p_val != p_test->keys[k]) {
+			cop_atomic_size_store(&(p_test->failed), 1);
+			break;
+		}
+		/* Volatile keys may or may not exist but must have the right data
+		 * if they do. */
+		k = RCU_STABLE_KEYS + (i * 7u) % RCU_VOLATILE_KEYS;
+		cop_strh_init_shallow(&key, p_test->keys[k]);
+		if (!cop_strdict_rcu_get(&reader, &key, &p_val) && p_val != p_test->keys[k]) {
+			cop_atomic_size_store(&(p_test->failed), 1);
+			break;
+		}
+	}
+	cop_strdict_rcu_reader_unregister(&reader);
+	return NULL;
+}
+
+/* Static so that packed nodes get their alignment. */
+static struct rcu_test rcu_state;
+
+int rcutests(void) {
+	struct rcu_test *p_test = &rcu_state;
+	cop_thread       threads[RCU_READERS];
+	char             present[RCU_VOLATILE_KEYS];
+	unsigned long    x = 1;
+	struct cop_strh  key;
+	unsigned         i;
+	int              failed = 0;
+
+	if (cop_strdict_rcu_init(&(p_test->rcu)))
+		abort();
+	p_test->stop   = 0;
+	p_test->failed = 0;
+	for (i = 0; i < RCU_STABLE_KEYS + RCU_VOLATILE_KEYS; i++) {
+		makekey(p_test->keys[i], i);
+		cop_strdict_node_init_by_cstr(&(p_test->nodes[i]), p_test->keys[i], p_test->keys[i]);
+		if (cop_strdict_rcu_insert(&(p_test->rcu), &(p_test->nodes[i])))
+			abort();
+		if (i >= RCU_STABLE_KEYS)
+			present[i - RCU_STABLE_KEYS] = 1;
+	}
+
+	for (i = 0; i < RCU_READERS; i++)
+		if (cop_thread_create(&(threads[i]), rcu_reader, p_test, 0, 0))
+			abort();
+
+	/* Randomly delete and re-insert the volatile keys. Deleted nodes are
+	 * trashed once readers are done with them. */
+	for (i = 0; i < RCU_WRITER_OPS && !cop_atomic_size_load(&(p_test->failed)); i++) {
+		unsigned                 k;
+		struct cop_strdict_node *p_node;
+		x = (x * 1103515245ul + 12345ul) & 0xFFFFFFFFul;
+		k = (x >> 8) % RCU_VOLATILE_KEYS;
+		cop_strh_init_shallow(&key, p_test->keys[RCU_STABLE_KEYS + k]);
+		if (present[k]) {
+			if ((p_node = cop_strdict_rcu_delete(&(p_test->rcu), &key)) != &(p_test->nodes[RCU_STABLE_KEYS + k])) {
+				fprintf(stderr, "cop_strdict_rcu_delete returned the wrong node\n");
+				failed = 1;
+				break;
+			}
+			cop_strdict_rcu_synchronize(&(p_test->rcu));
+			memset(p_node, 0xA5, sizeof(*p_node));
+			present[k] = 0;
+		} else {
+			cop_strdict_node_init_by_cstr(&(p_test->nodes[RCU_STABLE_KEYS + k]), p_test->keys[RCU_STABLE_KEYS + k], p_test->keys[RCU_STABLE_KEYS + k]);
+			if (cop_strdict_rcu_insert(&(p_test->rcu), &(p_test->nodes[RCU_STABLE_KEYS + k]))) {
+				fprintf(stderr, "cop_strdict_rcu_insert failed\n");
+				failed = 1;
+				break;
+			}
+			present[k] = 1;
+		}
+	}
+
+	cop_atomic_size_store(&(p_test->stop), 1);
+	for (i = 0; i < RCU_READERS; i++)
+		cop_thread_join(threads[i], NULL);
+	if (p_test->failed) {
+		fprintf(stderr, "a reader did not find a key which was never deleted\n");
+		failed = 1;
+	}
+
+	/* The writer view must agree with what was done. */
+	for (i = 0; i < RCU_STABLE_KEYS + RCU_VOLATILE_KEYS && !failed; i++) {
+		struct cop_strdict_node *p_root = cop_strdict_rcu_root(&(p_test->rcu));
+		int                      exists = (i < RCU_STABLE_KEYS) || present[i - RCU_STABLE_KEYS];
+		if (exists ? expect_exists(&p_root, p_test->keys[i]) : expect_removed(&p_root, p_test->keys[i]))
+			failed = 1;
+	}
+	cop_strh_init_shallow(&key, p_test->keys[0]);
+	if (!failed && (cop_strdict_rcu_update(&(p_test->rcu), &key, NULL) || expect_summaries(cop_strdict_rcu_root(&(p_test->rcu)))))
+		failed = 1;
+
+	cop_strdict_rcu_destroy(&(p_test->rcu));
+	return failed ? -1 : 0;
+}
+
 int test_main(int argc, char *argv[]) {
 	struct cop_alloc_virtual mem;
 	struct cop_salloc_iface  iface;
@@ -217,6 +594,10 @@ int test_main(int argc, char *argv[]) {
 		abort();
 
 	rflag = runtests(&iface);
+	rflag |= compacttests(&iface);
+	rflag |= multitests(&iface);
+	rflag |= upserttests(&iface);
+	rflag |= rcutests();
 
 	cop_alloc_virtual_free(&mem);
 